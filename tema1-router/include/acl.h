@@ -0,0 +1,76 @@
+#ifndef ACL_H
+#define ACL_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Stateless ACL, classified with tuple space search: the rules are grouped
+ * by their combination of masks (a tuple), and every tuple has a hash table
+ * of its rules keyed by the masked fields. A packet is classified with one
+ * hash probe per tuple; the tuples are ordered by the best priority they
+ * hold, so the search stops as soon as no remaining tuple can do better.
+ * Port ranges are split into prefixes, so every rule is a set of masks.
+ *
+ * Rules file, one rule per line, a lower priority number wins:
+ *	priority permit|deny src/len dst/len proto sport dport
+ * proto is any, icmp, tcp, udp or a number, ports are *, a port or lo-hi:
+ *	10 deny 10.0.0.0/8 192.168.1.0/24 tcp * 22
+ *	20 permit 0.0.0.0/0 0.0.0.0/0 any * *
+ */
+
+enum acl_action {
+	ACL_PERMIT,
+	ACL_DENY,
+};
+
+struct acl_rule {
+	uint32_t priority;
+	enum acl_action action;
+	uint32_t src, src_mask;		/* network order */
+	uint32_t dst, dst_mask;		/* network order */
+	uint8_t proto, proto_mask;
+	uint16_t sport_lo, sport_hi;	/* host order */
+	uint16_t dport_lo, dport_hi;	/* host order */
+	uint64_t hits;
+};
+
+/* hash table slot, rule is -1 for an empty slot */
+struct acl_entry {
+	uint32_t src;
+	uint32_t dst;
+	uint32_t ports;
+	uint8_t proto;
+	int32_t rule;
+};
+
+struct acl_tuple {
+	uint32_t src_mask;
+	uint32_t dst_mask;
+	uint32_t ports_mask;	/* sport mask << 16 | dport mask */
+	uint8_t proto_mask;
+	uint32_t best_priority;
+	struct acl_entry *table;
+	uint32_t size;		/* power of two */
+	uint32_t used;
+};
+
+struct acl {
+	struct acl_rule *rules;
+	int rule_count;
+	struct acl_tuple *tuples;
+	int tuple_count;
+};
+
+/* load and compile the rules of a file */
+extern struct acl *acl_load(const char *path);
+
+/* return the index of the best rule matching the packet, -1 if none;
+ * addresses in network order, ports in host order */
+extern int acl_classify(struct acl *acl, uint32_t src, uint32_t dst, uint8_t proto,
+			uint16_t sport, uint16_t dport);
+
+/* print the rules that had hits */
+extern void acl_dump(struct acl *acl, FILE *f);
+
+#endif
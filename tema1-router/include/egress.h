@@ -0,0 +1,80 @@
+#ifndef EGRESS_H
+#define EGRESS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+struct pool_set;
+
+/*
+ * Per-interface egress queues. A frame is written to its link right away
+ * while the link keeps up; once a write would block, the frames of that
+ * link are copied into per-class queues and drained by a deficit
+ * round-robin scheduler when the link becomes writable again, so a
+ * congested port never stalls the others.
+ *
+ * Every class gets a quantum of weight * EGRESS_QUANTUM_UNIT bytes per
+ * round, so it receives a share of the link proportional to its weight.
+ */
+
+#define EGRESS_CLASSES 4
+#define EGRESS_QUEUE_LEN 512		/* frames per class */
+#define EGRESS_QUANTUM_UNIT 1514	/* bytes, one full Ethernet frame */
+
+enum egress_class_id {
+	EGRESS_CONTROL,		/* CS6, CS7, ARP, neighbour discovery */
+	EGRESS_INTERACTIVE,	/* EF, CS4, CS5, AF4x */
+	EGRESS_BEST_EFFORT,
+	EGRESS_BULK,		/* CS1, LE */
+};
+
+struct egress_frame {
+	char *data;
+	uint32_t len;
+};
+
+struct egress_class {
+	struct egress_frame ring[EGRESS_QUEUE_LEN];
+	uint32_t head;
+	uint32_t count;
+	uint32_t quantum;
+	uint32_t deficit;
+	uint32_t max_depth;
+	uint64_t sent;
+	uint64_t dropped;
+};
+
+struct egress_port {
+	struct egress_class classes[EGRESS_CLASSES];
+	int current;		/* class holding the round-robin turn */
+	int turn_started;	/* current already got its quantum this turn */
+	uint32_t backlog;	/* frames queued over all classes */
+};
+
+struct egress {
+	int num_ports;
+	struct egress_port *ports;
+	struct pool_set *buffers;
+};
+
+/* create the queues of num_ports links, with the weight of every class
+ * (at least 1), taking the copies of the queued frames from buffers */
+extern struct egress *egress_create(int num_ports, const uint32_t *weights, struct pool_set *buffers);
+
+/* class of a DSCP value */
+extern int egress_dscp_class(uint8_t dscp);
+
+/* send a frame on a link, or queue a copy of it if the link is busy;
+ * returns -1 if the frame was dropped */
+extern int egress_send(struct egress *e, int port, char *frame, size_t len, int class_id);
+
+/* drain the queues into the links, as far as they take frames */
+extern void egress_run(struct egress *e);
+
+/* mask of the links with queued frames */
+extern unsigned int egress_backlog_mask(struct egress *e);
+
+/* print the depth and the counters of every class */
+extern void egress_dump(struct egress *e, FILE *out);
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef FIB4_H
+#define FIB4_H
+
+#include <stdint.h>
+
+/*
+ * IPv4 prefix table that can be updated one prefix at a time. All the
+ * prefixes live in one open addressing hash table keyed by (prefix,
+ * length); a bitmap tells which lengths are present, and a longest prefix
+ * match probes the present lengths from the longest down. Inserting,
+ * changing or removing a prefix touches only its own slot, so the table is
+ * never rebuilt.
+ *
+ * Prefixes and addresses are in host order.
+ */
+
+struct fib4_slot {
+	uint32_t prefix;
+	uint8_t len;
+	uint8_t in_use;
+	int32_t value;
+};
+
+struct fib4 {
+	struct fib4_slot *slots;
+	uint32_t mask;
+	uint32_t count;
+	uint32_t len_count[33];
+	uint64_t lengths;	/* bit len set if a prefix of that length exists */
+};
+
+/* create a table for up to size prefixes */
+extern struct fib4 *fib4_create(uint32_t size);
+
+/* add the prefix or change its value; returns -1 if the table is full */
+extern int fib4_set(struct fib4 *f, uint32_t prefix, int len, int32_t value);
+
+/* remove the prefix, if present */
+extern void fib4_delete(struct fib4 *f, uint32_t prefix, int len);
+
+/* the value of exactly this prefix, -1 if absent */
+extern int32_t fib4_find(struct fib4 *f, uint32_t prefix, int len);
+
+/* the value of the longest prefix matching addr, -1 if none does */
+extern int32_t fib4_lookup(struct fib4 *f, uint32_t addr);
+
+#endif
@@ -0,0 +1,91 @@
+#ifndef FLOW_H
+#define FLOW_H
+
+#include <stdint.h>
+
+/*
+ * Sampled flow accounting. One packet in about every `sampling` ones is
+ * accounted in a table of flows keyed by 5-tuple and ingress interface;
+ * flows idle for FLOW_INACTIVE_MS, or active for FLOW_ACTIVE_MS, are
+ * exported to a collector as IPFIX (RFC 7011) messages, batched up to
+ * FLOW_MAX_RECORDS records per message. The template is sent with the
+ * first message and every FLOW_TEMPLATE_EVERY messages after it.
+ *
+ * The decision to sample is a countdown kept inline, so packets that are
+ * not sampled cost a decrement and a branch. The countdown restarts from a
+ * random interval averaging `sampling`, so periodic traffic is not
+ * sampled in lockstep.
+ */
+
+#define FLOW_INACTIVE_MS 15000
+#define FLOW_ACTIVE_MS 60000
+#define FLOW_MAX_RECORDS 25
+#define FLOW_TEMPLATE_EVERY 20
+#define FLOW_TEMPLATE_ID 256
+
+struct flow_key {
+	uint32_t saddr;		/* network order */
+	uint32_t daddr;		/* network order */
+	uint16_t sport;		/* network order */
+	uint16_t dport;		/* network order */
+	uint8_t proto;
+	uint8_t ingress;
+	uint16_t pad;		/* zero, keys are compared as bytes */
+};
+
+struct flow_record {
+	struct flow_key key;
+	uint32_t hash;
+	uint32_t in_use;
+	uint64_t packets;
+	uint64_t bytes;
+	uint64_t first_ms;
+	uint64_t last_ms;
+};
+
+struct flow_table {
+	uint32_t sampling;
+	uint32_t countdown;
+	uint32_t rng;
+	struct flow_record *records;
+	uint32_t mask;
+	uint32_t active;
+	uint32_t sweep_cursor;
+	int fd;			/* collector socket or file */
+	uint32_t sequence;	/* records exported so far */
+	uint32_t messages;
+	int batch_count;
+	uint8_t batch[1400];
+	int batch_len;
+	uint64_t sampled;
+	uint64_t exported;
+	uint64_t dropped;	/* samples lost to a full table */
+};
+
+/* create a table of size flows (a power of two) sampling 1 in sampling
+ * packets */
+extern struct flow_table *flow_create(uint32_t sampling, uint32_t size);
+
+/* export to "ip:port" over UDP, or else append to the file at that path */
+extern void flow_set_collector(struct flow_table *t, const char *collector);
+
+extern uint32_t flow_next_interval(struct flow_table *t);
+
+/* tell whether to sample the current packet */
+static inline int flow_sample(struct flow_table *t)
+{
+	if (--t->countdown != 0)
+		return 0;
+	t->countdown = flow_next_interval(t);
+	return 1;
+}
+
+/* account a sampled packet of bytes bytes to its flow */
+extern void flow_account(struct flow_table *t, const struct flow_key *key, uint32_t bytes,
+			 uint64_t now_ms);
+
+/* export the expired flows among the next budget ones of the sweep, then
+ * send the pending batch */
+extern void flow_expire(struct flow_table *t, uint64_t now_ms, uint32_t budget);
+
+#endif
@@ -0,0 +1,25 @@
+#ifndef HUGEPAGE_H
+#define HUGEPAGE_H
+
+#include <stddef.h>
+
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+/* How a region ended up being backed. */
+enum huge_backing {
+	HUGE_BACKING_HUGETLB,	/* explicit 2 MB pages, MAP_HUGETLB */
+	HUGE_BACKING_THP,	/* transparent huge pages, madvise(MADV_HUGEPAGE) */
+	HUGE_BACKING_SMALL,	/* regular pages */
+};
+
+/* use regular pages for all the following allocations */
+extern void huge_disable(void);
+
+/* allocate size zeroed bytes, from 2 MB pages if possible; the page size
+ * actually used is reported on stderr, tagged with name */
+extern void *huge_alloc(size_t size, const char *name);
+
+/* release a region returned by huge_alloc() */
+extern void huge_free(void *addr, size_t size);
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Latency histogram with log-linear buckets: every power of two is split
+ * into LATENCY_SUB_BUCKETS buckets, so percentiles are within 12.5% of the
+ * recorded values over the whole nanosecond to second range, recording is
+ * a few instructions and the histogram has a fixed size.
+ */
+
+#define LATENCY_SUB_BITS 3
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BITS)
+#define LATENCY_BUCKETS (64 * LATENCY_SUB_BUCKETS)
+
+struct latency_hist {
+	uint64_t buckets[LATENCY_BUCKETS];
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+};
+
+/* current time in the clock of the kernel receive timestamps */
+extern uint64_t latency_now_ns(void);
+
+/* record a latency, in nanoseconds */
+extern void latency_record(struct latency_hist *h, uint64_t ns);
+
+/* the latency below which fraction p of the recorded ones are */
+extern uint64_t latency_percentile(struct latency_hist *h, double p);
+
+/* print the count, mean, percentiles and maximum, in microseconds */
+extern void latency_dump(struct latency_hist *h, const char *name, FILE *out);
+
+/* forget the recorded latencies */
+extern void latency_reset(struct latency_hist *h);
+
+#endif
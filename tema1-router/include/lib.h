@@ -5,12 +5,26 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <netinet/in.h>
 
 #define MAX_PACKET_LEN 1600
+/* Bytes a frame adds to its MTU: ETHERNET header, one VLAN tag and the FCS. */
+#define FRAME_OVERHEAD 22
+/* Largest MTU an interface can be given, and the frame it allows. */
+#define MAX_JUMBO_MTU 9216
+#define MAX_JUMBO_FRAME_LEN (MAX_JUMBO_MTU + FRAME_OVERHEAD)
 #define ROUTER_NUM_INTERFACES 3
 
 int send_to_link(int interface, char *frame_data, size_t length);
 
+/*
+ * @brief Same as send_to_link(), but never blocks.
+ *
+ * Returns: the number of bytes sent, -1 if the link cannot take the frame
+ * right now.
+ */
+int try_send_to_link(int interface, char *frame_data, size_t length);
+
 /*
  * @brief Receives a packet. Blocking function, blocks if there is no packet to
  * be received.
@@ -22,6 +36,72 @@ int send_to_link(int interface, char *frame_data, size_t length);
  */
 int recv_from_any_link(char *frame_data, size_t *length);
 
+/*
+ * @brief Same as recv_from_any_link(), but waits at most timeout_ms
+ * milliseconds. A negative timeout blocks until a packet arrives.
+ *
+ * Returns: the interface the packet has been received from, -1 if the
+ * timeout expired first.
+ */
+int recv_from_any_link_timeout(char *frame_data, size_t *length, int timeout_ms);
+
+/*
+ * @brief Receives a burst of packets. Waits at most timeout_ms milliseconds
+ * (forever if negative) for a link to become ready, then drains the ready
+ * links without blocking.
+ *
+ * @param frames - max buffers of frame_size bytes each
+ * @param frame_size - the size of the buffers, the longest frame received
+ * @param lengths - set to the length of every packet received
+ * @param links - set to the interface every packet has been received from
+ * @param stamps - if not NULL, set to the kernel receive time of every packet
+ *        (CLOCK_REALTIME ns), see enable_rx_timestamps()
+ * @param wait_writable - mask of the links whose becoming writable also ends
+ *        the wait
+ * Returns: the number of packets received, 0 if the timeout expired or only
+ * a link became writable.
+ */
+int recv_burst_from_links(char **frames, size_t frame_size, size_t *lengths, int *links,
+			  uint64_t *stamps, int max, int timeout_ms, unsigned int wait_writable);
+
+/*
+ * @brief Same as recv_burst_from_links(), but never waits: drains whatever
+ * the links already hold.
+ * Returns: the number of packets received, possibly 0.
+ */
+int poll_burst_from_links(char **frames, size_t frame_size, size_t *lengths, int *links,
+			  uint64_t *stamps, int max);
+
+/*
+ * @brief Gives the control frames (ARP, ICMP for the router, neighbour
+ * discovery) their own socket on every link, filtered in the kernel, so they
+ * never wait behind data frames nor get dropped with them when a link is
+ * flooded. The receive functions then drain the control sockets first, then
+ * at most budget data frames per burst.
+ * Returns: 0 on success, -1 on failure.
+ */
+int enable_control_priority(int budget);
+
+/*
+ * @brief Makes the kernel timestamp every received packet.
+ * Returns: 0 on success, -1 on failure.
+ */
+int enable_rx_timestamps(void);
+
+/*
+ * @brief Sets SO_BUSY_POLL (usecs) and SO_PREFER_BUSY_POLL on the sockets of
+ * the links, so the kernel polls the device queues instead of waiting for
+ * interrupts.
+ * Returns: 0 on success, -1 on failure (raising it needs CAP_NET_ADMIN).
+ */
+int enable_busy_poll(int usecs);
+
+/*
+ * @brief Pins the calling thread to a CPU.
+ * Returns: 0 on success, -1 on failure.
+ */
+int pin_to_cpu(int cpu);
+
 /* Route table entry */
 struct route_table_entry {
 	uint32_t prefix;
@@ -30,6 +110,14 @@ struct route_table_entry {
 	int interface;
 } __attribute__((packed));
 
+/* IPv6 route table entry, a next hop of :: means directly connected */
+struct route6_table_entry {
+	struct in6_addr prefix;
+	struct in6_addr next_hop;
+	int len;
+	int interface;
+};
+
 /* ARP table entry when skipping the ARP exercise */
 struct arp_entry {
     uint32_t ip;
@@ -38,6 +126,33 @@ struct arp_entry {
 
 char *get_interface_ip(int interface);
 
+/**
+ * @brief Get the netmask of the interface's IPv4 address, in network order.
+ */
+uint32_t get_interface_netmask(int interface);
+
+/**
+ * @brief Get the MTU of the interface.
+ */
+int get_interface_mtu(int interface);
+
+/**
+ * @brief Set the MTU of the interface.
+ * Returns: 0 on success, -1 if the kernel refused it.
+ */
+int set_interface_mtu(int interface, int mtu);
+
+/**
+ * @brief Get an IPv6 address of the interface, the link-local one
+ * (fe80::/10) if link_local is set, a global one otherwise.
+ *
+ * @param interface
+ * @param addr
+ * @param link_local
+ * Returns: 0 on success, -1 if the interface has no such address.
+ */
+int get_interface_ip6(int interface, struct in6_addr *addr, int link_local);
+
 /**
  * @brief Get the interface mac object. The function writes
  * the MAC at the pointer mac. uint8_t *mac should be allocated.
@@ -66,6 +181,29 @@ void get_interface_mac(int interface, uint8_t *mac);
  */
 uint16_t checksum(uint16_t *data, size_t len);
 
+/**
+ * @brief Incremental checksum update per RFC 1624. Returns the checksum
+ * after a 16 bit word covered by it changed from old_word to new_word.
+ * All values must be in the same byte order (e.g. taken from the packet).
+ *
+ * @param check current checksum
+ * @param old_word previous value of the modified word
+ * @param new_word new value of the modified word
+ */
+uint16_t checksum_update(uint16_t check, uint16_t old_word, uint16_t new_word);
+
+/**
+ * @brief Adds len bytes to a one's complement sum, for checksums over
+ * several areas (e.g. a pseudo-header and a payload). Start from 0 and
+ * finish with checksum_fold(). All but the last area must have an even
+ * length.
+ */
+uint32_t checksum_partial(uint32_t sum, const void *data, size_t len);
+
+/* Folds a sum from checksum_partial() into a checksum, in host order like
+ * the one returned by checksum(). */
+uint16_t checksum_fold(uint32_t sum);
+
 /**
  * hwaddr_aton - Convert ASCII string to MAC address (colon-delimited format)
  * @txt: MAC address as a string (e.g., "00:11:22:33:44:55")
@@ -80,6 +218,22 @@ int hwaddr_aton(const char *txt, uint8_t *addr);
  */
 int read_rtable(const char *path, struct route_table_entry *rtable);
 
+/* qsort() comparator of the route table: by mask, then by prefix, both
+ * descending, the order rtable_lookup() expects. */
+int rtable_compare(const void *a, const void *b);
+
+/* Longest prefix match of target_ip (network order) in rtable[left..right],
+ * sorted with rtable_compare(), by binary search. Returns NULL if no route
+ * matches. */
+struct route_table_entry *rtable_lookup(struct route_table_entry *rtable, uint32_t target_ip,
+					uint32_t left, uint32_t right);
+
+/* Populates an IPv6 route table from file, one route per line:
+ * prefix/len next_hop interface, e.g. 2001:db8:1::/48 fe80::2 1
+ * This function returns the size of the route table, at most max_size.
+ */
+int read_rtable6(const char *path, struct route6_table_entry *rtable6, int max_size);
+
 /* Parses a static mac table from path and populates arp_table.
  * arp_table should be allocated and have enough space. This
  * function returns the size of the arp table.
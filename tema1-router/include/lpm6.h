@@ -0,0 +1,48 @@
+#ifndef LPM6_H
+#define LPM6_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+/* Multibit trie for IPv6 longest prefix match. Every level consumes one
+ * byte of the address, so a lookup touches at most 16 nodes, and only
+ * as many as the longest matching prefix needs. Prefixes whose length is
+ * not a multiple of the stride are expanded over the slots they cover. */
+#define LPM6_STRIDE 8
+#define LPM6_NODE_SLOTS (1 << LPM6_STRIDE)
+
+struct lpm6_node;
+
+struct lpm6_slot {
+	struct lpm6_node *child;
+	int32_t route;	/* index of the route, -1 if none */
+	uint8_t len;	/* prefix length of the route */
+};
+
+struct lpm6_node {
+	struct lpm6_slot slots[LPM6_NODE_SLOTS];
+};
+
+/* Nodes are carved out of huge page backed chunks, so a lookup walking
+ * down the trie causes few TLB misses. */
+#define LPM6_CHUNK_NODES (2 * 1024 * 1024 / sizeof(struct lpm6_node))
+
+struct lpm6 {
+	struct lpm6_node *root;
+	int32_t default_route;
+	int nodes;
+	struct lpm6_node *chunk;
+	int chunk_free;
+};
+
+/* create an empty trie */
+extern struct lpm6 *lpm6_create(void);
+
+/* add the route with index route for prefix/len; a route already present
+ * for the same prefix is replaced */
+extern void lpm6_insert(struct lpm6 *t, const struct in6_addr *prefix, int len, int32_t route);
+
+/* return the index of the longest matching route, -1 if none matches */
+extern int32_t lpm6_lookup(struct lpm6 *t, const struct in6_addr *addr);
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef MPH_H
+#define MPH_H
+
+#include <stdint.h>
+
+/*
+ * Minimal perfect hash over 32-bit keys, built with hash and displace
+ * (CHD): the keys are split into buckets of about MPH_BUCKET_KEYS keys,
+ * and every bucket, the largest first, gets the first seed that sends all
+ * its keys to free slots. A key set of n keys maps onto slots 0..n-1
+ * without collisions, so a lookup is two hashes and one probe. Keys
+ * outside the set map to some slot too, the caller compares the key
+ * stored there.
+ */
+
+#define MPH_BUCKET_KEYS 4
+#define MPH_MAX_SEED (1u << 24)
+
+struct mph {
+	uint32_t size;		/* slots, the number of keys */
+	uint32_t num_buckets;
+	const uint32_t *seeds;	/* seed of every bucket */
+};
+
+static inline uint32_t mph_hash(uint32_t key, uint32_t seed)
+{
+	uint32_t h = key ^ (seed * 0x9e3779b1);
+
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	return h;
+}
+
+/* the slot of a key */
+static inline uint32_t mph_lookup(const struct mph *m, uint32_t key)
+{
+	uint32_t bucket = mph_hash(key, 0x5bd1e995) % m->num_buckets;
+
+	return mph_hash(key, m->seeds[bucket]) % m->size;
+}
+
+/* build the hash of n distinct keys; returns -1 if the keys are not
+ * distinct */
+extern int mph_build(struct mph *m, const uint32_t *keys, uint32_t n);
+
+#endif
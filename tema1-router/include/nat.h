@@ -0,0 +1,80 @@
+#ifndef NAT_H
+#define NAT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct iphdr;
+
+/*
+ * Source NAT (masquerade) for TCP, UDP and ICMP echo. Packets leaving
+ * through the outside interface get its address and an external port (the
+ * echo identifier for ICMP); replies coming back to that address and port
+ * are translated to the inside host.
+ *
+ * Sessions live in a preallocated array and are found through an open
+ * addressing hash table holding one slot per direction, so the data path
+ * never allocates. Each session keeps a coarse timestamp, refreshed by its
+ * packets; idle sessions are reclaimed by an incremental sweep.
+ */
+
+#define NAT_PORT_MIN 1024
+#define NAT_PORT_MAX 65535
+#define NAT_PORT_ATTEMPTS 64
+
+#define NAT_TCP_TIMEOUT 600	/* seconds */
+#define NAT_UDP_TIMEOUT 120
+#define NAT_ICMP_TIMEOUT 30
+
+struct nat_session {
+	uint32_t in_addr;	/* network order */
+	uint32_t remote_addr;	/* network order */
+	uint16_t in_port;	/* network order */
+	uint16_t ext_port;	/* network order */
+	uint16_t remote_port;	/* network order */
+	uint8_t proto;
+	uint8_t in_use;
+	uint32_t last_seen;	/* seconds */
+	int32_t next_free;
+};
+
+/* Hash table slot: session index << 1 | direction, -1 if empty. The hash
+ * is kept so probing rarely has to touch the sessions. */
+struct nat_slot {
+	uint32_t hash;
+	int32_t ref;
+};
+
+struct nat {
+	uint32_t ext_addr;	/* network order */
+	int outside;		/* outside interface */
+	struct nat_session *sessions;
+	uint32_t max_sessions;
+	uint32_t active;
+	int32_t free_head;
+	struct nat_slot *table;
+	uint32_t table_mask;
+	uint32_t now;
+	uint32_t sweep_cursor;
+	uint64_t created;
+	uint64_t expired;
+	uint64_t failed;
+};
+
+/* create a NAT translating to ext_addr on the outside interface, with
+ * room for max_sessions sessions */
+extern struct nat *nat_create(uint32_t ext_addr, int outside, uint32_t max_sessions);
+
+/* translate a packet leaving through the outside interface, creating its
+ * session if needed; returns -1 if the packet must be dropped */
+extern int nat_out(struct nat *nat, struct iphdr *ip_hdr, size_t len);
+
+/* translate a packet received for the outside address back to the inside
+ * host; returns -1 if it belongs to no session */
+extern int nat_in(struct nat *nat, struct iphdr *ip_hdr, size_t len);
+
+/* update the clock and reclaim the idle sessions among the next budget
+ * ones of the sweep */
+extern void nat_sweep(struct nat *nat, uint32_t now, uint32_t budget);
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+/* Fixed-size buffer pool, carved out of one preallocated region. Getting
+ * and putting a buffer is a push/pop on a free stack. */
+struct pool {
+	char *mem;
+	void **free_stack;
+	size_t buf_size;
+	int count;
+	int free_count;
+};
+
+/* create a pool of count buffers of buf_size bytes, backed by huge pages */
+extern struct pool *pool_create(size_t buf_size, int count, const char *name);
+
+/* take a buffer, NULL if the pool is exhausted */
+extern void *pool_get(struct pool *p);
+
+/* give a buffer back to its pool */
+extern void pool_put(struct pool *p, void *buf);
+
+/* Pools of several buffer sizes, so small frames do not take buffers
+ * sized for the largest ones. */
+#define POOL_SET_MAX_CLASSES 4
+
+struct pool_set {
+	int count;
+	struct pool *classes[POOL_SET_MAX_CLASSES];	/* by increasing size */
+};
+
+/* create count pools, sizes must be increasing */
+extern struct pool_set *pool_set_create(const size_t *sizes, const int *counts, int count,
+					const char *name);
+
+/* take a buffer of at least len bytes, from the smallest class that has
+ * one; NULL if none has */
+extern void *pool_set_get(struct pool_set *set, size_t len);
+
+/* give a buffer back to the pool it came from */
+extern void pool_set_put(struct pool_set *set, void *buf);
+
+#endif
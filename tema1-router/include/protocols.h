@@ -1,5 +1,6 @@
 #include <unistd.h>
 #include <stdint.h>
+#include <netinet/in.h>
 
 /* Ethernet ARP packet from RFC 826 */
 struct arp_header {
@@ -57,3 +58,44 @@ struct icmphdr
     } frag;                        /* path mtu discovery */
   } un;
 };
+
+
+/* IPv6 Header, RFC 8200 */
+struct ip6hdr {
+    uint32_t        vtc_flow;     // version (4 bits), traffic class, flow label
+    uint16_t        payload_len;  // length of everything after this header
+    uint8_t         next_header;  // encapsulated protocol, 58 for ICMPv6
+    uint8_t         hop_limit;    // IPv6 TTL, decremented by every router
+    struct in6_addr saddr;
+    struct in6_addr daddr;
+};
+
+/* ICMPv6 header, RFC 4443 */
+struct icmp6hdr {
+    uint8_t  type;
+    uint8_t  code;
+    uint16_t checksum;
+    uint32_t data;   // echo id/sequence, MTU, NDP flags, depending on type
+};
+
+/* Neighbour solicitation/advertisement, RFC 4861. The data field of the
+ * ICMPv6 header holds the advertisement flags. */
+struct nd_msg {
+    struct icmp6hdr hdr;
+    struct in6_addr target;
+};
+
+/* Source/target link-layer address option of a neighbour discovery message */
+struct nd_opt_lladdr {
+    uint8_t type;   // 1 source, 2 target
+    uint8_t len;    // in units of 8 bytes, 1 for Ethernet
+    uint8_t mac[6];
+};
+
+/* UDP header */
+struct udp_header {
+    uint16_t source;
+    uint16_t dest;
+    uint16_t len;
+    uint16_t check;
+};
@@ -0,0 +1,108 @@
+#ifndef RIP_H
+#define RIP_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Distance-vector routing, with RIPv2 messages (RFC 2453) over UDP to the
+ * 224.0.0.9 multicast group. Every router advertises its connected
+ * networks and the routes it learned, with split horizon and poisoned
+ * reverse; changes are announced right away by triggered updates, and the
+ * timers are shortened from the RFC's so a lost neighbour is noticed in
+ * seconds.
+ *
+ * This module keeps the routes (the RIB). Every route whose forwarding
+ * state changes is put on the dirty list, which the router drains into its
+ * forwarding table, so only the changed prefixes are ever pushed. The routes
+ * in use and the ones to announce are kept on lists too, so the periodic
+ * work costs as much as the routes in use, not as max_routes.
+ */
+
+#define RIP_PORT 520
+#define RIP_MULTICAST 0xe0000009	/* 224.0.0.9, host order */
+#define RIP_VERSION 2
+#define RIP_REQUEST 1
+#define RIP_RESPONSE 2
+#define RIP_AF_INET 2
+#define RIP_INFINITY 16
+#define RIP_ENTRIES_PER_PACKET 25
+
+#define RIP_UPDATE_MS 5000	/* full table, RFC 2453: 30s */
+#define RIP_TIMEOUT_MS 15000	/* route unreachable, RFC 2453: 180s */
+#define RIP_GARBAGE_MS 10000	/* then forgotten, RFC 2453: 120s */
+#define RIP_TRIGGER_MS 100	/* changes batched into one triggered update */
+
+struct rip_header {
+	uint8_t command;
+	uint8_t version;
+	uint16_t zero;
+};
+
+struct rip_entry {
+	uint16_t family;
+	uint16_t tag;
+	uint32_t addr;
+	uint32_t mask;
+	uint32_t next_hop;
+	uint32_t metric;
+};
+
+#define RIP_MAX_PAYLOAD (sizeof(struct rip_header) + RIP_ENTRIES_PER_PACKET * sizeof(struct rip_entry))
+
+struct rip_route {
+	uint32_t prefix;	/* network order */
+	uint32_t mask;		/* network order */
+	uint32_t next_hop;	/* network order, 0 for connected networks */
+	int interface;
+	uint8_t metric;
+	uint8_t in_use;
+	uint8_t connected;
+	uint8_t changed;	/* on the changed list, to announce in the next triggered update */
+	uint8_t dirty;		/* on the dirty list */
+	uint64_t updated_ms;	/* last refresh, or when it became unreachable */
+	int32_t next_free;
+	uint32_t used_pos;	/* position in the used list */
+};
+
+typedef void (*rip_send_fn)(int interface, const uint8_t *payload, size_t len);
+
+struct rip {
+	struct rip_route *routes;
+	uint32_t max_routes;
+	int32_t free_head;
+	struct fib4 *index;	/* exact (prefix, length) to route */
+	uint32_t *dirty;
+	uint32_t dirty_count;
+	uint32_t *used;		/* the routes in use, in no order */
+	uint32_t used_count;
+	uint32_t *changed_list;
+	uint32_t changed_count;
+	int changed;		/* some route waits for a triggered update */
+	uint64_t responses;
+	uint64_t triggered;
+};
+
+/* create a RIB of up to max_routes routes */
+extern struct rip *rip_create(uint32_t max_routes);
+
+/* add a connected network, advertised with metric 1 */
+extern void rip_add_connected(struct rip *rip, uint32_t prefix, uint32_t mask, int interface);
+
+/* process a message from src received on interface; returns RIP_REQUEST
+ * if it asked for the whole table, 0 otherwise */
+extern int rip_input(struct rip *rip, uint32_t src, int interface, const uint8_t *payload, size_t len,
+		     uint64_t now_ms);
+
+/* time out the routes whose neighbour went silent, forget the old ones */
+extern void rip_expire(struct rip *rip, uint64_t now_ms);
+
+/* advertise the routes, only the changed ones if only_changed, on an
+ * interface; clear_changed() afterwards once sent on all of them */
+extern void rip_advertise(struct rip *rip, int interface, int only_changed, rip_send_fn send);
+extern void rip_clear_changed(struct rip *rip);
+
+/* build a request for the whole table, returns its length */
+extern size_t rip_build_request(uint8_t *payload);
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+
+/* Granularity of the wheel and number of slots; a full turn covers
+ * TIMER_WHEEL_SLOTS * TIMER_TICK_MS milliseconds, longer timers wait
+ * for several turns in their slot. */
+#define TIMER_TICK_MS 10
+#define TIMER_WHEEL_SLOTS 256
+
+/* Maximum number of callbacks fired by one timer_wheel_run() call, so
+ * timer processing never delays the forwarding loop for long. */
+#define TIMER_RUN_BUDGET 32
+
+/* Maximum number of timers timer_wheel_timeout() looks at, so finding the
+ * next expiry does not cost as much as all the pending timers when most of
+ * them are due on later turns of the wheel. */
+#define TIMER_SCAN_BUDGET 64
+
+typedef void (*timer_callback)(void *arg);
+
+/* Embed this in the object that owns the timer. A timer is pending while
+ * it is linked in a slot (next != NULL). */
+struct timer {
+	struct timer *next;
+	struct timer *prev;
+	uint64_t expires;
+	timer_callback callback;
+	void *arg;
+};
+
+/* Hashed timing wheel: timers are hashed by expiry tick into a slot,
+ * insert and cancel are O(1). */
+struct timer_wheel {
+	struct timer slots[TIMER_WHEEL_SLOTS];
+	uint64_t current_tick;
+	int pending;
+	/* no pending timer expires before this tick */
+	uint64_t next_expires;
+};
+
+/* monotonic time in milliseconds */
+extern uint64_t timer_now_ms(void);
+
+/* initialise an empty wheel starting at the current time */
+extern void timer_wheel_init(struct timer_wheel *w);
+
+/* prepare a timer before its first use */
+extern void timer_init(struct timer *t, timer_callback callback, void *arg);
+
+/* (re)arm a timer to fire after delay_ms */
+extern void timer_add(struct timer_wheel *w, struct timer *t, uint32_t delay_ms);
+
+/* disarm a timer; does nothing if it is not pending */
+extern void timer_cancel(struct timer_wheel *w, struct timer *t);
+
+/* return a true value if the timer is armed */
+extern int timer_pending(struct timer *t);
+
+/* fire the expired timers, at most budget of them; the rest are fired on
+ * the next calls. Returns the number of callbacks fired. */
+extern int timer_wheel_run(struct timer_wheel *w, int budget);
+
+/* milliseconds until the earliest pending timer expires, so the event loop
+ * sleeps until then before calling timer_wheel_run() again; -1 if no timer
+ * is pending */
+extern int timer_wheel_timeout(struct timer_wheel *w);
+
+#endif
@@ -0,0 +1,90 @@
+#ifndef TOPK_H
+#define TOPK_H
+
+#include <stdint.h>
+
+/*
+ * Streaming top-K with the Space-Saving algorithm (Metwally et al., 2005):
+ * k counters, found by key through an open addressing index. A key without
+ * a counter takes over the smallest one, inheriting its counts, so memory is
+ * fixed and every key whose share of the packets exceeds 1/k is guaranteed a
+ * counter. The packets of a counter are overestimated by at most its
+ * `error`; its bytes are inherited the same way.
+ *
+ * The counters are kept in a stream summary: buckets of the counters with
+ * the same packets, in a list by packets ascending. Counting a packet moves
+ * its counter to the next bucket and a new key takes a counter of the first
+ * one, so adding a packet is a hash probe and a few links, with no search.
+ *
+ * To keep the per-packet cost off the forwarding path, only one packet in
+ * about every `sampling` ones is counted: the decision is a countdown kept
+ * inline, restarted from a random interval like the one of the flow table.
+ * The heavy hitters keep their rank, the counts are sampled ones.
+ */
+
+#define TOPK_NONE UINT32_MAX
+
+/* counters kept per key reported, the smallest ones churn */
+#define TOPK_OVERSIZE 4
+
+struct topk_entry {
+	uint64_t key;
+	uint64_t packets;
+	uint64_t bytes;
+	uint64_t error;		/* packets inherited from the evicted key */
+};
+
+struct topk_counter {
+	struct topk_entry entry;
+	uint32_t slot;		/* position in the index */
+	uint32_t bucket;
+	uint32_t prev, next;	/* counters of the bucket */
+};
+
+struct topk_bucket {
+	uint64_t packets;
+	uint32_t first;		/* counters with these packets */
+	uint32_t prev, next;	/* buckets by packets ascending */
+};
+
+struct topk {
+	uint32_t sampling;
+	uint32_t countdown;
+	uint32_t rng;
+	uint32_t k;
+	uint32_t size;		/* counters in use */
+	struct topk_counter *counters;
+	struct topk_bucket *buckets;
+	uint32_t min_bucket;	/* head of the bucket list */
+	uint32_t free_bucket;	/* unused buckets, linked by next */
+	uint32_t *index;	/* counter + 1 of every key, 0 if free */
+	uint32_t mask;
+	uint64_t packets;	/* totals of the stream */
+	uint64_t bytes;
+};
+
+/* create a tracker of k counters, sampling 1 in sampling packets */
+extern struct topk *topk_create(uint32_t k, uint32_t sampling);
+
+extern uint32_t topk_next_interval(struct topk *t);
+
+/* tell whether to count the current packet */
+static inline int topk_sample(struct topk *t)
+{
+	if (--t->countdown != 0)
+		return 0;
+	t->countdown = topk_next_interval(t);
+	return 1;
+}
+
+/* account a sampled packet of bytes bytes to key */
+extern void topk_add(struct topk *t, uint64_t key, uint32_t bytes);
+
+/* copy the counters to out (room for k), by packets descending; returns the
+ * number of counters */
+extern uint32_t topk_sorted(struct topk *t, struct topk_entry *out);
+
+/* forget all the keys */
+extern void topk_reset(struct topk *t);
+
+#endif
@@ -0,0 +1,118 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+/*
+ * Ring of the forwarding decisions of the last packets, for post-mortem
+ * debugging: every decision of the IPv4 path (forwarded, dropped and why,
+ * answered with ICMP, queued for ARP) writes a fixed-size binary record over
+ * the oldest one. Recording is a few stores and no branch on the ring state,
+ * the timestamp is taken once per burst.
+ *
+ * The ring is a file mapped MAP_SHARED, so its pages outlive a crash of the
+ * router and tools/tracedump decodes them afterwards, or while it runs. The
+ * ring has a single writer, the thread forwarding the packets, which
+ * publishes every record by storing the new head with release semantics; a
+ * reader copies the records and drops those overwritten meanwhile, by their
+ * sequence numbers. Nothing is locked.
+ */
+
+#define TRACE_MAGIC 0x54524331	/* "TRC1" */
+#define TRACE_VERSION 1
+#define TRACE_DEFAULT_RECORDS (1 << 16)
+#define TRACE_NO_ROUTE (-1)
+#define TRACE_NO_INTERFACE 0xff
+
+enum trace_decision {
+	TRACE_FORWARDED,
+	TRACE_DROPPED,
+	TRACE_ICMP,
+	TRACE_QUEUED,		/* waiting for the next hop to be resolved */
+	TRACE_DECISIONS,
+};
+
+enum trace_reason {
+	TRACE_NONE,
+	TRACE_STATIC_ROUTE,	/* forwarded by the static table */
+	TRACE_LEARNED_ROUTE,	/* forwarded by a route learned with RIP */
+	TRACE_RESOLVED,		/* sent once the next hop answered ARP */
+	TRACE_BAD_CHECKSUM,
+	TRACE_NOT_HANDLED,	/* for the router, but not an echo request */
+	TRACE_ACL_DENY,
+	TRACE_NAT_NO_SESSION,
+	TRACE_MTU,
+	TRACE_ARP_QUEUE_FULL,
+	TRACE_ECHO_REPLY,
+	TRACE_TTL_EXCEEDED,
+	TRACE_NO_ROUTE_FOUND,
+	TRACE_FRAG_NEEDED,
+	TRACE_ARP_TIMEOUT,	/* the next hop never answered, host unreachable */
+	TRACE_NO_NEIGHBOUR,	/* no static neighbour, in the builds without ARP */
+	TRACE_MALFORMED,	/* too short for its header, or not IPv4 */
+	TRACE_REASONS,
+};
+
+struct trace_record {
+	uint64_t stamp;		/* ns, CLOCK_REALTIME, of the burst */
+	uint32_t seq;		/* low bits of the record number */
+	uint32_t saddr;		/* network order */
+	uint32_t daddr;
+	int32_t route;		/* index in rtable or the learned routes */
+	uint16_t len;		/* of the IP packet */
+	uint8_t ingress;
+	uint8_t egress;
+	uint8_t decision;
+	uint8_t reason;
+	uint8_t pad[2];
+};
+
+struct trace_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t records;	/* a power of two */
+	uint32_t record_size;
+	uint64_t head;		/* records ever written */
+	uint64_t pad[5];	/* the records start on their own cache line */
+};
+
+struct trace {
+	struct trace_header *header;
+	struct trace_record *records;
+	uint64_t head;
+	uint32_t mask;
+	uint64_t now;		/* stamp of the records being written */
+};
+
+/* create path, or overwrite it, with a ring of records records */
+extern struct trace *trace_open(const char *path, uint32_t records);
+
+/* take the timestamp of the next records */
+extern void trace_stamp(struct trace *t);
+
+static inline void trace_record(struct trace *t, uint8_t decision, uint8_t reason, uint8_t ingress,
+				uint8_t egress, uint32_t saddr, uint32_t daddr, int32_t route,
+				uint16_t len)
+{
+	uint64_t head = t->head;
+	struct trace_record *r = &t->records[head & t->mask];
+
+	r->stamp = t->now;
+	r->seq = head;
+	r->saddr = saddr;
+	r->daddr = daddr;
+	r->route = route;
+	r->len = len;
+	r->ingress = ingress;
+	r->egress = egress;
+	r->decision = decision;
+	r->reason = reason;
+
+	t->head = head + 1;
+	__atomic_store_n(&t->header->head, head + 1, __ATOMIC_RELEASE);
+}
+
+extern const char *trace_decision_name(uint8_t decision);
+extern const char *trace_reason_name(uint8_t reason);
+
+#endif
@@ -0,0 +1,79 @@
+#ifndef VRF_H
+#define VRF_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * One IPv4 FIB for several routing tables (VRFs), looked up by VRF ID and
+ * address. Every VRF is a 16-8-8 multibit trie with its routes pushed to the
+ * leaves: a slot holds either the route of the longest prefix covering it or
+ * a child node, so a lookup reads at most three slots.
+ *
+ * The nodes under the roots are shared: a node is built once and then
+ * interned in a hash table by its contents, so identical sub-tries, in one
+ * VRF or in several, are stored once. Tenants whose tables mostly agree only
+ * add the nodes where they differ, and the memory grows far slower than the
+ * number of VRFs. The roots, 64K slots each, are shared only between
+ * identical tables.
+ *
+ * The tries are built once, from whole tables; the values of the routes must
+ * be the same in every VRF for their sub-tries to be shared. Once all of them
+ * are built, vrf_fib_finish() moves the nodes and the roots to huge pages.
+ */
+
+#define VRF_ROOT_BITS 16
+#define VRF_NODE_BITS 8
+#define VRF_ROOT_SLOTS (1 << VRF_ROOT_BITS)
+#define VRF_NODE_SLOTS (1 << VRF_NODE_BITS)
+
+/* a slot is a node index with this bit, or the route value + 1, 0 if none */
+#define VRF_SLOT_NODE 0x80000000u
+
+struct vrf_route {
+	uint32_t prefix;	/* host order */
+	int len;
+	int32_t value;		/* below 2^31 - 1 */
+};
+
+struct vrf_fib {
+	uint32_t vrfs;
+	uint32_t **roots;	/* by VRF ID, NULL if not built */
+	uint32_t *nodes;	/* VRF_NODE_SLOTS slots per node */
+	uint32_t *hashes;	/* of every node */
+	uint32_t count;		/* nodes in use */
+	uint32_t capacity;
+	uint32_t *index;	/* node + 1 by hash, 0 if free */
+	uint32_t index_mask;
+	uint32_t roots_shared;
+	uint64_t nodes_built;	/* nodes that would be stored without sharing */
+};
+
+/* create a FIB for VRF IDs 0 to vrfs - 1 */
+extern struct vrf_fib *vrf_fib_create(uint32_t vrfs);
+
+/* build the trie of a VRF from its routes, once */
+extern void vrf_fib_build(struct vrf_fib *f, uint32_t vrf, const struct vrf_route *routes, uint32_t count);
+
+/* move the nodes and the roots to huge_alloc() memory, after the last
+ * vrf_fib_build(); no VRF can be built afterwards */
+extern void vrf_fib_finish(struct vrf_fib *f);
+
+/* bytes taken by the roots and the shared nodes */
+extern size_t vrf_fib_memory(struct vrf_fib *f);
+
+/* the value of the longest prefix matching addr (host order) in vrf, -1 if
+ * none does */
+static inline int32_t vrf_fib_lookup(const struct vrf_fib *f, uint32_t vrf, uint32_t addr)
+{
+	uint32_t slot = f->roots[vrf][addr >> VRF_ROOT_BITS];
+
+	if (slot & VRF_SLOT_NODE) {
+		slot = f->nodes[(slot & ~VRF_SLOT_NODE) << VRF_NODE_BITS | ((addr >> VRF_NODE_BITS) & 0xff)];
+		if (slot & VRF_SLOT_NODE)
+			slot = f->nodes[(slot & ~VRF_SLOT_NODE) << VRF_NODE_BITS | (addr & 0xff)];
+	}
+	return (int32_t)slot - 1;
+}
+
+#endif
@@ -0,0 +1,331 @@
+#include "acl.h"
+#include "lib.h"
+#include <string.h>
+#include <strings.h>
+#include <arpa/inet.h>
+
+#define ACL_TUPLE_INITIAL_SIZE 16
+#define ACL_MAX_RANGE_PREFIXES 32
+
+static uint32_t acl_hash(uint32_t src, uint32_t dst, uint32_t ports, uint8_t proto)
+{
+	uint32_t h = src * 0x9e3779b1;
+
+	h ^= dst + 0x7f4a7c15 + (h << 6) + (h >> 2);
+	h ^= ports + 0x7f4a7c15 + (h << 6) + (h >> 2);
+	h ^= proto;
+
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	return h;
+}
+
+/* split [lo, hi] into aligned power of two blocks, one prefix each */
+static int range_to_prefixes(uint16_t lo, uint16_t hi, uint16_t *values, uint16_t *masks)
+{
+	uint32_t cur = lo;
+	int n = 0;
+
+	while (cur <= hi) {
+		uint32_t size = 1;
+
+		while ((cur & (size * 2 - 1)) == 0 && cur + size * 2 - 1 <= hi)
+			size *= 2;
+
+		values[n] = cur;
+		masks[n] = (uint16_t)~(size - 1);
+		n++;
+		cur += size;
+	}
+	return n;
+}
+
+static uint32_t prefix_mask(int len)
+{
+	return len <= 0 ? 0 : htonl(0xffffffffu << (32 - len));
+}
+
+static void tuple_table_init(struct acl_tuple *t, uint32_t size)
+{
+	t->size = size;
+	t->used = 0;
+	t->table = malloc(sizeof(struct acl_entry) * size);
+	DIE(t->table == NULL, "malloc");
+	for (uint32_t i = 0; i < size; i++)
+		t->table[i].rule = -1;
+}
+
+static void tuple_insert(struct acl *acl, struct acl_tuple *t, struct acl_entry *e);
+
+static void tuple_grow(struct acl *acl, struct acl_tuple *t)
+{
+	struct acl_entry *old = t->table;
+	uint32_t old_size = t->size;
+
+	tuple_table_init(t, old_size * 2);
+	for (uint32_t i = 0; i < old_size; i++)
+		if (old[i].rule >= 0)
+			tuple_insert(acl, t, &old[i]);
+	free(old);
+}
+
+static void tuple_insert(struct acl *acl, struct acl_tuple *t, struct acl_entry *e)
+{
+	if ((t->used + 1) * 2 > t->size)
+		tuple_grow(acl, t);
+
+	uint32_t i = acl_hash(e->src, e->dst, e->ports, e->proto) & (t->size - 1);
+
+	for (;; i = (i + 1) & (t->size - 1)) {
+		struct acl_entry *slot = &t->table[i];
+
+		if (slot->rule < 0) {
+			*slot = *e;
+			t->used++;
+			return;
+		}
+
+		if (slot->src == e->src && slot->dst == e->dst &&
+		    slot->ports == e->ports && slot->proto == e->proto) {
+			/* same key, keep the better rule, the first one on ties */
+			if (acl->rules[e->rule].priority < acl->rules[slot->rule].priority)
+				slot->rule = e->rule;
+			return;
+		}
+	}
+}
+
+static struct acl_tuple *get_tuple(struct acl *acl, uint32_t src_mask, uint32_t dst_mask,
+				   uint32_t ports_mask, uint8_t proto_mask)
+{
+	for (int i = 0; i < acl->tuple_count; i++) {
+		struct acl_tuple *t = &acl->tuples[i];
+
+		if (t->src_mask == src_mask && t->dst_mask == dst_mask &&
+		    t->ports_mask == ports_mask && t->proto_mask == proto_mask)
+			return t;
+	}
+
+	acl->tuples = realloc(acl->tuples, sizeof(struct acl_tuple) * (acl->tuple_count + 1));
+	DIE(acl->tuples == NULL, "realloc");
+
+	struct acl_tuple *t = &acl->tuples[acl->tuple_count++];
+	t->src_mask = src_mask;
+	t->dst_mask = dst_mask;
+	t->ports_mask = ports_mask;
+	t->proto_mask = proto_mask;
+	t->best_priority = UINT32_MAX;
+	tuple_table_init(t, ACL_TUPLE_INITIAL_SIZE);
+	return t;
+}
+
+static void acl_compile_rule(struct acl *acl, int index)
+{
+	struct acl_rule *r = &acl->rules[index];
+	uint16_t sport_values[ACL_MAX_RANGE_PREFIXES], sport_masks[ACL_MAX_RANGE_PREFIXES];
+	uint16_t dport_values[ACL_MAX_RANGE_PREFIXES], dport_masks[ACL_MAX_RANGE_PREFIXES];
+	int sports = range_to_prefixes(r->sport_lo, r->sport_hi, sport_values, sport_masks);
+	int dports = range_to_prefixes(r->dport_lo, r->dport_hi, dport_values, dport_masks);
+
+	for (int i = 0; i < sports; i++) {
+		for (int j = 0; j < dports; j++) {
+			uint32_t ports_mask = (uint32_t)sport_masks[i] << 16 | dport_masks[j];
+			struct acl_tuple *t = get_tuple(acl, r->src_mask, r->dst_mask, ports_mask, r->proto_mask);
+			struct acl_entry e = {
+				.src = r->src & r->src_mask,
+				.dst = r->dst & r->dst_mask,
+				.ports = ((uint32_t)sport_values[i] << 16 | dport_values[j]) & ports_mask,
+				.proto = r->proto & r->proto_mask,
+				.rule = index,
+			};
+
+			tuple_insert(acl, t, &e);
+			if (r->priority < t->best_priority)
+				t->best_priority = r->priority;
+		}
+	}
+}
+
+static int parse_prefix(char *s, uint32_t *addr, uint32_t *mask)
+{
+	char *slash = strchr(s, '/');
+	int len = 32;
+	struct in_addr in;
+
+	if (slash != NULL) {
+		*slash = '\0';
+		len = atoi(slash + 1);
+	}
+	if (inet_pton(AF_INET, s, &in) != 1 || len < 0 || len > 32)
+		return -1;
+
+	*mask = prefix_mask(len);
+	*addr = in.s_addr & *mask;
+	return 0;
+}
+
+static int parse_ports(char *s, uint16_t *lo, uint16_t *hi)
+{
+	char *dash = strchr(s, '-');
+	int first, last;
+
+	if (strcmp(s, "*") == 0) {
+		first = 0;
+		last = 65535;
+	} else if (dash != NULL) {
+		first = atoi(s);
+		last = atoi(dash + 1);
+	} else {
+		first = last = atoi(s);
+	}
+	if (first < 0 || last > 65535 || first > last)
+		return -1;
+
+	*lo = first;
+	*hi = last;
+	return 0;
+}
+
+static int acl_tuple_cmp(const void *a, const void *b)
+{
+	const struct acl_tuple *ta = a, *tb = b;
+
+	return (ta->best_priority > tb->best_priority) - (ta->best_priority < tb->best_priority);
+}
+
+struct acl *acl_load(const char *path)
+{
+	struct acl *acl = calloc(1, sizeof(struct acl));
+	FILE *f = fopen(path, "r");
+	char line[256];
+	int capacity = 0, line_number = 0;
+
+	DIE(acl == NULL, "calloc");
+	DIE(f == NULL, "Failed to open %s", path);
+
+	while (fgets(line, sizeof(line), f)) {
+		char action[16], src[32], dst[32], proto[16], sport[16], dport[16];
+		struct acl_rule r;
+
+		line_number++;
+		if (line[0] == '#' || sscanf(line, "%u %15s %31s %31s %15s %15s %15s", &r.priority,
+					      action, src, dst, proto, sport, dport) != 7)
+			continue;
+
+		if (strcasecmp(action, "deny") == 0) {
+			r.action = ACL_DENY;
+		} else if (strcasecmp(action, "permit") == 0) {
+			r.action = ACL_PERMIT;
+		} else {
+			fprintf(stderr, "%s:%d: Invalid ACL action %s: %s", path, line_number, action, line);
+			continue;
+		}
+		if (parse_prefix(src, &r.src, &r.src_mask) < 0 ||
+		    parse_prefix(dst, &r.dst, &r.dst_mask) < 0) {
+			fprintf(stderr, "%s:%d: Invalid ACL rule: %s", path, line_number, line);
+			continue;
+		}
+
+		r.proto_mask = 0xff;
+		if (strcasecmp(proto, "any") == 0) {
+			r.proto = 0;
+			r.proto_mask = 0;
+		} else if (strcasecmp(proto, "icmp") == 0) {
+			r.proto = 1;
+		} else if (strcasecmp(proto, "tcp") == 0) {
+			r.proto = 6;
+		} else if (strcasecmp(proto, "udp") == 0) {
+			r.proto = 17;
+		} else {
+			r.proto = atoi(proto);
+		}
+
+		if (parse_ports(sport, &r.sport_lo, &r.sport_hi) < 0 ||
+		    parse_ports(dport, &r.dport_lo, &r.dport_hi) < 0) {
+			fprintf(stderr, "%s:%d: Invalid ACL port range: %s", path, line_number, line);
+			continue;
+		}
+		r.hits = 0;
+
+		if (acl->rule_count == capacity) {
+			capacity = capacity ? capacity * 2 : 64;
+			acl->rules = realloc(acl->rules, sizeof(struct acl_rule) * capacity);
+			DIE(acl->rules == NULL, "realloc");
+		}
+		acl->rules[acl->rule_count++] = r;
+	}
+	fclose(f);
+
+	for (int i = 0; i < acl->rule_count; i++)
+		acl_compile_rule(acl, i);
+
+	qsort(acl->tuples, acl->tuple_count, sizeof(struct acl_tuple), acl_tuple_cmp);
+
+	fprintf(stderr, "ACL: %d rules in %d tuples\n", acl->rule_count, acl->tuple_count);
+	return acl;
+}
+
+int acl_classify(struct acl *acl, uint32_t src, uint32_t dst, uint8_t proto,
+		 uint16_t sport, uint16_t dport)
+{
+	uint32_t ports = (uint32_t)sport << 16 | dport;
+	uint32_t best_priority = UINT32_MAX;
+	int best = -1;
+
+	for (int i = 0; i < acl->tuple_count; i++) {
+		struct acl_tuple *t = &acl->tuples[i];
+
+		/* the tuples are sorted, none of the rest can win */
+		if (best >= 0 && t->best_priority > best_priority)
+			break;
+
+		uint32_t key_src = src & t->src_mask;
+		uint32_t key_dst = dst & t->dst_mask;
+		uint32_t key_ports = ports & t->ports_mask;
+		uint8_t key_proto = proto & t->proto_mask;
+		uint32_t j = acl_hash(key_src, key_dst, key_ports, key_proto) & (t->size - 1);
+
+		for (;; j = (j + 1) & (t->size - 1)) {
+			struct acl_entry *e = &t->table[j];
+
+			if (e->rule < 0)
+				break;
+			if (e->src == key_src && e->dst == key_dst &&
+			    e->ports == key_ports && e->proto == key_proto) {
+				uint32_t priority = acl->rules[e->rule].priority;
+
+				if (best < 0 || priority < best_priority ||
+				    (priority == best_priority && e->rule < best)) {
+					best = e->rule;
+					best_priority = priority;
+				}
+				break;
+			}
+		}
+	}
+
+	if (best >= 0)
+		acl->rules[best].hits++;
+	return best;
+}
+
+void acl_dump(struct acl *acl, FILE *f)
+{
+	for (int i = 0; i < acl->rule_count; i++) {
+		struct acl_rule *r = &acl->rules[i];
+		char src[INET_ADDRSTRLEN], dst[INET_ADDRSTRLEN];
+
+		if (r->hits == 0)
+			continue;
+
+		inet_ntop(AF_INET, &r->src, src, sizeof(src));
+		inet_ntop(AF_INET, &r->dst, dst, sizeof(dst));
+		fprintf(f, "  acl rule %d (priority %u %s %s/%d %s/%d proto %u ports %u-%u %u-%u): %lu hits\n",
+			i, r->priority, r->action == ACL_DENY ? "deny" : "permit",
+			src, __builtin_popcount(r->src_mask), dst, __builtin_popcount(r->dst_mask),
+			r->proto, r->sport_lo, r->sport_hi, r->dport_lo, r->dport_hi, r->hits);
+	}
+}
@@ -0,0 +1,141 @@
+#include "egress.h"
+#include "pool.h"
+#include "hugepage.h"
+#include "lib.h"
+#include <string.h>
+
+static const char *class_names[EGRESS_CLASSES] = {
+	"control", "interactive", "best-effort", "bulk",
+};
+
+struct egress *egress_create(int num_ports, const uint32_t *weights, struct pool_set *buffers)
+{
+	struct egress *e = malloc(sizeof(struct egress));
+
+	DIE(e == NULL, "malloc");
+
+	e->num_ports = num_ports;
+	e->ports = huge_alloc(sizeof(struct egress_port) * num_ports, "egress queues");
+	e->buffers = buffers;
+
+	for (int p = 0; p < num_ports; p++)
+		for (int c = 0; c < EGRESS_CLASSES; c++) {
+			DIE(weights[c] == 0, "egress weight");
+			e->ports[p].classes[c].quantum = weights[c] * EGRESS_QUANTUM_UNIT;
+		}
+
+	return e;
+}
+
+int egress_dscp_class(uint8_t dscp)
+{
+	if (dscp >= 48)
+		return EGRESS_CONTROL;
+	if (dscp >= 32)
+		return EGRESS_INTERACTIVE;
+	if (dscp == 8 || dscp == 1)
+		return EGRESS_BULK;
+	return EGRESS_BEST_EFFORT;
+}
+
+int egress_send(struct egress *e, int port_id, char *frame, size_t len, int class_id)
+{
+	struct egress_port *port = &e->ports[port_id];
+	struct egress_class *c = &port->classes[class_id];
+
+	/* nothing queued ahead of it, try the link first */
+	if (port->backlog == 0 && try_send_to_link(port_id, frame, len) >= 0) {
+		c->sent++;
+		return 0;
+	}
+
+	char *copy = c->count < EGRESS_QUEUE_LEN ? pool_set_get(e->buffers, len) : NULL;
+	if (copy == NULL) {
+		c->dropped++;
+		return -1;
+	}
+
+	memcpy(copy, frame, len);
+	struct egress_frame *f = &c->ring[(c->head + c->count) % EGRESS_QUEUE_LEN];
+	f->data = copy;
+	f->len = len;
+
+	c->count++;
+	if (c->count > c->max_depth)
+		c->max_depth = c->count;
+	port->backlog++;
+	return 0;
+}
+
+static void next_class(struct egress_port *port)
+{
+	port->current = (port->current + 1) % EGRESS_CLASSES;
+	port->turn_started = 0;
+}
+
+/* Deficit round-robin over the classes of one port. When the link stops
+ * taking frames the turn is kept, so the class resumes with what is left
+ * of its deficit. */
+static void drain_port(struct egress *e, int port_id)
+{
+	struct egress_port *port = &e->ports[port_id];
+
+	while (port->backlog > 0) {
+		struct egress_class *c = &port->classes[port->current];
+
+		if (c->count == 0) {
+			c->deficit = 0;
+			next_class(port);
+			continue;
+		}
+
+		if (!port->turn_started) {
+			c->deficit += c->quantum;
+			port->turn_started = 1;
+		}
+
+		struct egress_frame *f = &c->ring[c->head];
+		if (f->len > c->deficit) {
+			next_class(port);
+			continue;
+		}
+
+		if (try_send_to_link(port_id, f->data, f->len) < 0)
+			return;
+
+		c->deficit -= f->len;
+		pool_set_put(e->buffers, f->data);
+		c->head = (c->head + 1) % EGRESS_QUEUE_LEN;
+		c->count--;
+		c->sent++;
+		port->backlog--;
+	}
+}
+
+void egress_run(struct egress *e)
+{
+	for (int p = 0; p < e->num_ports; p++)
+		if (e->ports[p].backlog > 0)
+			drain_port(e, p);
+}
+
+unsigned int egress_backlog_mask(struct egress *e)
+{
+	unsigned int mask = 0;
+
+	for (int p = 0; p < e->num_ports; p++)
+		if (e->ports[p].backlog > 0)
+			mask |= 1u << p;
+	return mask;
+}
+
+void egress_dump(struct egress *e, FILE *out)
+{
+	for (int p = 0; p < e->num_ports; p++)
+		for (int c = 0; c < EGRESS_CLASSES; c++) {
+			struct egress_class *cl = &e->ports[p].classes[c];
+
+			fprintf(out, "  egress %d %-11s depth %u max %u sent %lu dropped %lu\n", p,
+				class_names[c], cl->count, cl->max_depth, cl->sent, cl->dropped);
+		}
+}
@@ -0,0 +1,118 @@
+#include "fib4.h"
+#include "hugepage.h"
+#include "lib.h"
+
+static inline uint32_t len_mask(int len)
+{
+	return len == 0 ? 0 : ~0u << (32 - len);
+}
+
+static inline uint32_t slot_hash(uint32_t prefix, int len)
+{
+	uint32_t h = prefix ^ (len * 0x9e3779b1);
+
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	return h;
+}
+
+struct fib4 *fib4_create(uint32_t size)
+{
+	struct fib4 *f = calloc(1, sizeof(struct fib4));
+	uint32_t slots = 1;
+
+	DIE(f == NULL, "calloc");
+
+	/* keep the table at most half full */
+	while (slots < size * 2)
+		slots <<= 1;
+
+	f->slots = huge_alloc(sizeof(struct fib4_slot) * slots, "fib4");
+	f->mask = slots - 1;
+	return f;
+}
+
+/* the slot of the prefix, or the empty slot ending its probe sequence */
+static uint32_t find_slot(struct fib4 *f, uint32_t prefix, int len)
+{
+	uint32_t i = slot_hash(prefix, len) & f->mask;
+
+	while (f->slots[i].in_use && (f->slots[i].prefix != prefix || f->slots[i].len != len))
+		i = (i + 1) & f->mask;
+	return i;
+}
+
+int fib4_set(struct fib4 *f, uint32_t prefix, int len, int32_t value)
+{
+	prefix &= len_mask(len);
+	uint32_t i = find_slot(f, prefix, len);
+	struct fib4_slot *slot = &f->slots[i];
+
+	if (!slot->in_use) {
+		if (f->count >= (f->mask + 1) / 2)
+			return -1;
+
+		slot->prefix = prefix;
+		slot->len = len;
+		slot->in_use = 1;
+		f->count++;
+		f->len_count[len]++;
+		f->lengths |= 1ull << len;
+	}
+
+	slot->value = value;
+	return 0;
+}
+
+void fib4_delete(struct fib4 *f, uint32_t prefix, int len)
+{
+	prefix &= len_mask(len);
+	uint32_t i = find_slot(f, prefix, len);
+
+	if (!f->slots[i].in_use)
+		return;
+
+	if (--f->len_count[len] == 0)
+		f->lengths &= ~(1ull << len);
+	f->count--;
+
+	/* shift back the following slots of the cluster, no tombstones */
+	for (uint32_t j = (i + 1) & f->mask;; j = (j + 1) & f->mask) {
+		struct fib4_slot *slot = &f->slots[j];
+
+		if (!slot->in_use)
+			break;
+
+		uint32_t home = slot_hash(slot->prefix, slot->len) & f->mask;
+		if ((i < j) ? (home <= i || home > j) : (home <= i && home > j)) {
+			f->slots[i] = *slot;
+			i = j;
+		}
+	}
+	f->slots[i].in_use = 0;
+}
+
+int32_t fib4_find(struct fib4 *f, uint32_t prefix, int len)
+{
+	struct fib4_slot *slot = &f->slots[find_slot(f, prefix & len_mask(len), len)];
+
+	return slot->in_use ? slot->value : -1;
+}
+
+int32_t fib4_lookup(struct fib4 *f, uint32_t addr)
+{
+	uint64_t lengths = f->lengths;
+
+	while (lengths != 0) {
+		int len = 63 - __builtin_clzll(lengths);
+		struct fib4_slot *slot = &f->slots[find_slot(f, addr & len_mask(len), len)];
+
+		if (slot->in_use)
+			return slot->value;
+		lengths &= ~(1ull << len);
+	}
+	return -1;
+}
@@ -0,0 +1,272 @@
+#include "flow.h"
+#include "hugepage.h"
+#include "lib.h"
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#define IPFIX_VERSION 10
+#define IPFIX_HEADER_LEN 16
+#define IPFIX_SET_HEADER_LEN 4
+#define IPFIX_TEMPLATE_SET_ID 2
+#define FLOW_RECORD_LEN 53
+
+/* Information elements of the exported records, in record order. */
+static const uint16_t template_fields[][2] = {
+	{ 8, 4 },	/* sourceIPv4Address */
+	{ 12, 4 },	/* destinationIPv4Address */
+	{ 7, 2 },	/* sourceTransportPort */
+	{ 11, 2 },	/* destinationTransportPort */
+	{ 4, 1 },	/* protocolIdentifier */
+	{ 10, 4 },	/* ingressInterface */
+	{ 2, 8 },	/* packetDeltaCount, sampled packets */
+	{ 1, 8 },	/* octetDeltaCount, sampled bytes */
+	{ 152, 8 },	/* flowStartMilliseconds */
+	{ 153, 8 },	/* flowEndMilliseconds */
+	{ 34, 4 },	/* samplingInterval */
+};
+
+#define TEMPLATE_FIELDS (sizeof(template_fields) / sizeof(template_fields[0]))
+
+static uint8_t *put16(uint8_t *p, uint16_t v)
+{
+	p[0] = v >> 8;
+	p[1] = v;
+	return p + 2;
+}
+
+static uint8_t *put32(uint8_t *p, uint32_t v)
+{
+	p = put16(p, v >> 16);
+	return put16(p, v);
+}
+
+static uint8_t *put64(uint8_t *p, uint64_t v)
+{
+	p = put32(p, v >> 32);
+	return put32(p, v);
+}
+
+static uint32_t flow_hash(const struct flow_key *key)
+{
+	uint32_t h = key->saddr * 0x9e3779b1;
+
+	h ^= key->daddr + 0x7f4a7c15 + (h << 6) + (h >> 2);
+	h ^= ((uint32_t)key->sport << 16 | key->dport) + 0x7f4a7c15 + (h << 6) + (h >> 2);
+	h ^= key->proto | key->ingress << 8;
+
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	return h;
+}
+
+uint32_t flow_next_interval(struct flow_table *t)
+{
+	/* xorshift32, uniform on [1, 2 * sampling - 1] */
+	t->rng ^= t->rng << 13;
+	t->rng ^= t->rng >> 17;
+	t->rng ^= t->rng << 5;
+	return 1 + t->rng % (2 * t->sampling - 1);
+}
+
+struct flow_table *flow_create(uint32_t sampling, uint32_t size)
+{
+	struct flow_table *t = calloc(1, sizeof(struct flow_table));
+
+	DIE(t == NULL, "calloc");
+	DIE(sampling == 0 || size == 0 || (size & (size - 1)) != 0, "flow table parameters");
+
+	t->sampling = sampling;
+	t->rng = time(NULL) | 1;
+	t->countdown = flow_next_interval(t);
+	t->records = huge_alloc(sizeof(struct flow_record) * size, "flow table");
+	t->mask = size - 1;
+	t->fd = -1;
+
+	return t;
+}
+
+void flow_set_collector(struct flow_table *t, const char *collector)
+{
+	char host[64];
+	int port;
+	struct sockaddr_in addr;
+
+	memset(&addr, 0, sizeof(addr));
+	if (sscanf(collector, "%63[0-9.]:%d", host, &port) == 2 && inet_pton(AF_INET, host, &addr.sin_addr) == 1) {
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons(port);
+		t->fd = socket(AF_INET, SOCK_DGRAM, 0);
+		DIE(t->fd == -1, "socket");
+		DIE(connect(t->fd, (struct sockaddr *)&addr, sizeof(addr)) == -1, "connect");
+		return;
+	}
+
+	t->fd = open(collector, O_WRONLY | O_CREAT | O_APPEND, 0644);
+	DIE(t->fd == -1, "open");
+}
+
+static uint64_t realtime_offset_ms(void)
+{
+	struct timespec real, mono;
+
+	clock_gettime(CLOCK_REALTIME, &real);
+	clock_gettime(CLOCK_MONOTONIC, &mono);
+	return ((uint64_t)real.tv_sec * 1000 + real.tv_nsec / 1000000) -
+	       ((uint64_t)mono.tv_sec * 1000 + mono.tv_nsec / 1000000);
+}
+
+static void start_message(struct flow_table *t)
+{
+	uint8_t *p = t->batch + IPFIX_HEADER_LEN;
+
+	if (t->messages % FLOW_TEMPLATE_EVERY == 0) {
+		p = put16(p, IPFIX_TEMPLATE_SET_ID);
+		p = put16(p, IPFIX_SET_HEADER_LEN + 4 + TEMPLATE_FIELDS * 4);
+		p = put16(p, FLOW_TEMPLATE_ID);
+		p = put16(p, TEMPLATE_FIELDS);
+		for (size_t i = 0; i < TEMPLATE_FIELDS; i++) {
+			p = put16(p, template_fields[i][0]);
+			p = put16(p, template_fields[i][1]);
+		}
+	}
+
+	/* data set header, its length is filled in when sending */
+	p = put16(p, FLOW_TEMPLATE_ID);
+	p = put16(p, 0);
+	t->batch_len = p - t->batch;
+}
+
+static void send_batch(struct flow_table *t)
+{
+	uint8_t *data_set = t->batch + t->batch_len - t->batch_count * FLOW_RECORD_LEN - IPFIX_SET_HEADER_LEN;
+	uint8_t *p = t->batch;
+
+	if (t->batch_count == 0)
+		return;
+
+	put16(data_set + 2, IPFIX_SET_HEADER_LEN + t->batch_count * FLOW_RECORD_LEN);
+
+	p = put16(p, IPFIX_VERSION);
+	p = put16(p, t->batch_len);
+	p = put32(p, time(NULL));
+	p = put32(p, t->sequence);
+	put32(p, 0);	/* observation domain */
+
+	/* a collector that is down or slow only loses records */
+	ssize_t ret = write(t->fd, t->batch, t->batch_len);
+	DIE(ret < 0 && errno != ECONNREFUSED && errno != EAGAIN && errno != ENOBUFS, "write");
+
+	t->sequence += t->batch_count;
+	t->exported += t->batch_count;
+	t->messages++;
+	t->batch_count = 0;
+}
+
+static void export_record(struct flow_table *t, struct flow_record *r, uint64_t offset_ms)
+{
+	if (t->batch_count == 0)
+		start_message(t);
+
+	uint8_t *p = t->batch + t->batch_len;
+
+	memcpy(p, &r->key.saddr, 4);
+	memcpy(p + 4, &r->key.daddr, 4);
+	memcpy(p + 8, &r->key.sport, 2);
+	memcpy(p + 10, &r->key.dport, 2);
+	p[12] = r->key.proto;
+	p = put32(p + 13, r->key.ingress);
+	p = put64(p, r->packets);
+	p = put64(p, r->bytes);
+	p = put64(p, r->first_ms + offset_ms);
+	p = put64(p, r->last_ms + offset_ms);
+	p = put32(p, t->sampling);
+
+	t->batch_len = p - t->batch;
+	if (++t->batch_count == FLOW_MAX_RECORDS)
+		send_batch(t);
+}
+
+void flow_account(struct flow_table *t, const struct flow_key *key, uint32_t bytes, uint64_t now_ms)
+{
+	uint32_t hash = flow_hash(key);
+	uint32_t i = hash & t->mask;
+
+	t->sampled++;
+
+	for (uint32_t probes = 0; probes <= t->mask; probes++, i = (i + 1) & t->mask) {
+		struct flow_record *r = &t->records[i];
+
+		if (r->in_use && r->hash == hash && memcmp(&r->key, key, sizeof(*key)) == 0) {
+			r->packets++;
+			r->bytes += bytes;
+			r->last_ms = now_ms;
+			return;
+		}
+
+		if (!r->in_use) {
+			/* keep the table at most 3/4 full so probes stay short */
+			if (t->active >= (t->mask + 1) / 4 * 3)
+				break;
+
+			r->key = *key;
+			r->hash = hash;
+			r->in_use = 1;
+			r->packets = 1;
+			r->bytes = bytes;
+			r->first_ms = r->last_ms = now_ms;
+			t->active++;
+			return;
+		}
+	}
+
+	t->dropped++;
+}
+
+/* remove the record at i, shifting back the following ones of its cluster */
+static void remove_record(struct flow_table *t, uint32_t i)
+{
+	for (uint32_t j = (i + 1) & t->mask;; j = (j + 1) & t->mask) {
+		struct flow_record *r = &t->records[j];
+
+		if (!r->in_use)
+			break;
+
+		uint32_t home = r->hash & t->mask;
+		if ((i < j) ? (home <= i || home > j) : (home <= i && home > j)) {
+			t->records[i] = *r;
+			i = j;
+		}
+	}
+	t->records[i].in_use = 0;
+	t->active--;
+}
+
+void flow_expire(struct flow_table *t, uint64_t now_ms, uint32_t budget)
+{
+	uint64_t offset_ms = realtime_offset_ms();
+
+	for (uint32_t n = 0; n < budget; n++) {
+		uint32_t i = t->sweep_cursor;
+		struct flow_record *r = &t->records[i];
+
+		t->sweep_cursor = (t->sweep_cursor + 1) & t->mask;
+		if (!r->in_use)
+			continue;
+		if (now_ms - r->last_ms < FLOW_INACTIVE_MS && now_ms - r->first_ms < FLOW_ACTIVE_MS)
+			continue;
+
+		export_record(t, r, offset_ms);
+		remove_record(t, i);
+		/* a record of the cluster may have been shifted back into i */
+		t->sweep_cursor = i;
+	}
+
+	send_batch(t);
+}
@@ -0,0 +1,71 @@
+#include "hugepage.h"
+#include "lib.h"
+#include <stdint.h>
+#include <sys/mman.h>
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+
+static int huge_enabled = 1;
+
+static const char *backing_names[] = {
+	[HUGE_BACKING_HUGETLB] = "2048 kB pages (MAP_HUGETLB)",
+	[HUGE_BACKING_THP] = "transparent huge pages (madvise)",
+	[HUGE_BACKING_SMALL] = "4 kB pages",
+};
+
+void huge_disable(void)
+{
+	huge_enabled = 0;
+}
+
+static size_t round_up(size_t size)
+{
+	return (size + HUGE_PAGE_SIZE - 1) & ~((size_t)HUGE_PAGE_SIZE - 1);
+}
+
+void *huge_alloc(size_t size, const char *name)
+{
+	enum huge_backing backing = HUGE_BACKING_SMALL;
+	void *addr = MAP_FAILED;
+
+	size = round_up(size);
+
+	if (huge_enabled) {
+		addr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_2MB, -1, 0);
+		backing = HUGE_BACKING_HUGETLB;
+	}
+
+	if (addr == MAP_FAILED && huge_enabled) {
+		/* No reserved huge pages, ask for THP on a 2 MB aligned region:
+		 * map one page more and trim the unaligned ends. */
+		char *raw = mmap(NULL, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+				 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		DIE(raw == MAP_FAILED, "mmap");
+
+		char *aligned = (char *)round_up((uintptr_t)raw);
+		if (aligned > raw)
+			munmap(raw, aligned - raw);
+		munmap(aligned + size, raw + HUGE_PAGE_SIZE - aligned);
+
+		addr = aligned;
+		backing = madvise(addr, size, MADV_HUGEPAGE) == 0 ? HUGE_BACKING_THP : HUGE_BACKING_SMALL;
+	}
+
+	if (addr == MAP_FAILED) {
+		addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		DIE(addr == MAP_FAILED, "mmap");
+		backing = HUGE_BACKING_SMALL;
+	}
+
+	fprintf(stderr, "%s: %zu kB on %s\n", name, size / 1024, backing_names[backing]);
+	return addr;
+}
+
+void huge_free(void *addr, size_t size)
+{
+	munmap(addr, round_up(size));
+}
@@ -0,0 +1,73 @@
+#include "latency.h"
+#include <string.h>
+#include <time.h>
+
+uint64_t latency_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int bucket_of(uint64_t ns)
+{
+	if (ns < LATENCY_SUB_BUCKETS)
+		return ns;
+
+	int exp = 63 - __builtin_clzll(ns);
+	int sub = (ns >> (exp - LATENCY_SUB_BITS)) & (LATENCY_SUB_BUCKETS - 1);
+
+	return (exp - LATENCY_SUB_BITS + 1) * LATENCY_SUB_BUCKETS + sub;
+}
+
+/* the largest value that falls in a bucket */
+static uint64_t bucket_limit(int bucket)
+{
+	if (bucket < LATENCY_SUB_BUCKETS)
+		return bucket;
+
+	int exp = bucket / LATENCY_SUB_BUCKETS + LATENCY_SUB_BITS - 1;
+	uint64_t sub = bucket % LATENCY_SUB_BUCKETS;
+	int shift = exp - LATENCY_SUB_BITS;
+
+	return ((LATENCY_SUB_BUCKETS + sub + 1) << shift) - 1;
+}
+
+void latency_record(struct latency_hist *h, uint64_t ns)
+{
+	h->buckets[bucket_of(ns)]++;
+	h->count++;
+	h->sum += ns;
+	if (ns > h->max)
+		h->max = ns;
+}
+
+uint64_t latency_percentile(struct latency_hist *h, double p)
+{
+	uint64_t rank = p * h->count, seen = 0;
+
+	for (int i = 0; i < LATENCY_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen > rank)
+			return bucket_limit(i) < h->max ? bucket_limit(i) : h->max;
+	}
+	return h->max;
+}
+
+void latency_dump(struct latency_hist *h, const char *name, FILE *out)
+{
+	if (h->count == 0)
+		return;
+
+	fprintf(out, "latency %s: packets %lu mean %.1fus p50 %.1fus p90 %.1fus p99 %.1fus "
+		"p99.9 %.1fus max %.1fus\n", name, h->count, h->sum / 1000.0 / h->count,
+		latency_percentile(h, 0.5) / 1000.0, latency_percentile(h, 0.9) / 1000.0,
+		latency_percentile(h, 0.99) / 1000.0, latency_percentile(h, 0.999) / 1000.0,
+		h->max / 1000.0);
+}
+
+void latency_reset(struct latency_hist *h)
+{
+	memset(h, 0, sizeof(struct latency_hist));
+}
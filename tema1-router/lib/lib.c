@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include "lib.h"
 
 #include <sys/ioctl.h>
@@ -5,6 +6,7 @@
 #include <netinet/in.h>
 #include <sys/socket.h>
 #include <linux/if_packet.h>
+#include <linux/filter.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -16,11 +18,130 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <ifaddrs.h>
+#include <errno.h>
+#include <sched.h>
+#include <time.h>
 
 
 int interfaces[ROUTER_NUM_INTERFACES];
 
-int get_sock(const char *if_name)
+/* Sockets of the control frames, see enable_control_priority(). */
+static int interfaces_control[ROUTER_NUM_INTERFACES];
+
+/* Names of the links, and the data frames drained per burst once the control
+ * frames have their own sockets (0 while they share the data sockets). */
+static char link_names[ROUTER_NUM_INTERFACES][IFNAMSIZ];
+static int data_budget;
+
+/* Frames a link filter lets through: all of them, or one class only. */
+enum link_role {
+	LINK_ALL,
+	LINK_DATA,
+	LINK_CONTROL
+};
+
+/* Positions of the jump targets in the link filter. */
+enum {
+	LF_TYPE = 8,
+	LF_ARP = 12,
+	LF_IP = 14,
+	LF_IP6 = 27,
+	LF_CONTROL = 38,
+	LF_DATA = 39,
+	LF_DROP = 40,
+	LF_LEN
+};
+
+#define LF_TO(label, pc) ((label) - (pc) - 1)
+
+/*
+ * Attaches a classic BPF filter to a link's socket, so the kernel only copies
+ * to the router the frames it handles: ARP, IPv4 and IPv6 frames addressed to
+ * the interface's MAC, broadcast or multicast, and long enough for their
+ * headers. The frames the router sends itself are dropped as well.
+ *
+ * ARP, ICMP for the interface's address and neighbour discovery are control
+ * frames, the rest are data frames; role picks the classes passed.
+ */
+static int attach_link_filter(int s, const char *if_name, enum link_role role)
+{
+	struct ifreq ifr;
+	uint32_t ip = 0;
+
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, if_name, IFNAMSIZ - 1);
+	DIE(ioctl(s, SIOCGIFHWADDR, &ifr) == -1, "ioctl SIOCGIFHWADDR");
+
+	uint8_t *mac = (uint8_t *)ifr.ifr_hwaddr.sa_data;
+	uint32_t mac_hi = (uint32_t)mac[0] << 24 | mac[1] << 16 | mac[2] << 8 | mac[3];
+	uint32_t mac_lo = mac[4] << 8 | mac[5];
+
+	/* An interface without an IPv4 address has no ICMP control frames. */
+	if (ioctl(s, SIOCGIFADDR, &ifr) == 0)
+		ip = ntohl(((struct sockaddr_in *)&ifr.ifr_addr)->sin_addr.s_addr);
+
+	uint32_t control = role != LINK_DATA ? 0xffffffff : 0;
+	uint32_t data = role != LINK_CONTROL ? 0xffffffff : 0;
+	struct sock_filter code[LF_LEN] = {
+		/* 0: not the router's own frames */
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_PKTTYPE),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, PACKET_OUTGOING, LF_TO(LF_DROP, 1), 0),
+		/* 2: group addresses, else the interface's MAC */
+		BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 0),
+		BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 1, LF_TO(LF_TYPE, 3), 0),
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 0),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, mac_hi, 0, LF_TO(LF_DROP, 5)),
+		BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 4),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, mac_lo, 0, LF_TO(LF_DROP, 7)),
+		/* 8 (LF_TYPE): the protocols the router handles */
+		BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 12),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0x0806, LF_TO(LF_ARP, 9), 0),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0x0800, LF_TO(LF_IP, 10), 0),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0x86dd, LF_TO(LF_IP6, 11), LF_TO(LF_DROP, 11)),
+		/* 12 (LF_ARP): a whole ARP packet */
+		BPF_STMT(BPF_LD | BPF_W | BPF_LEN, 0),
+		BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, 14 + 28, LF_TO(LF_CONTROL, 13), LF_TO(LF_DROP, 13)),
+		/* 14 (LF_IP): version 4, a valid IHL and tot_len within the frame */
+		BPF_STMT(BPF_LD | BPF_W | BPF_LEN, 0),
+		BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, 14 + 20, 0, LF_TO(LF_DROP, 15)),
+		BPF_STMT(BPF_MISC | BPF_TAX, 0),
+		BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 14),
+		BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, 0x45, 0, LF_TO(LF_DROP, 18)),
+		BPF_JUMP(BPF_JMP | BPF_JGT | BPF_K, 0x4f, LF_TO(LF_DROP, 19), 0),
+		BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 16),
+		BPF_STMT(BPF_ALU | BPF_ADD | BPF_K, 14),
+		BPF_JUMP(BPF_JMP | BPF_JGT | BPF_X, 0, LF_TO(LF_DROP, 22), 0),
+		/* 23: ICMP for the interface's address is control */
+		BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 23),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 1, 0, LF_TO(LF_DATA, 24)),
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 30),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ip, LF_TO(LF_CONTROL, 26), LF_TO(LF_DATA, 26)),
+		/* 27 (LF_IP6): the fixed header and the payload within the frame */
+		BPF_STMT(BPF_LD | BPF_W | BPF_LEN, 0),
+		BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, 14 + 40, 0, LF_TO(LF_DROP, 28)),
+		BPF_STMT(BPF_MISC | BPF_TAX, 0),
+		BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 18),
+		BPF_STMT(BPF_ALU | BPF_ADD | BPF_K, 14 + 40),
+		BPF_JUMP(BPF_JMP | BPF_JGT | BPF_X, 0, LF_TO(LF_DROP, 32), 0),
+		/* 33: neighbour discovery (ICMPv6 133 to 137) is control */
+		BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 20),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 58, 0, LF_TO(LF_DATA, 34)),
+		BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 54),
+		BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, 133, 0, LF_TO(LF_DATA, 36)),
+		BPF_JUMP(BPF_JMP | BPF_JGT | BPF_K, 137, LF_TO(LF_DATA, 37), LF_TO(LF_CONTROL, 37)),
+		/* 38 (LF_CONTROL), 39 (LF_DATA), 40 (LF_DROP) */
+		BPF_STMT(BPF_RET | BPF_K, control),
+		BPF_STMT(BPF_RET | BPF_K, data),
+		BPF_STMT(BPF_RET | BPF_K, 0),
+	};
+	struct sock_fprog prog = { .len = LF_LEN, .filter = code };
+
+	return setsockopt(s, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog));
+}
+
+/* Opens a socket on a link, passing the frames of role. */
+static int open_link(const char *if_name, enum link_role role)
 {
 	int res;
 	int s = socket(AF_PACKET, SOCK_RAW, 768);
@@ -31,6 +152,11 @@ int get_sock(const char *if_name)
 	res = ioctl(s, SIOCGIFINDEX, &intf);
 	DIE(res, "ioctl SIOCGIFINDEX");
 
+	/* Filter the frames in the kernel before the socket starts receiving
+	 * them on the interface. */
+	if (attach_link_filter(s, if_name, role) == -1)
+		fprintf(stderr, "%s: cannot attach the socket filter, receiving every frame\n", if_name);
+
 	struct sockaddr_ll addr;
 	memset(&addr, 0x00, sizeof(addr));
 	addr.sll_family = AF_PACKET;
@@ -41,6 +167,22 @@ int get_sock(const char *if_name)
 	return s;
 }
 
+int get_sock(const char *if_name)
+{
+	return open_link(if_name, LINK_ALL);
+}
+
+int enable_control_priority(int budget)
+{
+	for (int i = 0; i < ROUTER_NUM_INTERFACES; i++) {
+		interfaces_control[i] = open_link(link_names[i], LINK_CONTROL);
+		if (attach_link_filter(interfaces[i], link_names[i], LINK_DATA) == -1)
+			return -1;
+	}
+	data_budget = budget;
+	return 0;
+}
+
 int send_to_link(int intidx, char *frame_data, size_t len)
 {
 	/*
@@ -53,6 +195,16 @@ int send_to_link(int intidx, char *frame_data, size_t len)
 	return ret;
 }
 
+int try_send_to_link(int intidx, char *frame_data, size_t len)
+{
+	ssize_t ret = send(interfaces[intidx], frame_data, len, MSG_DONTWAIT);
+
+	if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS))
+		return -1;
+	DIE(ret < 0, "send");
+	return ret;
+}
+
 ssize_t receive_from_link(int intidx, char *frame_data)
 {
 	ssize_t ret;
@@ -98,6 +250,202 @@ int recv_from_any_link(char *frame_data, size_t *length) {
 	return -1;
 }
 
+int recv_from_any_link_timeout(char *frame_data, size_t *length, int timeout_ms)
+{
+	int res;
+	fd_set set;
+	struct timeval tv;
+
+	if (timeout_ms < 0)
+		return recv_from_any_link(frame_data, length);
+
+	FD_ZERO(&set);
+	for (int i = 0; i < ROUTER_NUM_INTERFACES; i++) {
+		FD_SET(interfaces[i], &set);
+	}
+
+	tv.tv_sec = timeout_ms / 1000;
+	tv.tv_usec = (timeout_ms % 1000) * 1000;
+	res = select(interfaces[ROUTER_NUM_INTERFACES - 1] + 1, &set, NULL, NULL, &tv);
+	DIE(res == -1, "select");
+
+	for (int i = 0; i < ROUTER_NUM_INTERFACES; i++) {
+		if (FD_ISSET(interfaces[i], &set)) {
+			ssize_t ret = receive_from_link(i, frame_data);
+			DIE(ret < 0, "receive_from_link");
+			*length = ret;
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+/* Receive one frame without blocking, with its kernel receive timestamp
+ * (CLOCK_REALTIME nanoseconds) if stamp is not NULL. */
+static ssize_t recv_frame(int sock, char *frame, size_t frame_size, uint64_t *stamp)
+{
+	struct iovec iov = { .iov_base = frame, .iov_len = frame_size };
+	char control[CMSG_SPACE(sizeof(struct timespec))];
+	struct msghdr msg = { 0 };
+	ssize_t ret;
+
+	if (stamp == NULL)
+		return recv(sock, frame, frame_size, MSG_DONTWAIT);
+
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	ret = recvmsg(sock, &msg, MSG_DONTWAIT);
+	*stamp = 0;
+	for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); ret >= 0 && c != NULL; c = CMSG_NXTHDR(&msg, c)) {
+		if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_TIMESTAMPNS) {
+			struct timespec ts;
+
+			memcpy(&ts, CMSG_DATA(c), sizeof(ts));
+			*stamp = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+		}
+	}
+	return ret;
+}
+
+/* Drain the sockets of the links in the mask without blocking, until the
+ * burst has max frames. count frames are already in the burst. */
+static int drain_links(const int *socks, unsigned int mask, char **frames, size_t frame_size,
+		       size_t *lengths, int *links, uint64_t *stamps, int count, int max)
+{
+	for (int i = 0; i < ROUTER_NUM_INTERFACES && count < max; i++) {
+		if (!(mask & (1u << i)))
+			continue;
+
+		while (count < max) {
+			ssize_t ret = recv_frame(socks[i], frames[count], frame_size,
+						 stamps != NULL ? &stamps[count] : NULL);
+
+			if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+				break;
+			DIE(ret < 0, "recv");
+
+			lengths[count] = ret;
+			links[count] = i;
+			count++;
+		}
+	}
+
+	return count;
+}
+
+/* Drain the control frames first, all of them, then at most data_budget
+ * data frames of the links in the mask. */
+static int drain_by_priority(unsigned int mask, char **frames, size_t frame_size, size_t *lengths,
+			     int *links, uint64_t *stamps, int max)
+{
+	if (data_budget == 0)
+		return drain_links(interfaces, mask, frames, frame_size, lengths, links, stamps, 0, max);
+
+	int count = drain_links(interfaces_control, (1u << ROUTER_NUM_INTERFACES) - 1, frames,
+				frame_size, lengths, links, stamps, 0, max);
+	int data_max = max - count < data_budget ? max : count + data_budget;
+
+	return drain_links(interfaces, mask, frames, frame_size, lengths, links, stamps, count,
+			   data_max);
+}
+
+int recv_burst_from_links(char **frames, size_t frame_size, size_t *lengths, int *links,
+			  uint64_t *stamps, int max, int timeout_ms, unsigned int wait_writable)
+{
+	int res, max_fd = 0;
+	unsigned int ready = 0;
+	fd_set set, write_set;
+	struct timeval tv, *tvp = NULL;
+
+	FD_ZERO(&set);
+	FD_ZERO(&write_set);
+	for (int i = 0; i < ROUTER_NUM_INTERFACES; i++) {
+		FD_SET(interfaces[i], &set);
+		if (wait_writable & (1u << i))
+			FD_SET(interfaces[i], &write_set);
+		if (interfaces[i] > max_fd)
+			max_fd = interfaces[i];
+		if (data_budget > 0) {
+			FD_SET(interfaces_control[i], &set);
+			if (interfaces_control[i] > max_fd)
+				max_fd = interfaces_control[i];
+		}
+	}
+
+	if (timeout_ms >= 0) {
+		tv.tv_sec = timeout_ms / 1000;
+		tv.tv_usec = (timeout_ms % 1000) * 1000;
+		tvp = &tv;
+	}
+
+	res = select(max_fd + 1, &set, &write_set, NULL, tvp);
+	DIE(res == -1, "select");
+
+	for (int i = 0; i < ROUTER_NUM_INTERFACES; i++)
+		if (FD_ISSET(interfaces[i], &set))
+			ready |= 1u << i;
+
+	return drain_by_priority(ready, frames, frame_size, lengths, links, stamps, max);
+}
+
+int poll_burst_from_links(char **frames, size_t frame_size, size_t *lengths, int *links,
+			  uint64_t *stamps, int max)
+{
+	return drain_by_priority((1u << ROUTER_NUM_INTERFACES) - 1, frames, frame_size, lengths,
+				 links, stamps, max);
+}
+
+int enable_rx_timestamps(void)
+{
+	int on = 1;
+
+	for (int i = 0; i < ROUTER_NUM_INTERFACES; i++) {
+		if (setsockopt(interfaces[i], SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) == -1)
+			return -1;
+		if (data_budget > 0 &&
+		    setsockopt(interfaces_control[i], SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) == -1)
+			return -1;
+	}
+	return 0;
+}
+
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+
+int enable_busy_poll(int usecs)
+{
+	int on = 1;
+
+	for (int i = 0; i < ROUTER_NUM_INTERFACES; i++) {
+		if (setsockopt(interfaces[i], SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs)) == -1)
+			return -1;
+		if (setsockopt(interfaces[i], SOL_SOCKET, SO_PREFER_BUSY_POLL, &on, sizeof(on)) == -1)
+			return -1;
+		if (data_budget == 0)
+			continue;
+		/* The control sockets are drained first, poll them the same way. */
+		if (setsockopt(interfaces_control[i], SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs)) == -1)
+			return -1;
+		if (setsockopt(interfaces_control[i], SOL_SOCKET, SO_PREFER_BUSY_POLL, &on, sizeof(on)) == -1)
+			return -1;
+	}
+	return 0;
+}
+
+int pin_to_cpu(int cpu)
+{
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return sched_setaffinity(0, sizeof(set), &set);
+}
+
 char *get_interface_ip(int interface)
 {
 	struct ifreq ifr;
@@ -112,6 +460,75 @@ char *get_interface_ip(int interface)
 	return inet_ntoa(((struct sockaddr_in *)&ifr.ifr_addr)->sin_addr);
 }
 
+uint32_t get_interface_netmask(int interface)
+{
+	struct ifreq ifr;
+	int ret;
+	if (interface == 0)
+		sprintf(ifr.ifr_name, "rr-0-1");
+	else
+		sprintf(ifr.ifr_name, "r-%u", interface - 1);
+	ret = ioctl(interfaces[interface], SIOCGIFNETMASK, &ifr);
+	DIE(ret == -1, "ioctl SIOCGIFNETMASK");
+	return ((struct sockaddr_in *)&ifr.ifr_netmask)->sin_addr.s_addr;
+}
+
+int get_interface_mtu(int interface)
+{
+	struct ifreq ifr;
+	int ret;
+	if (interface == 0)
+		sprintf(ifr.ifr_name, "rr-0-1");
+	else
+		sprintf(ifr.ifr_name, "r-%u", interface - 1);
+	ret = ioctl(interfaces[interface], SIOCGIFMTU, &ifr);
+	DIE(ret == -1, "ioctl SIOCGIFMTU");
+	return ifr.ifr_mtu;
+}
+
+int set_interface_mtu(int interface, int mtu)
+{
+	struct ifreq ifr;
+	if (interface == 0)
+		sprintf(ifr.ifr_name, "rr-0-1");
+	else
+		sprintf(ifr.ifr_name, "r-%u", interface - 1);
+	ifr.ifr_mtu = mtu;
+	return ioctl(interfaces[interface], SIOCSIFMTU, &ifr) == -1 ? -1 : 0;
+}
+
+int get_interface_ip6(int interface, struct in6_addr *addr, int link_local)
+{
+	struct ifaddrs *ifa_list, *ifa;
+	char name[IFNAMSIZ];
+	int ret = -1;
+
+	if (interface == 0)
+		sprintf(name, "rr-0-1");
+	else
+		sprintf(name, "r-%u", interface - 1);
+
+	if (getifaddrs(&ifa_list) == -1)
+		return -1;
+
+	for (ifa = ifa_list; ifa != NULL; ifa = ifa->ifa_next) {
+		if (ifa->ifa_addr == NULL || ifa->ifa_addr->sa_family != AF_INET6)
+			continue;
+		if (strcmp(ifa->ifa_name, name) != 0)
+			continue;
+
+		struct in6_addr *a = &((struct sockaddr_in6 *)ifa->ifa_addr)->sin6_addr;
+		if (IN6_IS_ADDR_LINKLOCAL(a) == !!link_local) {
+			memcpy(addr, a, sizeof(struct in6_addr));
+			ret = 0;
+			break;
+		}
+	}
+
+	freeifaddrs(ifa_list);
+	return ret;
+}
+
 void get_interface_mac(int interface, uint8_t *mac)
 {
 	struct ifreq ifr;
@@ -173,6 +590,7 @@ void init(int argc, char *argv[])
 {
 	for (int i = 0; i < argc; ++i) {
 		printf("Setting up interface: %s\n", argv[i]);
+		strncpy(link_names[i], argv[i], IFNAMSIZ - 1);
 		interfaces[i] = get_sock(argv[i]);
 	}
 }
@@ -197,6 +615,38 @@ uint16_t checksum(uint16_t *data, size_t len)
 	return (uint16_t)(~checksum);
 }
 
+uint32_t checksum_partial(uint32_t sum, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+
+	while (len > 1) {
+		sum += (p[0] << 8) | p[1];
+		p += 2;
+		len -= 2;
+	}
+	if (len)
+		sum += p[0] << 8;
+
+	return sum;
+}
+
+uint16_t checksum_fold(uint32_t sum)
+{
+	sum = (sum >> 16) + (sum & 0xffff);
+	sum += (sum >> 16);
+	return (uint16_t)(~sum);
+}
+
+uint16_t checksum_update(uint16_t check, uint16_t old_word, uint16_t new_word)
+{
+	/* HC' = ~(~HC + ~m + m') */
+	uint32_t sum = (uint16_t)~check + (uint16_t)~old_word + new_word;
+
+	sum = (sum >> 16) + (sum & 0xffff);
+	sum += (sum >> 16);
+	return (uint16_t)(~sum);
+}
+
 int read_rtable(const char *path, struct route_table_entry *rtable)
 {
 	FILE *fp = fopen(path, "r");
@@ -226,6 +676,81 @@ int read_rtable(const char *path, struct route_table_entry *rtable)
 	return j;
 }
 
+int rtable_compare(const void *a, const void *b)
+{
+	const struct route_table_entry *entry_a = a;
+	const struct route_table_entry *entry_b = b;
+
+	/* a larger mask first */
+	if (entry_a->mask != entry_b->mask)
+		return entry_a->mask > entry_b->mask ? -1 : 1;
+
+	/* then a larger prefix first */
+	if (entry_a->prefix != entry_b->prefix)
+		return entry_a->prefix > entry_b->prefix ? -1 : 1;
+	return 0;
+}
+
+struct route_table_entry *rtable_lookup(struct route_table_entry *rtable, uint32_t target_ip,
+					uint32_t left, uint32_t right)
+{
+	while (left <= right) {
+		uint32_t mid = (left + right) / 2;
+		uint32_t masked_dest_ip = target_ip & rtable[mid].mask;
+
+		if (masked_dest_ip == rtable[mid].prefix) {
+			if (left == right)
+				return &rtable[mid];
+
+			/* Longer prefixes sort first, so a longer match can only be
+			 * between 0 and mid. */
+			return rtable_lookup(rtable, target_ip, 0, mid);
+		}
+
+		if (masked_dest_ip > rtable[mid].prefix) {
+			/* nothing left of the first entry, right would wrap */
+			if (mid == 0)
+				break;
+			right = mid - 1;
+		} else {
+			left = mid + 1;
+		}
+	}
+
+	return NULL;
+}
+
+int read_rtable6(const char *path, struct route6_table_entry *rtable6, int max_size)
+{
+	FILE *fp = fopen(path, "r");
+	char line[256], prefix[INET6_ADDRSTRLEN + 4], next_hop[INET6_ADDRSTRLEN];
+	int j = 0;
+
+	DIE(fp == NULL, "Failed to open %s", path);
+	while (j < max_size && fgets(line, sizeof(line), fp) != NULL) {
+		char *slash;
+
+		if (sscanf(line, "%49s %45s %d", prefix, next_hop, &rtable6[j].interface) != 3)
+			continue;
+
+		slash = strchr(prefix, '/');
+		rtable6[j].len = 128;
+		if (slash != NULL) {
+			*slash = '\0';
+			rtable6[j].len = atoi(slash + 1);
+		}
+
+		if (inet_pton(AF_INET6, prefix, &rtable6[j].prefix) != 1 ||
+		    inet_pton(AF_INET6, next_hop, &rtable6[j].next_hop) != 1) {
+			fprintf(stderr, "Invalid IPv6 route: %s", line);
+			continue;
+		}
+		j++;
+	}
+	fclose(fp);
+	return j;
+}
+
 int parse_arp_table(char *path, struct arp_entry *arp_table)
 {
 	FILE *f;
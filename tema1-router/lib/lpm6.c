@@ -0,0 +1,90 @@
+#include "lpm6.h"
+#include "hugepage.h"
+#include "lib.h"
+#include <stdlib.h>
+
+static struct lpm6_node *node_create(struct lpm6 *t)
+{
+	struct lpm6_node *node;
+
+	if (t->chunk_free == 0) {
+		t->chunk = huge_alloc(LPM6_CHUNK_NODES * sizeof(struct lpm6_node), "lpm6 nodes");
+		t->chunk_free = LPM6_CHUNK_NODES;
+	}
+	node = &t->chunk[LPM6_CHUNK_NODES - t->chunk_free--];
+
+	for (int i = 0; i < LPM6_NODE_SLOTS; i++) {
+		node->slots[i].child = NULL;
+		node->slots[i].route = -1;
+		node->slots[i].len = 0;
+	}
+	t->nodes++;
+	return node;
+}
+
+struct lpm6 *lpm6_create(void)
+{
+	struct lpm6 *t = malloc(sizeof(struct lpm6));
+
+	DIE(t == NULL, "malloc");
+	t->nodes = 0;
+	t->chunk = NULL;
+	t->chunk_free = 0;
+	t->default_route = -1;
+	t->root = node_create(t);
+	return t;
+}
+
+void lpm6_insert(struct lpm6 *t, const struct in6_addr *prefix, int len, int32_t route)
+{
+	struct lpm6_node *node = t->root;
+	int level = 0;
+
+	if (len <= 0) {
+		t->default_route = route;
+		return;
+	}
+	if (len > 128)
+		len = 128;
+
+	/* walk down to the level holding the last, possibly partial, byte */
+	while (len > (level + 1) * LPM6_STRIDE) {
+		struct lpm6_slot *slot = &node->slots[prefix->s6_addr[level]];
+
+		if (slot->child == NULL)
+			slot->child = node_create(t);
+		node = slot->child;
+		level++;
+	}
+
+	/* expand the prefix over all the slots it covers at this level,
+	 * without overwriting longer prefixes already expanded there */
+	int bits = len - level * LPM6_STRIDE;
+	int span = 1 << (LPM6_STRIDE - bits);
+	int first = prefix->s6_addr[level] & ~(span - 1) & (LPM6_NODE_SLOTS - 1);
+
+	for (int i = first; i < first + span; i++) {
+		struct lpm6_slot *slot = &node->slots[i];
+
+		if (slot->route < 0 || slot->len <= len) {
+			slot->route = route;
+			slot->len = len;
+		}
+	}
+}
+
+int32_t lpm6_lookup(struct lpm6 *t, const struct in6_addr *addr)
+{
+	struct lpm6_node *node = t->root;
+	int32_t best = t->default_route;
+
+	for (int level = 0; level < 16 && node != NULL; level++) {
+		struct lpm6_slot *slot = &node->slots[addr->s6_addr[level]];
+
+		if (slot->route >= 0)
+			best = slot->route;
+		node = slot->child;
+	}
+
+	return best;
+}
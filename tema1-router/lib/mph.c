@@ -0,0 +1,88 @@
+#include "mph.h"
+#include "lib.h"
+#include <string.h>
+
+struct mph_bucket {
+	uint32_t index;
+	uint32_t count;
+	uint32_t first;		/* of its keys in the keys grouped by bucket */
+};
+
+static int by_size(const void *a, const void *b)
+{
+	const struct mph_bucket *x = a, *y = b;
+
+	return (int)y->count - (int)x->count;
+}
+
+int mph_build(struct mph *m, const uint32_t *keys, uint32_t n)
+{
+	uint32_t num_buckets = n / MPH_BUCKET_KEYS + 1;
+	struct mph_bucket *buckets = calloc(num_buckets, sizeof(struct mph_bucket));
+	uint32_t *grouped = malloc(sizeof(uint32_t) * (n + 1));
+	uint32_t *slots = malloc(sizeof(uint32_t) * (n + 1));
+	uint32_t *seeds = calloc(num_buckets, sizeof(uint32_t));
+	uint8_t *taken = calloc(n + 1, 1);
+	uint32_t *fill = calloc(num_buckets, sizeof(uint32_t));
+	int ret = 0;
+
+	DIE(!buckets || !grouped || !slots || !seeds || !taken || !fill, "calloc");
+
+	m->size = n;
+	m->num_buckets = num_buckets;
+	m->seeds = seeds;
+
+	/* group the keys by bucket */
+	for (uint32_t i = 0; i < n; i++)
+		buckets[mph_hash(keys[i], 0x5bd1e995) % num_buckets].count++;
+	for (uint32_t b = 0, first = 0; b < num_buckets; b++) {
+		buckets[b].index = b;
+		buckets[b].first = first;
+		first += buckets[b].count;
+	}
+	for (uint32_t i = 0; i < n; i++) {
+		struct mph_bucket *bucket = &buckets[mph_hash(keys[i], 0x5bd1e995) % num_buckets];
+
+		grouped[bucket->first + fill[bucket->index]++] = keys[i];
+	}
+
+	qsort(buckets, num_buckets, sizeof(struct mph_bucket), by_size);
+
+	/* displace the buckets, the largest first while most slots are free */
+	for (uint32_t b = 0; b < num_buckets && buckets[b].count > 0 && ret == 0; b++) {
+		struct mph_bucket *bucket = &buckets[b];
+		uint32_t *bucket_keys = grouped + bucket->first;
+		uint32_t seed;
+
+		for (seed = 1; seed < MPH_MAX_SEED; seed++) {
+			uint32_t k;
+
+			for (k = 0; k < bucket->count; k++) {
+				slots[k] = mph_hash(bucket_keys[k], seed) % n;
+				if (taken[slots[k]])
+					break;
+				taken[slots[k]] = 1;
+			}
+			if (k == bucket->count)
+				break;
+
+			/* undo the partial placement, it also catches two keys of
+			 * the bucket on the same slot */
+			while (k-- > 0)
+				taken[slots[k]] = 0;
+		}
+
+		if (seed == MPH_MAX_SEED) {
+			ret = -1;
+			break;
+		}
+		seeds[bucket->index] = seed;
+	}
+
+	free(buckets);
+	free(grouped);
+	free(slots);
+	free(taken);
+	free(fill);
+	return ret;
+}
@@ -0,0 +1,327 @@
+#include "nat.h"
+#include "hugepage.h"
+#include "lib.h"
+#include "protocols.h"
+#include <string.h>
+#include <arpa/inet.h>
+
+#define NAT_DIR_OUT 0
+#define NAT_DIR_IN 1
+
+#define PROTO_ICMP 1
+#define PROTO_TCP 6
+#define PROTO_UDP 17
+#define ICMP_ECHO_REPLY 0
+#define ICMP_ECHO_REQUEST 8
+
+/* Where the translated fields of a packet are. For ICMP echo both ports
+ * point to the identifier. */
+struct nat_fields {
+	uint16_t *sport;
+	uint16_t *dport;
+	uint16_t *check;
+	int pseudo;	/* the L4 checksum covers the addresses */
+	int udp;	/* a zero UDP checksum means none */
+};
+
+static uint32_t nat_hash(uint32_t a, uint32_t b, uint16_t p1, uint16_t p2, uint8_t proto)
+{
+	uint32_t h = a * 0x9e3779b1;
+
+	h ^= b + 0x7f4a7c15 + (h << 6) + (h >> 2);
+	h ^= ((uint32_t)p1 << 16 | p2) + 0x7f4a7c15 + (h << 6) + (h >> 2);
+	h ^= proto;
+
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	return h;
+}
+
+/* Outbound key: inside address and port, remote address and port.
+ * Inbound key: remote address and port, external port. */
+static int key_matches(struct nat_session *s, int dir, uint32_t a, uint32_t b,
+		       uint16_t p1, uint16_t p2, uint8_t proto)
+{
+	if (s->proto != proto || s->remote_addr != b || s->remote_port != p2)
+		return 0;
+	if (dir == NAT_DIR_OUT)
+		return s->in_addr == a && s->in_port == p1;
+	return s->ext_port == p1;
+}
+
+static uint32_t session_hash(struct nat_session *s, int dir)
+{
+	if (dir == NAT_DIR_OUT)
+		return nat_hash(s->in_addr, s->remote_addr, s->in_port, s->remote_port, s->proto);
+	return nat_hash(0, s->remote_addr, s->ext_port, s->remote_port, s->proto);
+}
+
+static int32_t table_lookup(struct nat *nat, int dir, uint32_t hash, uint32_t a, uint32_t b,
+			    uint16_t p1, uint16_t p2, uint8_t proto)
+{
+	for (uint32_t i = hash & nat->table_mask;; i = (i + 1) & nat->table_mask) {
+		struct nat_slot *slot = &nat->table[i];
+
+		if (slot->ref < 0)
+			return -1;
+		if (slot->hash == hash && (slot->ref & 1) == dir &&
+		    key_matches(&nat->sessions[slot->ref >> 1], dir, a, b, p1, p2, proto))
+			return slot->ref >> 1;
+	}
+}
+
+static void table_insert(struct nat *nat, uint32_t hash, int32_t ref)
+{
+	uint32_t i = hash & nat->table_mask;
+
+	while (nat->table[i].ref >= 0)
+		i = (i + 1) & nat->table_mask;
+	nat->table[i].hash = hash;
+	nat->table[i].ref = ref;
+}
+
+/* linear probing deletion: shift back the following slots of the cluster
+ * that would no longer be reachable, so no tombstones are needed */
+static void table_remove(struct nat *nat, uint32_t hash, int32_t ref)
+{
+	uint32_t i = hash & nat->table_mask;
+
+	while (nat->table[i].ref != ref)
+		i = (i + 1) & nat->table_mask;
+
+	for (uint32_t j = (i + 1) & nat->table_mask;; j = (j + 1) & nat->table_mask) {
+		struct nat_slot *slot = &nat->table[j];
+
+		if (slot->ref < 0)
+			break;
+
+		uint32_t home = slot->hash & nat->table_mask;
+		/* move it if its home is not in (i, j] (cyclically) */
+		if ((i < j) ? (home <= i || home > j) : (home <= i && home > j)) {
+			nat->table[i] = *slot;
+			i = j;
+		}
+	}
+	nat->table[i].ref = -1;
+}
+
+static int parse_fields(struct iphdr *ip_hdr, size_t len, struct nat_fields *f)
+{
+	size_t ihl = ip_hdr->ihl * 4;
+	char *l4 = (char *)ip_hdr + ihl;
+
+	/* non-first fragments carry no ports */
+	if ((ntohs(ip_hdr->frag_off) & 0x1fff) != 0 || len < ihl + 8)
+		return -1;
+
+	switch (ip_hdr->protocol) {
+	case PROTO_TCP:
+		if (len < ihl + 20)
+			return -1;
+		f->sport = (uint16_t *)l4;
+		f->dport = (uint16_t *)(l4 + 2);
+		f->check = (uint16_t *)(l4 + 16);
+		f->pseudo = 1;
+		f->udp = 0;
+		return 0;
+	case PROTO_UDP:
+		f->sport = (uint16_t *)l4;
+		f->dport = (uint16_t *)(l4 + 2);
+		f->check = (uint16_t *)(l4 + 6);
+		f->pseudo = 1;
+		f->udp = 1;
+		return 0;
+	case PROTO_ICMP:
+		if (l4[0] != ICMP_ECHO_REQUEST && l4[0] != ICMP_ECHO_REPLY)
+			return -1;
+		f->sport = f->dport = (uint16_t *)(l4 + 4);
+		f->check = (uint16_t *)(l4 + 2);
+		f->pseudo = 0;
+		f->udp = 0;
+		return 0;
+	}
+	return -1;
+}
+
+/* rewrite an address and a port, patching the checksums incrementally */
+static void rewrite(struct iphdr *ip_hdr, struct nat_fields *f, uint32_t *addr, uint32_t new_addr,
+		    uint16_t *port, uint16_t new_port)
+{
+	uint32_t old_addr = *addr;
+	uint16_t old_port = *port;
+	int has_check = !(f->udp && *f->check == 0);
+
+	*addr = new_addr;
+	*port = new_port;
+
+	ip_hdr->check = checksum_update(ip_hdr->check, old_addr >> 16, new_addr >> 16);
+	ip_hdr->check = checksum_update(ip_hdr->check, old_addr & 0xffff, new_addr & 0xffff);
+
+	if (!has_check)
+		return;
+
+	uint16_t check = *f->check;
+	if (f->pseudo) {
+		check = checksum_update(check, old_addr >> 16, new_addr >> 16);
+		check = checksum_update(check, old_addr & 0xffff, new_addr & 0xffff);
+	}
+	check = checksum_update(check, old_port, new_port);
+	if (f->udp && check == 0)
+		check = 0xffff;
+	*f->check = check;
+}
+
+static uint32_t session_timeout(struct nat_session *s)
+{
+	if (s->proto == PROTO_TCP)
+		return NAT_TCP_TIMEOUT;
+	if (s->proto == PROTO_UDP)
+		return NAT_UDP_TIMEOUT;
+	return NAT_ICMP_TIMEOUT;
+}
+
+struct nat *nat_create(uint32_t ext_addr, int outside, uint32_t max_sessions)
+{
+	struct nat *nat = calloc(1, sizeof(struct nat));
+	uint32_t table_size = 1;
+
+	DIE(nat == NULL, "calloc");
+
+	/* two slots per session, at most half full */
+	while (table_size < max_sessions * 4)
+		table_size <<= 1;
+
+	nat->ext_addr = ext_addr;
+	nat->outside = outside;
+	nat->max_sessions = max_sessions;
+	nat->sessions = huge_alloc(sizeof(struct nat_session) * max_sessions, "nat sessions");
+	nat->table = huge_alloc(sizeof(struct nat_slot) * table_size, "nat table");
+	nat->table_mask = table_size - 1;
+
+	for (uint32_t i = 0; i < table_size; i++)
+		nat->table[i].ref = -1;
+	for (uint32_t i = 0; i < max_sessions; i++)
+		nat->sessions[i].next_free = i + 1 < max_sessions ? (int32_t)(i + 1) : -1;
+	nat->free_head = 0;
+
+	return nat;
+}
+
+static int32_t session_create(struct nat *nat, uint32_t hash, uint32_t in_addr, uint32_t remote_addr,
+			      uint16_t in_port, uint16_t remote_port, uint8_t proto)
+{
+	int32_t index = nat->free_head;
+	uint32_t range = NAT_PORT_MAX - NAT_PORT_MIN + 1;
+
+	if (index < 0)
+		return -1;
+
+	/* Pick a free external port, starting from one derived from the flow.
+	 * A port only has to be unique towards a given remote endpoint. */
+	for (int attempt = 0; attempt < NAT_PORT_ATTEMPTS; attempt++) {
+		uint16_t ext_port = htons(NAT_PORT_MIN + (hash + attempt) % range);
+		uint32_t in_hash = nat_hash(0, remote_addr, ext_port, remote_port, proto);
+
+		if (table_lookup(nat, NAT_DIR_IN, in_hash, 0, remote_addr, ext_port, remote_port, proto) >= 0)
+			continue;
+
+		struct nat_session *s = &nat->sessions[index];
+		nat->free_head = s->next_free;
+
+		s->in_addr = in_addr;
+		s->remote_addr = remote_addr;
+		s->in_port = in_port;
+		s->ext_port = ext_port;
+		s->remote_port = remote_port;
+		s->proto = proto;
+		s->in_use = 1;
+		s->last_seen = nat->now;
+
+		table_insert(nat, hash, index << 1 | NAT_DIR_OUT);
+		table_insert(nat, in_hash, index << 1 | NAT_DIR_IN);
+		nat->active++;
+		nat->created++;
+		return index;
+	}
+
+	return -1;
+}
+
+static void session_delete(struct nat *nat, int32_t index)
+{
+	struct nat_session *s = &nat->sessions[index];
+
+	table_remove(nat, session_hash(s, NAT_DIR_OUT), index << 1 | NAT_DIR_OUT);
+	table_remove(nat, session_hash(s, NAT_DIR_IN), index << 1 | NAT_DIR_IN);
+
+	s->in_use = 0;
+	s->next_free = nat->free_head;
+	nat->free_head = index;
+	nat->active--;
+	nat->expired++;
+}
+
+int nat_out(struct nat *nat, struct iphdr *ip_hdr, size_t len)
+{
+	struct nat_fields f;
+
+	if (parse_fields(ip_hdr, len, &f) < 0)
+		return -1;
+
+	uint16_t remote_port = ip_hdr->protocol == PROTO_ICMP ? 0 : *f.dport;
+	uint32_t hash = nat_hash(ip_hdr->saddr, ip_hdr->daddr, *f.sport, remote_port, ip_hdr->protocol);
+	int32_t index = table_lookup(nat, NAT_DIR_OUT, hash, ip_hdr->saddr, ip_hdr->daddr,
+				     *f.sport, remote_port, ip_hdr->protocol);
+
+	if (index < 0) {
+		index = session_create(nat, hash, ip_hdr->saddr, ip_hdr->daddr, *f.sport, remote_port,
+				       ip_hdr->protocol);
+		if (index < 0) {
+			nat->failed++;
+			return -1;
+		}
+	}
+
+	struct nat_session *s = &nat->sessions[index];
+	s->last_seen = nat->now;
+	rewrite(ip_hdr, &f, &ip_hdr->saddr, nat->ext_addr, f.sport, s->ext_port);
+	return 0;
+}
+
+int nat_in(struct nat *nat, struct iphdr *ip_hdr, size_t len)
+{
+	struct nat_fields f;
+
+	if (parse_fields(ip_hdr, len, &f) < 0)
+		return -1;
+
+	uint16_t remote_port = ip_hdr->protocol == PROTO_ICMP ? 0 : *f.sport;
+	uint32_t hash = nat_hash(0, ip_hdr->saddr, *f.dport, remote_port, ip_hdr->protocol);
+	int32_t index = table_lookup(nat, NAT_DIR_IN, hash, 0, ip_hdr->saddr, *f.dport,
+				     remote_port, ip_hdr->protocol);
+
+	if (index < 0)
+		return -1;
+
+	struct nat_session *s = &nat->sessions[index];
+	s->last_seen = nat->now;
+	rewrite(ip_hdr, &f, &ip_hdr->daddr, s->in_addr, f.dport, s->in_port);
+	return 0;
+}
+
+void nat_sweep(struct nat *nat, uint32_t now, uint32_t budget)
+{
+	nat->now = now;
+
+	for (uint32_t i = 0; i < budget && i < nat->max_sessions; i++) {
+		int32_t index = nat->sweep_cursor;
+		struct nat_session *s = &nat->sessions[index];
+
+		nat->sweep_cursor = (nat->sweep_cursor + 1) % nat->max_sessions;
+		if (s->in_use && now - s->last_seen > session_timeout(s))
+			session_delete(nat, index);
+	}
+}
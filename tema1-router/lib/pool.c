@@ -0,0 +1,78 @@
+#include "pool.h"
+#include "hugepage.h"
+#include "lib.h"
+
+struct pool *pool_create(size_t buf_size, int count, const char *name)
+{
+	struct pool *p = malloc(sizeof(struct pool));
+
+	DIE(p == NULL, "malloc");
+
+	/* keep every buffer cache line aligned */
+	buf_size = (buf_size + 63) & ~(size_t)63;
+
+	p->buf_size = buf_size;
+	p->count = count;
+	p->mem = huge_alloc(buf_size * count, name);
+	p->free_stack = malloc(sizeof(void *) * count);
+	DIE(p->free_stack == NULL, "malloc");
+
+	for (int i = 0; i < count; i++)
+		p->free_stack[i] = p->mem + (size_t)(count - 1 - i) * buf_size;
+	p->free_count = count;
+
+	return p;
+}
+
+void *pool_get(struct pool *p)
+{
+	if (p->free_count == 0)
+		return NULL;
+	return p->free_stack[--p->free_count];
+}
+
+void pool_put(struct pool *p, void *buf)
+{
+	p->free_stack[p->free_count++] = buf;
+}
+
+struct pool_set *pool_set_create(const size_t *sizes, const int *counts, int count,
+				 const char *name)
+{
+	struct pool_set *set = malloc(sizeof(struct pool_set));
+	char class_name[64];
+
+	DIE(set == NULL, "malloc");
+	DIE(count > POOL_SET_MAX_CLASSES, "too many pool classes");
+
+	set->count = count;
+	for (int i = 0; i < count; i++) {
+		snprintf(class_name, sizeof(class_name), "%s %zu", name, sizes[i]);
+		set->classes[i] = pool_create(sizes[i], counts[i], class_name);
+	}
+
+	return set;
+}
+
+void *pool_set_get(struct pool_set *set, size_t len)
+{
+	for (int i = 0; i < set->count; i++) {
+		struct pool *p = set->classes[i];
+
+		if (p->buf_size >= len && p->free_count > 0)
+			return pool_get(p);
+	}
+	return NULL;
+}
+
+void pool_set_put(struct pool_set *set, void *buf)
+{
+	for (int i = 0; i < set->count; i++) {
+		struct pool *p = set->classes[i];
+
+		if ((char *)buf >= p->mem && (char *)buf < p->mem + p->buf_size * p->count) {
+			pool_put(p, buf);
+			return;
+		}
+	}
+}
@@ -0,0 +1,249 @@
+#include "rip.h"
+#include "fib4.h"
+#include "hugepage.h"
+#include "lib.h"
+#include <string.h>
+#include <arpa/inet.h>
+
+static int mask_len(uint32_t mask)
+{
+	return __builtin_popcount(mask);
+}
+
+struct rip *rip_create(uint32_t max_routes)
+{
+	struct rip *rip = calloc(1, sizeof(struct rip));
+
+	DIE(rip == NULL, "calloc");
+
+	rip->max_routes = max_routes;
+	rip->routes = huge_alloc(sizeof(struct rip_route) * max_routes, "rip routes");
+	rip->dirty = huge_alloc(sizeof(uint32_t) * max_routes, "rip dirty list");
+	rip->used = huge_alloc(sizeof(uint32_t) * max_routes, "rip used list");
+	rip->changed_list = huge_alloc(sizeof(uint32_t) * max_routes, "rip changed list");
+	rip->index = fib4_create(max_routes);
+
+	for (uint32_t i = 0; i < max_routes; i++)
+		rip->routes[i].next_free = i + 1 < max_routes ? (int32_t)(i + 1) : -1;
+	rip->free_head = 0;
+
+	return rip;
+}
+
+static void mark_changed(struct rip *rip, int32_t index)
+{
+	struct rip_route *r = &rip->routes[index];
+
+	if (!r->changed) {
+		r->changed = 1;
+		rip->changed_list[rip->changed_count++] = index;
+	}
+	rip->changed = 1;
+	if (!r->dirty) {
+		r->dirty = 1;
+		rip->dirty[rip->dirty_count++] = index;
+	}
+}
+
+static int32_t new_route(struct rip *rip, uint32_t prefix, uint32_t mask)
+{
+	int32_t index = rip->free_head;
+
+	if (index < 0)
+		return -1;
+	rip->free_head = rip->routes[index].next_free;
+
+	struct rip_route *r = &rip->routes[index];
+	memset(r, 0, sizeof(*r));
+	r->prefix = prefix;
+	r->mask = mask;
+	r->in_use = 1;
+	r->used_pos = rip->used_count;
+	rip->used[rip->used_count++] = index;
+	fib4_set(rip->index, ntohl(prefix), mask_len(ntohl(mask)), index);
+	return index;
+}
+
+static void free_route(struct rip *rip, int32_t index)
+{
+	struct rip_route *r = &rip->routes[index];
+
+	fib4_delete(rip->index, ntohl(r->prefix), mask_len(ntohl(r->mask)));
+
+	/* the last route of the used list takes its place */
+	rip->used[r->used_pos] = rip->used[--rip->used_count];
+	rip->routes[rip->used[r->used_pos]].used_pos = r->used_pos;
+
+	r->in_use = 0;
+	r->next_free = rip->free_head;
+	rip->free_head = index;
+}
+
+void rip_add_connected(struct rip *rip, uint32_t prefix, uint32_t mask, int interface)
+{
+	int32_t index = new_route(rip, prefix & mask, mask);
+
+	DIE(index < 0, "rip table full");
+	rip->routes[index].interface = interface;
+	rip->routes[index].metric = 1;
+	rip->routes[index].connected = 1;
+	mark_changed(rip, index);
+}
+
+/* Bellman-Ford on one advertised route (RFC 2453 3.9.2) */
+static void update_route(struct rip *rip, uint32_t src, int interface, struct rip_entry *e, uint64_t now_ms)
+{
+	uint32_t metric = ntohl(e->metric);
+	uint32_t mask = e->mask;
+	uint32_t next_hop = e->next_hop != 0 ? e->next_hop : src;
+
+	if (ntohs(e->family) != RIP_AF_INET || metric < 1 || metric > RIP_INFINITY)
+		return;
+	/* the mask must be contiguous */
+	if ((~ntohl(mask) & (~ntohl(mask) + 1)) != 0)
+		return;
+
+	metric = metric + 1 < RIP_INFINITY ? metric + 1 : RIP_INFINITY;
+
+	int32_t index = fib4_find(rip->index, ntohl(e->addr & mask), mask_len(ntohl(mask)));
+	if (index < 0) {
+		if (metric == RIP_INFINITY)
+			return;
+		index = new_route(rip, e->addr & mask, mask);
+		if (index < 0)
+			return;
+
+		struct rip_route *r = &rip->routes[index];
+		r->next_hop = next_hop;
+		r->interface = interface;
+		r->metric = metric;
+		r->updated_ms = now_ms;
+		mark_changed(rip, index);
+		return;
+	}
+
+	struct rip_route *r = &rip->routes[index];
+	if (r->connected)
+		return;
+
+	if (r->next_hop == next_hop && r->interface == interface) {
+		/* news from the current next hop are always believed */
+		if (metric != r->metric) {
+			r->metric = metric;
+			r->updated_ms = now_ms;
+			mark_changed(rip, index);
+		}
+		else if (metric < RIP_INFINITY) {
+			r->updated_ms = now_ms;
+		}
+	}
+	else if (metric < r->metric) {
+		r->next_hop = next_hop;
+		r->interface = interface;
+		r->metric = metric;
+		r->updated_ms = now_ms;
+		mark_changed(rip, index);
+	}
+}
+
+int rip_input(struct rip *rip, uint32_t src, int interface, const uint8_t *payload, size_t len,
+	      uint64_t now_ms)
+{
+	const struct rip_header *hdr = (const struct rip_header *)payload;
+	struct rip_entry entry;
+
+	if (len < sizeof(struct rip_header) || hdr->version != RIP_VERSION)
+		return 0;
+
+	size_t count = (len - sizeof(struct rip_header)) / sizeof(struct rip_entry);
+
+	if (hdr->command == RIP_REQUEST)
+		return RIP_REQUEST;
+	if (hdr->command != RIP_RESPONSE)
+		return 0;
+
+	rip->responses++;
+	for (size_t i = 0; i < count; i++) {
+		memcpy(&entry, payload + sizeof(struct rip_header) + i * sizeof(struct rip_entry), sizeof(entry));
+		update_route(rip, src, interface, &entry, now_ms);
+	}
+	return 0;
+}
+
+void rip_expire(struct rip *rip, uint64_t now_ms)
+{
+	/* backwards, a freed route is replaced by one already seen */
+	for (uint32_t n = rip->used_count; n-- > 0;) {
+		uint32_t i = rip->used[n];
+		struct rip_route *r = &rip->routes[i];
+
+		if (r->connected)
+			continue;
+
+		if (r->metric < RIP_INFINITY && now_ms - r->updated_ms > RIP_TIMEOUT_MS) {
+			r->metric = RIP_INFINITY;
+			r->updated_ms = now_ms;
+			mark_changed(rip, i);
+		}
+		else if (r->metric == RIP_INFINITY && !r->dirty && !r->changed &&
+			 now_ms - r->updated_ms > RIP_GARBAGE_MS) {
+			free_route(rip, i);
+		}
+	}
+}
+
+void rip_advertise(struct rip *rip, int interface, int only_changed, rip_send_fn send)
+{
+	uint8_t payload[RIP_MAX_PAYLOAD];
+	struct rip_header *hdr = (struct rip_header *)payload;
+	struct rip_entry *entries = (struct rip_entry *)(hdr + 1);
+	uint32_t *list = only_changed ? rip->changed_list : rip->used;
+	uint32_t length = only_changed ? rip->changed_count : rip->used_count;
+	int count = 0;
+
+	hdr->command = RIP_RESPONSE;
+	hdr->version = RIP_VERSION;
+	hdr->zero = 0;
+
+	for (uint32_t n = 0; n < length; n++) {
+		struct rip_route *r = &rip->routes[list[n]];
+		struct rip_entry *e = &entries[count];
+		e->family = htons(RIP_AF_INET);
+		e->tag = 0;
+		e->addr = r->prefix;
+		e->mask = r->mask;
+		e->next_hop = 0;
+		/* poisoned reverse: routes learned on the interface are unreachable through us */
+		e->metric = htonl(!r->connected && r->interface == interface ? RIP_INFINITY : r->metric);
+
+		if (++count == RIP_ENTRIES_PER_PACKET) {
+			send(interface, payload, RIP_MAX_PAYLOAD);
+			count = 0;
+		}
+	}
+
+	if (count > 0)
+		send(interface, payload, sizeof(struct rip_header) + count * sizeof(struct rip_entry));
+}
+
+void rip_clear_changed(struct rip *rip)
+{
+	for (uint32_t n = 0; n < rip->changed_count; n++)
+		rip->routes[rip->changed_list[n]].changed = 0;
+	rip->changed_count = 0;
+	rip->changed = 0;
+}
+
+size_t rip_build_request(uint8_t *payload)
+{
+	struct rip_header *hdr = (struct rip_header *)payload;
+	struct rip_entry *e = (struct rip_entry *)(hdr + 1);
+
+	/* a single entry of family 0 and metric infinity asks for everything */
+	hdr->command = RIP_REQUEST;
+	hdr->version = RIP_VERSION;
+	hdr->zero = 0;
+	memset(e, 0, sizeof(*e));
+	e->metric = htonl(RIP_INFINITY);
+	return sizeof(*hdr) + sizeof(*e);
+}
@@ -0,0 +1,188 @@
+#include "timer.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+uint64_t timer_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint64_t now_tick(void)
+{
+	return timer_now_ms() / TIMER_TICK_MS;
+}
+
+static void list_init(struct timer *head)
+{
+	head->next = head->prev = head;
+}
+
+static void list_add_tail(struct timer *head, struct timer *t)
+{
+	t->prev = head->prev;
+	t->next = head;
+	head->prev->next = t;
+	head->prev = t;
+}
+
+static void list_del(struct timer *t)
+{
+	t->prev->next = t->next;
+	t->next->prev = t->prev;
+	t->next = t->prev = NULL;
+}
+
+void timer_wheel_init(struct timer_wheel *w)
+{
+	for (int i = 0; i < TIMER_WHEEL_SLOTS; i++)
+		list_init(&w->slots[i]);
+	w->current_tick = now_tick();
+	w->pending = 0;
+	w->next_expires = 0;
+}
+
+void timer_init(struct timer *t, timer_callback callback, void *arg)
+{
+	t->next = t->prev = NULL;
+	t->expires = 0;
+	t->callback = callback;
+	t->arg = arg;
+}
+
+int timer_pending(struct timer *t)
+{
+	return t->next != NULL;
+}
+
+void timer_add(struct timer_wheel *w, struct timer *t, uint32_t delay_ms)
+{
+	uint64_t expires;
+
+	timer_cancel(w, t);
+	if (w->pending == 0 && w->current_tick < now_tick())
+		w->current_tick = now_tick();	/* idle wheel, skip the empty ticks */
+
+	expires = now_tick() + (delay_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+
+	/* never land in the slot being processed, or a callback re-arming
+	 * itself with a zero delay would loop forever */
+	if (expires <= w->current_tick)
+		expires = w->current_tick + 1;
+
+	t->expires = expires;
+	list_add_tail(&w->slots[expires % TIMER_WHEEL_SLOTS], t);
+	w->pending++;
+	if (expires < w->next_expires)
+		w->next_expires = expires;
+}
+
+void timer_cancel(struct timer_wheel *w, struct timer *t)
+{
+	if (!timer_pending(t))
+		return;
+	list_del(t);
+	w->pending--;
+}
+
+int timer_wheel_run(struct timer_wheel *w, int budget)
+{
+	uint64_t target = now_tick();
+	int fired = 0;
+
+	while (w->current_tick <= target) {
+		struct timer *slot = &w->slots[w->current_tick % TIMER_WHEEL_SLOTS];
+		struct timer expired;
+
+		/* Move the slot to a private list so callbacks can freely add or
+		 * cancel timers, including the ones not processed yet. */
+		list_init(&expired);
+		if (slot->next != slot) {
+			expired.next = slot->next;
+			expired.prev = slot->prev;
+			expired.next->prev = &expired;
+			expired.prev->next = &expired;
+			list_init(slot);
+		}
+
+		while (expired.next != &expired && fired < budget) {
+			struct timer *t = expired.next;
+
+			list_del(t);
+			if (t->expires > w->current_tick) {
+				/* belongs to a later turn of the wheel */
+				list_add_tail(slot, t);
+				continue;
+			}
+
+			w->pending--;
+			t->callback(t->arg);
+			fired++;
+		}
+
+		if (expired.next != &expired) {
+			/* Out of budget: give the rest back to the slot and resume
+			 * from this tick on the next call. */
+			while (expired.next != &expired) {
+				struct timer *t = expired.next;
+
+				list_del(t);
+				list_add_tail(slot, t);
+			}
+			break;
+		}
+
+		w->current_tick++;
+	}
+
+	return fired;
+}
+
+/* Walk the slots in tick order from the current one: the first timer due in
+ * its own turn is the earliest. Timers of later turns only count if the whole
+ * wheel holds no other. After TIMER_SCAN_BUDGET timers, gives up with the tick
+ * being scanned, as no timer of the slots before it is due earlier. */
+static uint64_t earliest_expires(struct timer_wheel *w)
+{
+	uint64_t earliest = UINT64_MAX;
+	int budget = TIMER_SCAN_BUDGET;
+
+	for (uint64_t tick = w->current_tick; tick < w->current_tick + TIMER_WHEEL_SLOTS; tick++) {
+		struct timer *slot = &w->slots[tick % TIMER_WHEEL_SLOTS];
+
+		for (struct timer *t = slot->next; t != slot; t = t->next) {
+			if (t->expires < earliest)
+				earliest = t->expires;
+			if (--budget == 0)
+				return earliest < tick ? earliest : tick;
+		}
+
+		if (earliest <= tick)
+			break;
+	}
+
+	return earliest;
+}
+
+int timer_wheel_timeout(struct timer_wheel *w)
+{
+	uint64_t now = timer_now_ms();
+
+	if (w->pending == 0)
+		return -1;
+
+	/* Adding a timer lowers the bound, cancelling or firing one keeps it
+	 * valid, so the slots are only scanned again once it is reached. */
+	if (w->next_expires * TIMER_TICK_MS <= now)
+		w->next_expires = earliest_expires(w);
+
+	/* late already, the loop should only poll the links */
+	if (w->next_expires * TIMER_TICK_MS <= now)
+		return 0;
+	if (w->next_expires * TIMER_TICK_MS - now > INT32_MAX)
+		return INT32_MAX;
+	return w->next_expires * TIMER_TICK_MS - now;
+}
@@ -0,0 +1,232 @@
+#include "topk.h"
+#include "lib.h"
+#include <string.h>
+#include <time.h>
+
+static uint32_t key_hash(uint64_t key)
+{
+	key ^= key >> 33;
+	key *= 0xff51afd7ed558ccdULL;
+	key ^= key >> 33;
+	key *= 0xc4ceb9fe1a85ec53ULL;
+	key ^= key >> 33;
+	return key;
+}
+
+/* Take a free bucket for packets and link it after `after`, at the head of
+ * the list if after is TOPK_NONE. */
+static uint32_t bucket_new(struct topk *t, uint64_t packets, uint32_t after)
+{
+	uint32_t b = t->free_bucket;
+	struct topk_bucket *bucket = &t->buckets[b];
+
+	t->free_bucket = bucket->next;
+	bucket->packets = packets;
+	bucket->first = TOPK_NONE;
+	bucket->prev = after;
+	bucket->next = after == TOPK_NONE ? t->min_bucket : t->buckets[after].next;
+
+	if (bucket->next != TOPK_NONE)
+		t->buckets[bucket->next].prev = b;
+	if (after == TOPK_NONE)
+		t->min_bucket = b;
+	else
+		t->buckets[after].next = b;
+	return b;
+}
+
+/* Unlink a counter from its bucket, freeing the bucket if it empties. */
+static void counter_unlink(struct topk *t, uint32_t c)
+{
+	struct topk_counter *counter = &t->counters[c];
+	struct topk_bucket *bucket = &t->buckets[counter->bucket];
+
+	if (counter->prev != TOPK_NONE)
+		t->counters[counter->prev].next = counter->next;
+	else
+		bucket->first = counter->next;
+	if (counter->next != TOPK_NONE)
+		t->counters[counter->next].prev = counter->prev;
+
+	if (bucket->first != TOPK_NONE)
+		return;
+
+	if (bucket->prev != TOPK_NONE)
+		t->buckets[bucket->prev].next = bucket->next;
+	else
+		t->min_bucket = bucket->next;
+	if (bucket->next != TOPK_NONE)
+		t->buckets[bucket->next].prev = bucket->prev;
+
+	bucket->next = t->free_bucket;
+	t->free_bucket = counter->bucket;
+}
+
+static void counter_link(struct topk *t, uint32_t c, uint32_t b)
+{
+	struct topk_counter *counter = &t->counters[c];
+	struct topk_bucket *bucket = &t->buckets[b];
+
+	counter->bucket = b;
+	counter->prev = TOPK_NONE;
+	counter->next = bucket->first;
+	if (bucket->first != TOPK_NONE)
+		t->counters[bucket->first].prev = c;
+	bucket->first = c;
+}
+
+/* Count a packet on a counter, moving it to the bucket of its new packets. */
+static void counter_increment(struct topk *t, uint32_t c)
+{
+	struct topk_counter *counter = &t->counters[c];
+	uint32_t b = counter->bucket;
+	uint64_t packets = ++counter->entry.packets;
+	uint32_t next = t->buckets[b].next;
+
+	if (next != TOPK_NONE && t->buckets[next].packets == packets) {
+		counter_unlink(t, c);
+		counter_link(t, c, next);
+	}
+	else if (t->buckets[b].first == c && counter->next == TOPK_NONE) {
+		/* alone in its bucket, which keeps its place in the list */
+		t->buckets[b].packets = packets;
+	}
+	else {
+		counter_unlink(t, c);
+		counter_link(t, c, bucket_new(t, packets, b));
+	}
+}
+
+/* Free an index slot, shifting back the entries after it (no tombstones). */
+static void index_delete(struct topk *t, uint32_t i)
+{
+	uint32_t j = i;
+
+	t->index[i] = 0;
+	while (1) {
+		j = (j + 1) & t->mask;
+		if (t->index[j] == 0)
+			return;
+
+		struct topk_counter *counter = &t->counters[t->index[j] - 1];
+		uint32_t home = key_hash(counter->entry.key) & t->mask;
+
+		/* the entry can fill the hole if its home is not in (i, j] */
+		if ((i < j) ? (home <= i || home > j) : (home <= i && home > j)) {
+			t->index[i] = t->index[j];
+			t->index[j] = 0;
+			counter->slot = i;
+			i = j;
+		}
+	}
+}
+
+uint32_t topk_next_interval(struct topk *t)
+{
+	if (t->sampling == 1)
+		return 1;
+
+	/* xorshift32, uniform in [1, 2 * sampling - 1] */
+	t->rng ^= t->rng << 13;
+	t->rng ^= t->rng >> 17;
+	t->rng ^= t->rng << 5;
+	return 1 + t->rng % (2 * t->sampling - 1);
+}
+
+struct topk *topk_create(uint32_t k, uint32_t sampling)
+{
+	struct topk *t = calloc(1, sizeof(struct topk));
+	uint32_t size = 1;
+
+	DIE(t == NULL, "calloc");
+	DIE(k == 0 || sampling == 0, "top-k parameters");
+
+	/* keep the index at most half full */
+	while (size < 2 * k)
+		size <<= 1;
+
+	t->sampling = sampling;
+	t->rng = time(NULL) | 1;
+	t->countdown = topk_next_interval(t);
+	t->k = k;
+	t->counters = calloc(k, sizeof(struct topk_counter));
+	t->buckets = calloc(k, sizeof(struct topk_bucket));
+	t->index = calloc(size, sizeof(uint32_t));
+	DIE(t->counters == NULL || t->buckets == NULL || t->index == NULL, "calloc");
+	t->mask = size - 1;
+	topk_reset(t);
+
+	return t;
+}
+
+void topk_add(struct topk *t, uint64_t key, uint32_t bytes)
+{
+	uint32_t i = key_hash(key) & t->mask;
+	uint32_t c;
+
+	t->packets++;
+	t->bytes += bytes;
+
+	for (; t->index[i] != 0; i = (i + 1) & t->mask) {
+		c = t->index[i] - 1;
+		if (t->counters[c].entry.key == key) {
+			t->counters[c].entry.bytes += bytes;
+			counter_increment(t, c);
+			return;
+		}
+	}
+
+	if (t->size < t->k) {
+		/* a free counter while there are fewer than k keys, in the bucket
+		 * of the single packets */
+		c = t->size++;
+		t->counters[c].entry = (struct topk_entry) { key, 1, bytes, 0 };
+		t->counters[c].slot = i;
+		t->index[i] = c + 1;
+
+		uint32_t b = t->min_bucket;
+		if (b == TOPK_NONE || t->buckets[b].packets != 1)
+			b = bucket_new(t, 1, TOPK_NONE);
+		counter_link(t, c, b);
+		return;
+	}
+
+	/* take over a counter with the fewest packets */
+	c = t->buckets[t->min_bucket].first;
+	index_delete(t, t->counters[c].slot);
+
+	/* the deletion may have shifted the free slot found for key */
+	for (i = key_hash(key) & t->mask; t->index[i] != 0; i = (i + 1) & t->mask)
+		;
+
+	t->counters[c].entry.key = key;
+	t->counters[c].entry.error = t->counters[c].entry.packets;
+	t->counters[c].entry.bytes += bytes;
+	t->counters[c].slot = i;
+	t->index[i] = c + 1;
+	counter_increment(t, c);
+}
+
+uint32_t topk_sorted(struct topk *t, struct topk_entry *out)
+{
+	uint32_t n = t->size;
+
+	/* the buckets are by packets ascending, fill from the end */
+	for (uint32_t b = t->min_bucket; b != TOPK_NONE; b = t->buckets[b].next)
+		for (uint32_t c = t->buckets[b].first; c != TOPK_NONE; c = t->counters[c].next)
+			out[--n] = t->counters[c].entry;
+
+	return t->size;
+}
+
+void topk_reset(struct topk *t)
+{
+	memset(t->index, 0, sizeof(uint32_t) * (t->mask + 1));
+	for (uint32_t b = 0; b < t->k; b++)
+		t->buckets[b].next = b + 1 < t->k ? b + 1 : TOPK_NONE;
+	t->free_bucket = 0;
+	t->min_bucket = TOPK_NONE;
+	t->size = 0;
+	t->packets = 0;
+	t->bytes = 0;
+}
@@ -0,0 +1,79 @@
+#include "trace.h"
+#include "lib.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <time.h>
+
+static const char *decision_names[TRACE_DECISIONS] = {
+	[TRACE_FORWARDED] = "forwarded",
+	[TRACE_DROPPED] = "dropped",
+	[TRACE_ICMP] = "icmp",
+	[TRACE_QUEUED] = "queued",
+};
+
+static const char *reason_names[TRACE_REASONS] = {
+	[TRACE_NONE] = "-",
+	[TRACE_STATIC_ROUTE] = "static-route",
+	[TRACE_LEARNED_ROUTE] = "learned-route",
+	[TRACE_RESOLVED] = "arp-resolved",
+	[TRACE_BAD_CHECKSUM] = "bad-checksum",
+	[TRACE_NOT_HANDLED] = "not-handled",
+	[TRACE_ACL_DENY] = "acl-deny",
+	[TRACE_NAT_NO_SESSION] = "nat-no-session",
+	[TRACE_MTU] = "mtu",
+	[TRACE_ARP_QUEUE_FULL] = "arp-queue-full",
+	[TRACE_ECHO_REPLY] = "echo-reply",
+	[TRACE_TTL_EXCEEDED] = "ttl-exceeded",
+	[TRACE_NO_ROUTE_FOUND] = "no-route",
+	[TRACE_FRAG_NEEDED] = "frag-needed",
+	[TRACE_ARP_TIMEOUT] = "arp-timeout",
+	[TRACE_NO_NEIGHBOUR] = "no-neighbour",
+	[TRACE_MALFORMED] = "malformed",
+};
+
+struct trace *trace_open(const char *path, uint32_t records)
+{
+	struct trace *t = calloc(1, sizeof(struct trace));
+	size_t size = sizeof(struct trace_header) + (size_t)records * sizeof(struct trace_record);
+
+	DIE(t == NULL, "calloc");
+	DIE(records == 0 || (records & (records - 1)) != 0, "trace records must be a power of two");
+
+	/* a fresh file, so a reader never decodes the records of another run */
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	DIE(fd < 0, "open %s", path);
+	DIE(ftruncate(fd, size) < 0, "ftruncate");
+
+	void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	DIE(addr == MAP_FAILED, "mmap");
+	close(fd);
+
+	t->header = addr;
+	t->records = (struct trace_record *)(t->header + 1);
+	t->mask = records - 1;
+	t->header->records = records;
+	t->header->record_size = sizeof(struct trace_record);
+	t->header->version = TRACE_VERSION;
+	__atomic_store_n(&t->header->magic, TRACE_MAGIC, __ATOMIC_RELEASE);
+	trace_stamp(t);
+
+	return t;
+}
+
+void trace_stamp(struct trace *t)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	t->now = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+const char *trace_decision_name(uint8_t decision)
+{
+	return decision < TRACE_DECISIONS ? decision_names[decision] : "?";
+}
+
+const char *trace_reason_name(uint8_t reason)
+{
+	return reason < TRACE_REASONS ? reason_names[reason] : "?";
+}
@@ -0,0 +1,264 @@
+#include "vrf.h"
+#include "lib.h"
+#include "hugepage.h"
+#include <string.h>
+
+#define NODE_BYTES (sizeof(uint32_t) * VRF_NODE_SLOTS)
+#define ROOT_BYTES (sizeof(uint32_t) * VRF_ROOT_SLOTS)
+
+/* Nodes of the trie being built, not shared yet. */
+struct vrf_build {
+	uint32_t *slots;
+	uint32_t count;
+	uint32_t capacity;
+};
+
+static inline uint32_t len_mask(int len)
+{
+	return len == 0 ? 0 : ~0u << (32 - len);
+}
+
+static uint32_t node_hash(const uint32_t *slots)
+{
+	uint64_t h = 0x9e3779b97f4a7c15ULL;
+
+	for (int i = 0; i < VRF_NODE_SLOTS; i++) {
+		h = (h ^ slots[i]) * 0xff51afd7ed558ccdULL;
+		h ^= h >> 29;
+	}
+	return h ^ (h >> 32);
+}
+
+struct vrf_fib *vrf_fib_create(uint32_t vrfs)
+{
+	struct vrf_fib *f = calloc(1, sizeof(struct vrf_fib));
+	uint32_t *empty = calloc(VRF_ROOT_SLOTS, sizeof(uint32_t));
+
+	DIE(f == NULL || empty == NULL || vrfs == 0, "vrf fib");
+	f->vrfs = vrfs;
+	f->roots = malloc(sizeof(uint32_t *) * vrfs);
+	DIE(f->roots == NULL, "malloc");
+
+	/* the VRFs not built yet have no route */
+	for (uint32_t v = 0; v < vrfs; v++)
+		f->roots[v] = empty;
+
+	f->capacity = 1024;
+	f->nodes = malloc(NODE_BYTES * f->capacity);
+	f->hashes = malloc(sizeof(uint32_t) * f->capacity);
+	f->index_mask = 2 * f->capacity - 1;
+	f->index = calloc(f->index_mask + 1, sizeof(uint32_t));
+	DIE(f->nodes == NULL || f->hashes == NULL || f->index == NULL, "malloc");
+	return f;
+}
+
+/* Double the node pool and the index, which stays at most half full. */
+static void grow(struct vrf_fib *f)
+{
+	f->capacity *= 2;
+	f->nodes = realloc(f->nodes, NODE_BYTES * f->capacity);
+	f->hashes = realloc(f->hashes, sizeof(uint32_t) * f->capacity);
+	DIE(f->nodes == NULL || f->hashes == NULL, "realloc");
+
+	free(f->index);
+	f->index_mask = 2 * f->capacity - 1;
+	f->index = calloc(f->index_mask + 1, sizeof(uint32_t));
+	DIE(f->index == NULL, "calloc");
+
+	for (uint32_t n = 0; n < f->count; n++) {
+		uint32_t i = f->hashes[n] & f->index_mask;
+
+		while (f->index[i] != 0)
+			i = (i + 1) & f->index_mask;
+		f->index[i] = n + 1;
+	}
+}
+
+/* The shared node with these slots, added if there is none yet. */
+static uint32_t intern(struct vrf_fib *f, const uint32_t *slots)
+{
+	uint32_t h = node_hash(slots);
+	uint32_t i = h & f->index_mask;
+
+	for (; f->index[i] != 0; i = (i + 1) & f->index_mask) {
+		uint32_t n = f->index[i] - 1;
+
+		if (f->hashes[n] == h && memcmp(&f->nodes[n << VRF_NODE_BITS], slots, NODE_BYTES) == 0)
+			return n;
+	}
+
+	DIE(f->count >= VRF_SLOT_NODE - 1, "vrf fib full");
+	if (f->count == f->capacity) {
+		grow(f);
+		for (i = h & f->index_mask; f->index[i] != 0; i = (i + 1) & f->index_mask)
+			;
+	}
+
+	uint32_t n = f->count++;
+	memcpy(&f->nodes[n << VRF_NODE_BITS], slots, NODE_BYTES);
+	f->hashes[n] = h;
+	f->index[i] = n + 1;
+	return n;
+}
+
+/* The child of a slot of the trie being built, made from the route the slot
+ * holds if it has none. */
+static uint32_t child_of(struct vrf_build *b, uint32_t *slot)
+{
+	if (*slot & VRF_SLOT_NODE)
+		return *slot & ~VRF_SLOT_NODE;
+
+	if (b->count == b->capacity) {
+		b->capacity = b->capacity ? 2 * b->capacity : 256;
+		b->slots = realloc(b->slots, NODE_BYTES * b->capacity);
+		DIE(b->slots == NULL, "realloc");
+	}
+
+	uint32_t n = b->count++;
+	for (int i = 0; i < VRF_NODE_SLOTS; i++)
+		b->slots[n << VRF_NODE_BITS | i] = *slot;
+	*slot = VRF_SLOT_NODE | n;
+	return n;
+}
+
+/* Expand a route over the slots it covers. Routes come by length ascending,
+ * so a longer one always overwrites the shorter ones, and the children are
+ * only made after all the routes of their parent's level. */
+static void insert(struct vrf_build *b, uint32_t *root, const struct vrf_route *route)
+{
+	uint32_t prefix = route->prefix & len_mask(route->len);
+	uint32_t value = route->value + 1;
+	int len = route->len;
+
+	if (len <= VRF_ROOT_BITS) {
+		uint32_t first = prefix >> VRF_ROOT_BITS;
+
+		for (uint32_t i = 0; i < 1u << (VRF_ROOT_BITS - len); i++)
+			root[first + i] = value;
+		return;
+	}
+
+	uint32_t n = child_of(b, &root[prefix >> VRF_ROOT_BITS]);
+	uint32_t middle = (prefix >> VRF_NODE_BITS) & 0xff;
+
+	if (len <= VRF_ROOT_BITS + VRF_NODE_BITS) {
+		for (uint32_t i = 0; i < 1u << (VRF_ROOT_BITS + VRF_NODE_BITS - len); i++)
+			b->slots[n << VRF_NODE_BITS | (middle + i)] = value;
+		return;
+	}
+
+	/* copied, child_of() may move the slots */
+	uint32_t slot = b->slots[n << VRF_NODE_BITS | middle];
+	uint32_t leaf = child_of(b, &slot);
+
+	b->slots[n << VRF_NODE_BITS | middle] = slot;
+	for (uint32_t i = 0; i < 1u << (32 - len); i++)
+		b->slots[leaf << VRF_NODE_BITS | ((prefix & 0xff) + i)] = value;
+}
+
+static int by_len(const void *a, const void *b)
+{
+	return ((const struct vrf_route *)a)->len - ((const struct vrf_route *)b)->len;
+}
+
+void vrf_fib_build(struct vrf_fib *f, uint32_t vrf, const struct vrf_route *routes, uint32_t count)
+{
+	struct vrf_route *sorted = malloc(sizeof(struct vrf_route) * (count > 0 ? count : 1));
+	uint32_t *root = calloc(VRF_ROOT_SLOTS, sizeof(uint32_t));
+	struct vrf_build b = { 0 };
+
+	DIE(vrf >= f->vrfs, "no such VRF");
+	DIE(f->index == NULL, "vrf fib already finished");
+	DIE(sorted == NULL || root == NULL, "malloc");
+	memcpy(sorted, routes, sizeof(struct vrf_route) * count);
+	qsort(sorted, count, sizeof(struct vrf_route), by_len);
+
+	for (uint32_t i = 0; i < count; i++)
+		insert(&b, root, &sorted[i]);
+
+	/* Share the nodes bottom-up: the leaves first, then the nodes pointing
+	 * to the shared leaves. */
+	for (uint32_t s = 0; s < VRF_ROOT_SLOTS; s++) {
+		if (!(root[s] & VRF_SLOT_NODE))
+			continue;
+
+		uint32_t *slots = &b.slots[(root[s] & ~VRF_SLOT_NODE) << VRF_NODE_BITS];
+		for (int i = 0; i < VRF_NODE_SLOTS; i++) {
+			if (slots[i] & VRF_SLOT_NODE) {
+				slots[i] = VRF_SLOT_NODE | intern(f, &b.slots[(slots[i] & ~VRF_SLOT_NODE) << VRF_NODE_BITS]);
+				f->nodes_built++;
+			}
+		}
+		root[s] = VRF_SLOT_NODE | intern(f, slots);
+		f->nodes_built++;
+	}
+
+	/* Whole tables can be the same too. */
+	for (uint32_t v = 0; v < f->vrfs; v++) {
+		if (v != vrf && memcmp(f->roots[v], root, ROOT_BYTES) == 0) {
+			free(root);
+			root = f->roots[v];
+			f->roots_shared++;
+			break;
+		}
+	}
+
+	f->roots[vrf] = root;
+	free(b.slots);
+	free(sorted);
+}
+
+/* whether a VRF before v has the same root as v */
+static int root_seen(struct vrf_fib *f, uint32_t v)
+{
+	for (uint32_t u = 0; u < v; u++)
+		if (f->roots[u] == f->roots[v])
+			return 1;
+	return 0;
+}
+
+void vrf_fib_finish(struct vrf_fib *f)
+{
+	uint32_t *nodes = huge_alloc(NODE_BYTES * (f->count > 0 ? f->count : 1), "vrf nodes");
+	uint32_t roots = 0;
+
+	memcpy(nodes, f->nodes, NODE_BYTES * f->count);
+	free(f->nodes);
+	f->nodes = nodes;
+
+	for (uint32_t v = 0; v < f->vrfs; v++)
+		roots += !root_seen(f, v);
+
+	/* The shared roots are copied once, the VRFs keep sharing them. */
+	uint32_t *copy = huge_alloc(ROOT_BYTES * roots, "vrf roots");
+
+	for (uint32_t v = 0; v < f->vrfs; v++) {
+		uint32_t *root = f->roots[v];
+
+		if (root_seen(f, v))
+			continue;
+
+		memcpy(copy, root, ROOT_BYTES);
+		for (uint32_t u = v; u < f->vrfs; u++)
+			if (f->roots[u] == root)
+				f->roots[u] = copy;
+		free(root);
+		copy += VRF_ROOT_SLOTS;
+	}
+
+	/* only needed to share the nodes of new tries */
+	free(f->hashes);
+	free(f->index);
+	f->hashes = NULL;
+	f->index = NULL;
+}
+
+size_t vrf_fib_memory(struct vrf_fib *f)
+{
+	size_t bytes = (size_t)f->count * NODE_BYTES;
+
+	for (uint32_t v = 0; v < f->vrfs; v++)
+		if (!root_seen(f, v))
+			bytes += ROOT_BYTES;
+	return bytes;
+}
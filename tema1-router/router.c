@@ -1,4 +1,19 @@
 #include "queue.h"
+#include "timer.h"
+#include "lpm6.h"
+#include "pool.h"
+#include "hugepage.h"
+#include "acl.h"
+#include "nat.h"
+#include "egress.h"
+#include "latency.h"
+#include "flow.h"
+#include "mph.h"
+#include "rip.h"
+#include "fib4.h"
+#include "topk.h"
+#include "trace.h"
+#include "vrf.h"
 #include "lib.h"
 #include "protocols.h"
 #include <stdio.h>
@@ -7,12 +22,16 @@
 
 #define ETHERTYPE_IP 0x0800
 #define ETHERTYPE_ARP 0x0806
+#define ETHERTYPE_IPV6 0x86DD
 #define RTABLE_MAXSIZE 100000
 #define ICMP 1
+#define TCP 6
+#define UDP 17
 #define ICMP_ECHO_REQUEST 8
 #define ICMP_ECHO_REPLY 0
 #define ICMP_TIME_EXCEEDED 11
 #define ICMP_DESTINATION_UNREACHABLE 3
+#define ICMP_HOST_UNREACHABLE 1
 #define ARP_OP_REQUEST 1
 #define ARP_OP_REPLY 2
 #define ARP_HTYPE 1
@@ -20,17 +39,285 @@
 #define ARP_HLEN 6
 #define ARP_PLEN 4
 #define MAX_TTL 64
+#define ICMP_ERROR_QUOTE_LEN (sizeof(struct iphdr) + 8)
+#define ARP_TABLE_MAXSIZE 1024
+#define ARP_ENTRY_TIMEOUT_MS 60000
+#define ARP_PENDING_MAXSIZE 64
+#define ARP_PENDING_MAXPACKETS 64
+#define ARP_RETRANSMIT_MS 1000
+#define ARP_MAX_RETRIES 3
+#define STATS_INTERVAL_MS 10000
+#define ECMP_MAX_PATHS 8
+#define VECTOR_SIZE 256
+#define NAT_DEFAULT_SESSIONS (1 << 20)
+#define NAT_SWEEP_MS 100
+#define NAT_SWEEP_BATCH 4096
+#define FRAME_CLASSES 3
+#define ICMP_FRAG_NEEDED 4
+#define IP_DF 0x4000
+#define ICMP6_PACKET_TOO_BIG 2
+#define MIN_MTU 68
+#define BUSY_POLL_USECS 50
+#define BUSY_POLL_MIN_SPIN_US 20
+#define BUSY_POLL_MAX_SPIN_US 2000
+#define FLOW_TABLE_SIZE 65536
+#define FLOW_SWEEP_MS 1000
+#define FLOW_SWEEP_BATCH 16384
+#define STATIC_NEIGHBOURS_MAXSIZE 65536
+#define RIP_MAX_ROUTES 65536
+#define RIP_EXPIRE_MS 1000
+#define RIP_TOS 0xc0
+#define NEIGHBOUR_MAXSIZE 256
+#define PROBE_DETECT_MULT 3
+#define HEAVY_HITTERS_SAMPLING 16
+#define VRF_MAXSIZE 64
+#define BENCH_FRAME_LEN 98
+#define RTABLE6_MAXSIZE 100000
+#define ND_TABLE_MAXSIZE 1024
+#define ICMP6 58
+#define ICMP6_DEST_UNREACH 1
+#define ICMP6_NO_ROUTE 0
+#define ICMP6_ADDR_UNREACH 3
+#define ICMP6_TIME_EXCEEDED 3
+#define ICMP6_ECHO_REQUEST 128
+#define ICMP6_ECHO_REPLY 129
+#define ICMP6_NEIGHBOR_SOLICIT 135
+#define ICMP6_NEIGHBOR_ADVERT 136
+#define ND_ROUTER_SOLICIT 133
+#define ND_REDIRECT 137
+#define ND_OPT_SOURCE_LLADDR 1
+#define ND_OPT_TARGET_LLADDR 2
+#define ND_HOP_LIMIT 255
+#define ND_FLAG_ROUTER 0x80000000
+#define ND_FLAG_SOLICITED 0x40000000
+#define ND_FLAG_OVERRIDE 0x20000000
+/* An ICMPv6 error must fit in the IPv6 minimum MTU (RFC 4443). */
+#define ICMP6_ERROR_MAX_QUOTE (1280 - sizeof(struct ip6hdr) - sizeof(struct icmp6hdr))
+
+/* Stages of the IPv4 fast path left out at build time (see the Makefile), so
+ * a deployment not needing them pays no branch per packet for them:
+ * TRUSTED_INGRESS skips the header checksum, NO_ICMP_ERRORS drops the packets
+ * an ICMP error would answer, STATIC_NEXT_HOPS only forwards to the static
+ * neighbours, with no ARP cache lookup and no queueing for ARP. */
+#ifdef TRUSTED_INGRESS
+#define VERIFY_CHECKSUM 0
+#else
+#define VERIFY_CHECKSUM 1
+#endif
+#ifdef NO_ICMP_ERRORS
+#define ICMP_ERRORS 0
+#else
+#define ICMP_ERRORS 1
+#endif
+#ifdef STATIC_NEXT_HOPS
+#define ARP_RESOLUTION 0
+#else
+#define ARP_RESOLUTION 1
+#endif
 
 static int rtable_size;
 static int arp_table_size;
 struct route_table_entry *rtable;
-struct arp_entry *arp_table;
-queue q;
 
+/* Liveness of a gateway, probed with ARP requests (-P). It is shared by all
+ * the paths through the gateway, so marking it down moves every prefix using
+ * it to its backup at once. */
+struct neighbour {
+    uint32_t ip;
+    int interface;
+    int up;
+    int missed;     // probes sent since the last reply
+};
+
+/* One of the equal-cost paths of a route. */
+struct nexthop {
+    uint32_t ip;
+    int interface;
+    struct neighbour *neighbour;    // NULL if not probed, always up
+};
+
+/* Equal-cost next hops of a prefix, nh_groups[i] belongs to rtable[i]. */
+struct nexthop_group {
+    int count;
+    struct nexthop hops[ECMP_MAX_PATHS];
+    struct nexthop_group *backup;   // used once all the hops are down, NULL if none
+};
+
+struct nexthop_group *nh_groups;
+
+/* Configured alternates (-A), in the rtable format, merged into groups the
+ * same way. alt_groups[i] is the backup of the route with alt_table[i]'s
+ * prefix and mask. */
+static int alt_size;
+static struct route_table_entry *alt_table;
+static struct nexthop_group *alt_groups;
+
+/* The gateways of the routes, probed every probe_interval_ms if not 0. */
+static struct neighbour neighbours[NEIGHBOUR_MAXSIZE];
+static int neighbours_size;
+static int probe_interval_ms;
+static struct timer probe_timer;
+
+/* VRFs (-V), selected by the ingress interface; VRF 0 is the main table. The
+ * routes of the other VRFs follow the main ones in rtable, a route shared by
+ * several VRFs being stored once, and every VRF is looked up in vrf_fib, NULL
+ * if there is only the main table. */
+static struct vrf_fib *vrf_fib;
+static int vrf_count;
+static const char *vrf_names[VRF_MAXSIZE];
+static char *vrf_paths[VRF_MAXSIZE];
+static char *vrf_interfaces[VRF_MAXSIZE];
+static uint8_t interface_vrf[ROUTER_NUM_INTERFACES];
+static int rtable_used;             // routes of all the VRFs
+static struct fib4 *route_index;    // first route of every prefix
+static int32_t *route_next;         // next route with the same prefix, -1 if none
+
+static int rtable6_size;
+struct route6_table_entry *rtable6;
+static struct lpm6 *fib6;
+
+/* Rules checked before the route lookup, NULL if there is no ACL. */
+static struct acl *acl;
+
+/* Source NAT on the outside interface, NULL if disabled. */
+static struct nat *nat;
+static struct timer nat_timer;
+
+/* Route learned by the routing daemon, as pushed into its forwarding table. */
+struct learned_route {
+    struct nexthop nh;
+    int len;
+};
+
+/* Distance-vector routing (-R), NULL if disabled. The learned routes are
+ * forwarded from rip_fib, updated one prefix at a time from the RIB. */
+static struct rip *rip;
+static struct fib4 *rip_fib;
+static struct learned_route *learned_routes;
+static struct timer rip_update_timer;
+static struct timer rip_trigger_timer;
+static struct timer rip_expire_timer;
+
+/* Top destination prefixes by sampled packets (-H), NULL if disabled. The
+ * report is refreshed at every stats flush. */
+static struct topk *heavy_hitters;
+static struct topk_entry *heavy_hitters_report;
+static uint32_t heavy_hitters_shown;
+
+/* Decisions of the last IPv4 packets (-T), NULL if disabled. */
+static struct trace *trace;
+
+/* Sampled flow accounting, NULL if disabled. */
+static struct flow_table *flows;
+static struct timer flow_timer;
+
+/* Output queues of the interfaces, see include/egress.h. */
+static struct egress *egress;
+static struct timer_wheel timers;
+
+/* ARP cache entry, removed by its aging timer if not refreshed. */
+struct arp_cache_entry {
+    struct arp_entry entry;
+    int valid;
+    struct timer aging;
+};
+
+static struct arp_cache_entry *arp_table;
+
+/* Static neighbours, found with a single probe in a perfect hash before the
+ * ARP cache is searched: loaded with -s, or compiled in with
+ * make STATIC_NEIGHBOURS=file. */
+static struct mph static_neighbours;
+static const struct arp_entry *static_neighbour_table;
+
+#ifdef STATIC_NEIGHBOURS
+#include "static_neighbours.h"
+#endif
+
+/* IPv6 neighbour cache entry, removed by its aging timer if not refreshed. */
+struct nd_cache_entry {
+    struct in6_addr ip;
+    uint8_t mac[6];
+    int valid;
+    struct timer aging;
+};
+
+static int nd_table_size;
+static struct nd_cache_entry *nd_table;
+
+/* Next hop waiting for an ARP reply (or a neighbour advertisement, for
+ * family AF_INET6), with the packets queued for it. */
+struct arp_pending {
+    int in_use;
+    int family;
+    uint32_t next_hop;
+    struct in6_addr next_hop6;
+    int interface;
+    int retries;
+    int queued;
+    queue packets;
+    struct timer retransmit;
+};
+
+static struct arp_pending arp_pending[ARP_PENDING_MAXSIZE];
+
+/* Buffers of the frames that outlive their burst: the packets waiting in the
+ * pending queues (a struct packet followed by the payload) and the copies in
+ * the egress queues. Small, standard and jumbo frames have their own pools. */
+static const size_t frame_class_sizes[FRAME_CLASSES] = { 256, 2048, MAX_JUMBO_FRAME_LEN + 128 };
+static const int frame_class_counts[FRAME_CLASSES] = { 8192, 8192, 1024 };
+static struct pool_set *frame_buffers;
+
+/* An ICMP error built in place can be this much longer than the packet. */
+#define ICMP_ERROR_ROOM (sizeof(struct ip6hdr) + sizeof(struct icmp6hdr))
+
+/* The size of the receive buffers, the longest frame of any interface. */
+static size_t rx_frame_size;
+
+/* Counters flushed periodically to stderr. */
+struct router_stats {
+    uint64_t received;
+    uint64_t forwarded;
+    uint64_t dropped;
+    uint64_t icmp_sent;
+    uint64_t arp_requests;
+    uint64_t nd_solicits;
+    uint64_t arp_timeouts;
+    uint64_t acl_denied;
+    uint64_t nat_dropped;
+    uint64_t egress_dropped;
+    uint64_t mtu_exceeded;
+    uint64_t poll_sleeps;
+    uint64_t fib_updates;
+    uint64_t nh_failures;
+    uint64_t nh_recoveries;
+};
+
+static struct router_stats stats;
+static struct timer stats_timer;
+
+/* Per-interface addresses and ICMP error header templates, filled at startup. */
+struct interface_info {
+    uint32_t ip;
+    struct in6_addr ip6;
+    struct in6_addr ip6_ll;
+    uint8_t mac[6];
+    int mtu;
+    struct ether_header eth_template;
+    struct iphdr ip_template;
+};
+
+static struct interface_info ifaces[ROUTER_NUM_INTERFACES];
+
+/* Packet descriptor, passed between the nodes of the processing graph. */
 struct packet {
     char *payload;
     size_t len;
     int interface;
+    int out_interface;      // set once the output interface is known
+    struct nexthop *nh;     // set by ip4-lookup
+    int32_t route;          // set by ip4-lookup, index in rtable or learned_routes
+    uint8_t learned;        // set by ip4-lookup, whether route is a learned one
 };
 
 /**
@@ -83,6 +370,24 @@ struct icmphdr *get_icmp_header(void *buf){
    return (struct icmphdr *)(buf + sizeof(struct iphdr) + sizeof(struct ether_header));
 }
 
+/**
+ * @brief Extracts the IPv6 header from a buffer.
+ * @param buf
+ * @return
+ */
+struct ip6hdr *get_ip6_header(char *buf) {
+    return (struct ip6hdr *)(buf + sizeof(struct ether_header));
+}
+
+/**
+ * @brief Extracts the ICMPv6 header from a buffer.
+ * @param buf
+ * @return
+ */
+struct icmp6hdr *get_icmp6_header(char *buf) {
+    return (struct icmp6hdr *)(buf + sizeof(struct ether_header) + sizeof(struct ip6hdr));
+}
+
 /**
  * @brief Extracts the ARP header from a buffer.
  * @param buf
@@ -93,40 +398,48 @@ struct arp_header *get_arp_header(void *buf) {
 }
 
 /**
- * @brief Comparator function for the routing table. First sort by mask length
- * descending then by prefix length also descending.
+ * @brief Picks the egress class of a frame: ARP and neighbour discovery are
+ * control traffic, IP packets are classified by their DSCP.
  *
- * @param a First element to compare.
- * @param b Second element to compare.
- * @return -1 if a should come before b, 0 if the order doesn't matter, 1 if b should come before a.
+ * @param frame
+ * @return The egress class.
  */
-int comparator(const void *a, const void *b) {
-    const struct route_table_entry *entry_a = (const struct route_table_entry *) a;
-    const struct route_table_entry *entry_b = (const struct route_table_entry *) b;
-
-    if (entry_a->mask > entry_b->mask) {
-        // a has a larger mask than b, so a should come first.
-        return -1;
+int get_egress_class(char *frame) {
+    struct ether_header *eth_hdr = get_ether_header(frame);
+
+    switch (ntohs(eth_hdr->ether_type)) {
+    case ETHERTYPE_IP:
+        return egress_dscp_class(get_ip_header(frame)->tos >> 2);
+    case ETHERTYPE_IPV6: {
+        struct ip6hdr *ip6_hdr = get_ip6_header(frame);
+        uint8_t type = get_icmp6_header(frame)->type;
+
+        if (ip6_hdr->next_header == ICMP6 && type >= ND_ROUTER_SOLICIT && type <= ND_REDIRECT) {
+            return EGRESS_CONTROL;
+        }
+        return egress_dscp_class((ntohl(ip6_hdr->vtc_flow) >> 22) & 0x3f);
     }
-    else if (entry_a->mask < entry_b->mask) {
-        // a has a smaller mask than b, so a should come later.
-        return 1;
+    default:
+        return EGRESS_CONTROL;
     }
-    else {
-        // Then sort by prefix in descending order.
-        if (entry_a->prefix > entry_b->prefix) {
-            return -1;
-        }
-        else if (entry_a->prefix < entry_b->prefix) {
-            return 1;
-        }
-        else return 0;
+}
+
+/**
+ * @brief Sends a frame through the egress queues of the interface.
+ *
+ * @param interface
+ * @param frame
+ * @param len
+ */
+void output_frame(int interface, char *frame, size_t len) {
+    if (egress_send(egress, interface, frame, len, get_egress_class(frame)) < 0) {
+        stats.egress_dropped++;
     }
 }
 
 /**
- * @brief Algorithm to determine the longest prefix match of a target IP implemented
- * with binary search in O(log n) time.
+ * @brief Longest prefix match of a target IP in the routing table, by binary
+ * search in O(log n) time, see rtable_lookup().
  *
  * @param target_ip The IP to search for.
  * @param left Left index.
@@ -134,481 +447,2871 @@ int comparator(const void *a, const void *b) {
  * @return Routing table entry containing the best route for the target IP.
  */
 struct route_table_entry *get_best_route(uint32_t target_ip, uint32_t left, uint32_t right) {
-    struct route_table_entry *best_match = NULL;
-
-    // Start the binary search.
-    while (left <= right) {
-        uint32_t mid = (left + right) / 2;
-        uint32_t mask = rtable[mid].mask;
-        uint32_t prefix = rtable[mid].prefix;
-        uint32_t masked_dest_ip = target_ip & mask;
-
-        if (masked_dest_ip == prefix) {
-
-            // Found a match, check if there are any longer prefixes.
-            if (left == right) {
-                // Found the longest match.
-                return &rtable[mid];
-            } else {
-                // There might be longer prefixes, the routing table is sorted in descending order both by
-                // mask and prefix, so the longest prefix is now somewhere between index 0 and mid.
-                // Start binary search from 0 to mid.
-                return get_best_route(target_ip, 0, mid);
-            }
+    return rtable_lookup(rtable, target_ip, left, right);
+}
 
+/**
+ * @brief Merges the routes with the same prefix and mask into one entry whose
+ * next-hop group holds all their paths. The table must be sorted, so
+ * duplicates are adjacent.
+ *
+ * @param table A routing table, compacted in place.
+ * @param size The number of routes in the table.
+ * @param groups Set to the group of every route left, should have room for size groups.
+ * @return The new size of the table.
+ */
+int build_nexthop_groups(struct route_table_entry *table, int size, struct nexthop_group *groups) {
+    int merged = 0;
 
-        }
-        else if (masked_dest_ip > prefix) {
-            // A match may be somewhere in the left part from the current midpoint.
-            right = mid - 1;
+    for (int i = 0; i < size; i++) {
+        struct nexthop_group *group;
+
+        if (merged > 0 && table[i].prefix == table[merged - 1].prefix && table[i].mask == table[merged - 1].mask) {
+            // Another path for the previous prefix.
+            group = &groups[merged - 1];
         }
         else {
-            // A match may be somewhere in the right part from the current midpoint.
-            left = mid + 1;
+            table[merged] = table[i];
+            group = &groups[merged];
+            group->count = 0;
+            group->backup = NULL;
+            merged++;
+        }
+
+        // Skip duplicated paths and paths over the group's capacity.
+        int duplicate = 0;
+        for (int j = 0; j < group->count; j++) {
+            if (group->hops[j].ip == table[i].next_hop && group->hops[j].interface == table[i].interface) {
+                duplicate = 1;
+            }
+        }
+
+        if (!duplicate && group->count < ECMP_MAX_PATHS) {
+            group->hops[group->count].ip = table[i].next_hop;
+            group->hops[group->count].interface = table[i].interface;
+            group->hops[group->count].neighbour = NULL;
+            group->count++;
         }
     }
 
-    return best_match;
+    return merged;
 }
 
 /**
- * @brief Linear search the ARP table for the target_ip.
+ * @brief Finds the route with exactly this prefix and mask, by binary search
+ * in a sorted routing table.
  *
- * @param target_ip
- * @return The ARP entry corresponding to the IP, NULL if the IP cannot be found.
+ * @param table
+ * @param size
+ * @param prefix
+ * @param mask
+ * @return The route, NULL if there is none.
  */
-struct arp_entry *get_arp_entry(uint32_t target_ip) {
-    for (int i=0; i<arp_table_size; i++) {
-        if (target_ip == arp_table[i].ip) {
-            return &arp_table[i];
-        }
+struct route_table_entry *find_route(struct route_table_entry *table, int size, uint32_t prefix, uint32_t mask) {
+    struct route_table_entry key = { .prefix = prefix, .mask = mask };
+
+    if (size == 0) {
+        return NULL;
     }
-    return NULL;
+    return bsearch(&key, table, size, sizeof(struct route_table_entry), rtable_compare);
 }
 
 /**
- * @brief Sends an ICMP packet on the interface.
+ * @brief Checks if a group only goes through the gateways of another one, in
+ * which case it is no backup for it.
  *
- * @param packet The packet that generated the ICMP message.
- * @param icmp_type The type of the ICMP message.
- * @param icmp_code The code of the ICMP message.
- * @param interface The interface on which to send it on.
+ * @param group
+ * @param other
+ * @return 1 if every hop of group is also a hop of other, 0 otherwise.
  */
-void send_icmp(struct packet *packet, uint8_t icmp_type, uint8_t icmp_code, int interface) {
-    // Setup, unpack.
-    struct ether_header *eth_hdr = get_ether_header(packet->payload);
-    struct iphdr *ip_hdr = get_ip_header(packet->payload);
-    struct icmphdr *icmp_hdr = get_icmp_header(packet->payload);
-    size_t len = packet->len;
-    char *buf = packet->payload;
-
-    struct ether_header new_eth_hdr;
-    struct iphdr new_ip_hdr;
-    struct icmphdr new_icmp_hdr;
-
-    // Construct the ETHERNET header
-    memcpy(&new_eth_hdr.ether_dhost, eth_hdr->ether_shost, sizeof(eth_hdr->ether_shost));
-    memcpy(&new_eth_hdr.ether_shost, eth_hdr->ether_dhost, sizeof(eth_hdr->ether_dhost));
-    new_eth_hdr.ether_type = ntohs(ETHERTYPE_IP);
-
-    // Construct the IP header
-    memcpy(&new_ip_hdr, ip_hdr, sizeof(struct iphdr));
-    new_ip_hdr.tot_len = htons(len - sizeof(struct ether_header));
-    new_ip_hdr.ttl = MAX_TTL;
-    new_ip_hdr.protocol = ICMP;
-    new_ip_hdr.saddr = ip_hdr->daddr;
-    new_ip_hdr.daddr = ip_hdr->saddr;
-    new_ip_hdr.check = 0;
-    new_ip_hdr.check = ntohs(checksum((uint16_t *)&new_ip_hdr, sizeof(struct iphdr)));
-    
-    // Construct the ICMP header
-    memcpy(&new_icmp_hdr, icmp_hdr, sizeof(struct icmphdr));
-    new_icmp_hdr.type = icmp_type;
-    new_icmp_hdr.code = icmp_code;
-    new_icmp_hdr.checksum = 0;
-    new_icmp_hdr.checksum = ntohs(checksum((uint16_t *) &new_icmp_hdr,
-                                           len - sizeof(struct ether_header) - sizeof(struct iphdr)));
+int group_within(struct nexthop_group *group, struct nexthop_group *other) {
+    for (int i = 0; i < group->count; i++) {
+        int found = 0;
+
+        for (int j = 0; j < other->count; j++) {
+            if (group->hops[i].ip == other->hops[j].ip && group->hops[i].interface == other->hops[j].interface) {
+                found = 1;
+                break;
+            }
+        }
+        if (!found) {
+            return 0;
+        }
+    }
+    return 1;
+}
 
-    // Create the new packet
-    char *new_packet = malloc(len * sizeof(char));
+/**
+ * @brief Finds the backup of a route: the longest route covering its prefix
+ * that does not only go through the route's own gateways.
+ *
+ * @param route
+ * @return The backup's next-hop group, NULL if no route qualifies.
+ */
+struct nexthop_group *find_covering_group(struct route_table_entry *route) {
+    struct nexthop_group *group = &nh_groups[route - rtable];
 
-    memcpy(new_packet, buf, len);
-    memcpy(new_packet, &new_eth_hdr, sizeof(struct ether_header));
-    memcpy(new_packet + sizeof(struct ether_header), &new_ip_hdr, sizeof(struct iphdr));
-    memcpy(new_packet + sizeof(struct ether_header) + sizeof(struct iphdr), &new_icmp_hdr, sizeof(struct icmphdr));
+    for (int len = __builtin_popcount(route->mask) - 1; len >= 0; len--) {
+        uint32_t mask = len > 0 ? htonl(0xffffffff << (32 - len)) : 0;
+        struct route_table_entry *covering = find_route(rtable, rtable_size, route->prefix & mask, mask);
 
-    // Send the created packet
-    send_to_link(interface, new_packet, len);
+        if (covering != NULL && !group_within(&nh_groups[covering - rtable], group)) {
+            return &nh_groups[covering - rtable];
+        }
+    }
+    return NULL;
 }
 
 /**
- * @brief Sends an ICMP error message.
+ * @brief Finds the liveness state of a gateway, adding it if it is new.
  *
- * @param packet The packet that generated the error.
- * @param icmp_type The ICMP error type.
- * @param icmp_code The ICMP error code.
- * @param interface The interface on which to send the ICMP on.
+ * @param ip
+ * @param interface
+ * @return The gateway's state, NULL if the table is full.
  */
-void send_icmp_error(struct packet *packet, uint8_t icmp_type, uint8_t icmp_code, int interface) {
-    // Setup, unpack.
-    struct ether_header *eth_hdr = get_ether_header(packet->payload);
-    struct iphdr *ip_hdr = get_ip_header(packet->payload);
-    struct icmphdr *icmp_hdr = get_icmp_header(packet->payload);
-
-    struct ether_header new_eth_hdr;
-    struct iphdr new_ip_hdr;
-    struct icmphdr *new_icmp_hdr;
-
-    // Construct the ETHERNET header
-    memcpy(&new_eth_hdr.ether_dhost, eth_hdr->ether_shost, sizeof(eth_hdr->ether_shost));
-    memcpy(&new_eth_hdr.ether_shost, eth_hdr->ether_dhost, sizeof(eth_hdr->ether_dhost));
-    new_eth_hdr.ether_type = ntohs(ETHERTYPE_IP);
+struct neighbour *get_neighbour(uint32_t ip, int interface) {
+    for (int i = 0; i < neighbours_size; i++) {
+        if (neighbours[i].ip == ip && neighbours[i].interface == interface) {
+            return &neighbours[i];
+        }
+    }
 
-    // Construct the IP header
-    memcpy(&new_ip_hdr, ip_hdr, sizeof(struct iphdr));
-    uint16_t new_tot_len = sizeof(struct iphdr) + sizeof(uint64_t) + sizeof(struct iphdr) + sizeof(uint64_t);
-    new_ip_hdr.tot_len = htons(new_tot_len);
-    new_ip_hdr.ttl = MAX_TTL;
-    new_ip_hdr.protocol = ICMP;
-    new_ip_hdr.saddr = ip_hdr->daddr;
-    new_ip_hdr.daddr = ip_hdr->saddr;
-    new_ip_hdr.check = 0;
-    new_ip_hdr.check = ntohs(checksum((uint16_t *)&new_ip_hdr, sizeof(struct iphdr)));
+    if (neighbours_size == NEIGHBOUR_MAXSIZE) {
+        return NULL;
+    }
 
-    // Create the new ICMP header
-    uint32_t new_icmp_hdr_size = sizeof(uint8_t) + sizeof(uint8_t) + sizeof(uint16_t) + sizeof(uint32_t);
-    new_icmp_hdr = malloc(new_icmp_hdr_size);
+    struct neighbour *neighbour = &neighbours[neighbours_size++];
+    neighbour->ip = ip;
+    neighbour->interface = interface;
+    neighbour->up = 1;
+    neighbour->missed = 0;
+    return neighbour;
+}
 
-    // Copy data.
-    new_icmp_hdr->type = icmp_type;
-    new_icmp_hdr->code = icmp_code;
-    new_icmp_hdr->checksum = 0;
-    new_icmp_hdr->un.echo.sequence = 0;
-    new_icmp_hdr->un.echo.sequence = 0;
-    new_icmp_hdr->un.gateway = 0;
+/**
+ * @brief Links the hops of a group to the liveness state of their gateways.
+ * Gateways over NEIGHBOUR_MAXSIZE are not probed and stay up.
+ *
+ * @param group
+ */
+void attach_neighbours(struct nexthop_group *group) {
+    for (int i = 0; i < group->count; i++) {
+        if (group->hops[i].ip != 0) {
+            group->hops[i].neighbour = get_neighbour(group->hops[i].ip, group->hops[i].interface);
+        }
+    }
+}
 
-    // Create the new packet.
-    size_t new_packet_len = sizeof(struct ether_header) + new_tot_len;
-    char *new_packet = malloc(new_packet_len);
+/**
+ * @brief Precomputes the backup of every route, so a failed gateway never
+ * costs a FIB update: a configured alternate if there is one, backed in turn
+ * by the longest covering route, otherwise the covering route alone. With
+ * probing enabled the hops are also linked to their gateways' state.
+ */
+void build_backups(void) {
+    for (int i = 0; i < rtable_size; i++) {
+        nh_groups[i].backup = find_covering_group(&rtable[i]);
+    }
 
-    // Copy the ETHERNET header.
-    size_t offset = 0;
-    memcpy(new_packet, &new_eth_hdr, sizeof(struct ether_header));
-    offset += sizeof(struct ether_header);
+    for (int i = 0; i < alt_size; i++) {
+        struct route_table_entry *route = find_route(rtable, rtable_size, alt_table[i].prefix, alt_table[i].mask);
 
-    // Copy the IP header.
-    memcpy(new_packet + offset, &new_ip_hdr, sizeof(struct iphdr));
-    offset += sizeof(struct iphdr);
+        if (route == NULL) {
+            fprintf(stderr, "alternate %08x/%08x: no such route\n", ntohl(alt_table[i].prefix), ntohl(alt_table[i].mask));
+            continue;
+        }
+        alt_groups[i].backup = nh_groups[route - rtable].backup;
+        nh_groups[route - rtable].backup = &alt_groups[i];
+    }
 
-    // Copy the ICMP header.
-    memcpy(new_packet + offset, new_icmp_hdr, new_icmp_hdr_size);
-    offset += new_icmp_hdr_size;
+    if (probe_interval_ms > 0) {
+        for (int i = 0; i < rtable_size; i++) {
+            attach_neighbours(&nh_groups[i]);
+        }
+        for (int i = 0; i < alt_size; i++) {
+            attach_neighbours(&alt_groups[i]);
+        }
+    }
+}
 
-    // Copy the old IP header.
-    memcpy(new_packet + offset, ip_hdr, sizeof(struct iphdr));
-    offset += sizeof(struct iphdr);
+/**
+ * @brief Adds a route to the index of the routes by prefix, which finds the
+ * routes a VRF can share.
+ *
+ * @param index The route's index in rtable.
+ */
+void index_route(int index) {
+    uint32_t prefix = ntohl(rtable[index].prefix);
+    int len = __builtin_popcount(rtable[index].mask);
 
-    // Copy 8 bytes of the old ICMP header.
-    memcpy(new_packet + offset, icmp_hdr, sizeof(uint64_t));
+    route_next[index] = fib4_find(route_index, prefix, len);
+    DIE(fib4_set(route_index, prefix, len, index) < 0, "route index full");
+}
 
-    // Recompute checksum.
-    struct icmphdr *temp = get_icmp_header(new_packet);
-    temp->checksum = 0;
-    temp->checksum = ntohs(checksum((uint16_t *) temp, new_icmp_hdr_size + sizeof(struct iphdr) + sizeof(uint64_t)));
+/**
+ * @brief Stores a route of a VRF, unless one already stored has the same
+ * prefix, paths and backup: the VRFs agreeing on a route then agree on its
+ * index, which lets them share the sub-tries of their FIBs.
+ *
+ * @param route
+ * @param group The route's paths and backup.
+ * @return The route's index in rtable.
+ */
+int intern_route(struct route_table_entry *route, struct nexthop_group *group) {
+    for (int32_t i = fib4_find(route_index, ntohl(route->prefix), __builtin_popcount(route->mask)); i >= 0; i = route_next[i]) {
+        if (nh_groups[i].count == group->count && nh_groups[i].backup == group->backup &&
+            group_within(&nh_groups[i], group) && group_within(group, &nh_groups[i])) {
+            return i;
+        }
+    }
 
-    // Send the packet
-    send_to_link(interface, new_packet, new_packet_len);
+    DIE(rtable_used >= RTABLE_MAXSIZE, "too many routes in the VRFs");
+    int index = rtable_used++;
+    rtable[index] = *route;
+    nh_groups[index] = *group;
+    if (probe_interval_ms > 0) {
+        attach_neighbours(&nh_groups[index]);
+    }
+    index_route(index);
+    return index;
 }
 
 /**
- * @brief Sends an ARP message.
+ * @brief Loads the routing table of a VRF and builds its trie. The backup of
+ * a route is found in the same VRF, like in build_backups() but without
+ * alternates, so the routes are stored by mask ascending: the backup of a
+ * route is stored before it.
  *
- * @param daddr Destination IP address.
- * @param saddr Sender IP address.
- * @param eth_hdr Ethernet header.
- * @param interface Interface ID.
- * @param op ARP OPCODE.
+ * @param vrf The VRF ID.
+ * @param path The VRF's table, in the rtable format.
  */
-void send_arp(uint32_t daddr, uint32_t saddr, struct ether_header *eth_hdr, int interface, uint16_t op) {
-    struct arp_header new_arp_hdr;
+void load_vrf(int vrf, const char *path) {
+    struct route_table_entry *table = malloc(sizeof(struct route_table_entry) * RTABLE_MAXSIZE);
+    struct nexthop_group *groups = malloc(sizeof(struct nexthop_group) * RTABLE_MAXSIZE);
+    struct vrf_route *routes = malloc(sizeof(struct vrf_route) * RTABLE_MAXSIZE);
+    DIE(table == NULL || groups == NULL || routes == NULL, "malloc");
+
+    int size = read_rtable(path, table);
+    qsort((void *) table, size, sizeof(struct route_table_entry), rtable_compare);
+    size = build_nexthop_groups(table, size, groups);
+
+    // The table is sorted by mask descending, start from its end.
+    for (int i = size - 1; i >= 0; i--) {
+        int len = __builtin_popcount(table[i].mask);
+
+        for (int covering_len = len - 1; covering_len >= 0; covering_len--) {
+            uint32_t mask = covering_len > 0 ? htonl(0xffffffff << (32 - covering_len)) : 0;
+            struct route_table_entry *covering = find_route(table, size, table[i].prefix & mask, mask);
+
+            if (covering != NULL && !group_within(&groups[covering - table], &groups[i])) {
+                groups[i].backup = &nh_groups[routes[covering - table].value];
+                break;
+            }
+        }
 
-    // Construct the ARP header.
-    new_arp_hdr.op = op;
-    new_arp_hdr.hlen = ARP_HLEN;
-    new_arp_hdr.plen = ARP_PLEN;
-    new_arp_hdr.htype = htons(ARP_HTYPE);
-    new_arp_hdr.ptype = htons(ARP_PTYPE);
+        routes[i] = (struct vrf_route) { ntohl(table[i].prefix), len, intern_route(&table[i], &groups[i]) };
+    }
 
-    memcpy(&new_arp_hdr.sha, eth_hdr->ether_shost, sizeof(new_arp_hdr.sha));
-    memcpy(&new_arp_hdr.tha, eth_hdr->ether_dhost, sizeof(new_arp_hdr.tha));
+    vrf_fib_build(vrf_fib, vrf, routes, size);
+    fprintf(stderr, "vrf %s: %d routes\n", vrf_names[vrf], size);
 
-    new_arp_hdr.spa = saddr;
-    new_arp_hdr.tpa = daddr;
+    free(routes);
+    free(groups);
+    free(table);
+}
 
-    // Create the packet
-    size_t len = sizeof(struct ether_header) + sizeof(struct arp_header);
-    char *payload = malloc(len);
+/**
+ * @brief Builds the FIB of all the VRFs, the main table first, and binds the
+ * VRFs to their ingress interfaces.
+ */
+void build_vrfs(void) {
+    struct vrf_route *routes = malloc(sizeof(struct vrf_route) * (rtable_size > 0 ? rtable_size : 1));
+    DIE(routes == NULL, "malloc");
+
+    vrf_fib = vrf_fib_create(vrf_count);
+    route_index = fib4_create(RTABLE_MAXSIZE);
+    route_next = malloc(sizeof(int32_t) * RTABLE_MAXSIZE);
+    DIE(route_next == NULL, "malloc");
+
+    rtable_used = rtable_size;
+    for (int i = 0; i < rtable_size; i++) {
+        index_route(i);
+        routes[i] = (struct vrf_route) { ntohl(rtable[i].prefix), __builtin_popcount(rtable[i].mask), i };
+    }
+    vrf_fib_build(vrf_fib, 0, routes, rtable_size);
+    free(routes);
 
-    // Copy the data.
-    memcpy(payload, eth_hdr, sizeof(struct ether_header));
-    memcpy(payload + sizeof(struct ether_header), &new_arp_hdr, sizeof(struct arp_header));
+    for (int vrf = 1; vrf < vrf_count; vrf++) {
+        load_vrf(vrf, vrf_paths[vrf]);
 
-    struct packet *new_packet = malloc(sizeof(struct packet));
-    new_packet->payload = payload;
-    new_packet->interface = interface;
-    new_packet->len = len;
+        for (char *interface = strtok(vrf_interfaces[vrf], ","); interface != NULL; interface = strtok(NULL, ",")) {
+            // An interface number, anything else (a name, "r-1") is an error.
+            char *end;
+            long i = strtol(interface, &end, 10);
 
-    // Send the packet.
-    send_to_link(interface, payload, len);
+            DIE(end == interface || *end != '\0' || i < 0 || i >= ROUTER_NUM_INTERFACES,
+                "vrf %s: no interface %s", vrf_names[vrf], interface);
+            interface_vrf[i] = vrf;
+        }
+    }
+
+    vrf_fib_finish(vrf_fib);
+    fprintf(stderr, "vrf fib: %d VRFs, %d routes, %u nodes for %lu without sharing, %u tables shared, %zu KB\n",
+            vrf_count, rtable_used, vrf_fib->count, vrf_fib->nodes_built, vrf_fib->roots_shared,
+            vrf_fib_memory(vrf_fib) / 1024);
 }
 
 /**
- * @brief Forwards a packet on the network.
+ * @brief Records the decision taken for an IPv4 packet in the trace ring, if
+ * enabled. Called before an ICMP error is built over the packet.
  *
  * @param packet
+ * @param decision One of enum trace_decision.
+ * @param reason One of enum trace_reason.
+ * @param route The route the packet matched, TRACE_NO_ROUTE if none.
+ * @param egress The output interface, TRACE_NO_INTERFACE if none.
  */
-void forward_packet(struct packet *packet) {
-    // Setup
-    struct ether_header *eth_hdr = get_ether_header(packet->payload);
-    struct iphdr *ip_hdr = get_ip_header(packet->payload);
-    int interface = packet->interface;
-    size_t len = packet->len;
-    char *buf = packet->payload;
-
-    // Verify checksum.
-    uint16_t old_check = ip_hdr->check;
-    ip_hdr->check = 0;
-    uint16_t new_check = ntohs(checksum((uint16_t *) ip_hdr, sizeof(struct iphdr)));
-    ip_hdr->check = new_check;
-
-    // Drop the packet if the checksum is incorrect.
-    if (old_check != new_check) {
-        return;
-    }
-
-    // Check the packet's TTL
-    if (ip_hdr->ttl <= 1) {
-        // TTL expired, send time exceeded.
-        send_icmp_error(packet, ICMP_TIME_EXCEEDED, 0, interface);
+static inline void trace_packet(struct packet *packet, uint8_t decision, uint8_t reason, int32_t route, int egress) {
+    if (trace == NULL) {
         return;
     }
 
-    // Find the best route.
-    struct route_table_entry *best_route = get_best_route(ip_hdr->daddr, 0, rtable_size - 1);
+    struct iphdr *ip_hdr = get_ip_header(packet->payload);
+    trace_record(trace, decision, reason, packet->interface, egress, ip_hdr->saddr, ip_hdr->daddr, route,
+                 ntohs(ip_hdr->tot_len));
+}
 
-    // Check if a route was found.
-    if (best_route == NULL) {
+/**
+ * @brief Extracts the ports of an IP packet. Only unfragmented TCP and UDP
+ * packets have them, the others get 0, so all the packets of a flow agree.
+ *
+ * @param ip_hdr
+ * @return The source and destination ports as they are in the packet.
+ */
+uint32_t get_l4_ports(struct iphdr *ip_hdr) {
+    uint32_t ports = 0;
 
-        // Send destination unreachable ICMP
-        send_icmp_error(packet, ICMP_DESTINATION_UNREACHABLE, 0, interface);
-        return;
+    if ((ip_hdr->protocol == TCP || ip_hdr->protocol == UDP) && (ntohs(ip_hdr->frag_off) & 0x3fff) == 0) {
+        memcpy(&ports, (char *) ip_hdr + ip_hdr->ihl * 4, sizeof(ports));
     }
+    return ports;
+}
 
-    // A route was found, prepare to forward the packet
-
-    // Decrement TTL, recompute checksum
-    ip_hdr->ttl--;
-    ip_hdr->check = 0;
-    new_check = ntohs(checksum((uint16_t *) ip_hdr, sizeof(struct iphdr)));
-    ip_hdr->check = new_check;
-
-    struct arp_entry *arp_table_entry = get_arp_entry(best_route->next_hop);
-
-    // If no ARP entry was found.
-    if (arp_table_entry == NULL) {
+/**
+ * @brief Hashes the 5-tuple of an IP packet, so all the packets of a flow get
+ * the same hash.
+ *
+ * @param ip_hdr
+ * @return The flow hash.
+ */
+uint32_t flow_hash(struct iphdr *ip_hdr) {
+    uint32_t ports = get_l4_ports(ip_hdr);
+
+    // Mix the fields, then apply the murmur3 finalizer.
+    uint32_t h = ip_hdr->saddr * 0x9e3779b1;
+    h ^= ip_hdr->daddr + 0x7f4a7c15 + (h << 6) + (h >> 2);
+    h ^= ports + 0x7f4a7c15 + (h << 6) + (h >> 2);
+    h ^= ip_hdr->protocol;
+
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+
+    return h;
+}
 
-        // Enqueue the packet.
-        struct packet *new_packet = malloc(sizeof(struct packet));
-        memcpy(new_packet, packet, sizeof(struct packet));
-        queue_enq(q, new_packet);
+static inline int nexthop_up(const struct nexthop *nh) {
+    return nh->neighbour == NULL || nh->neighbour->up;
+}
 
+/**
+ * @brief Picks the path of a route for a packet, by the packet's flow hash.
+ * The flows of a path that is down move to the next live path of the group,
+ * and once the whole group is down to its backup group.
+ *
+ * @param group The next-hop group of the route found for the packet.
+ * @param ip_hdr
+ * @return The chosen next hop, the primary one if no path is up.
+ */
+struct nexthop *select_nexthop(struct nexthop_group *group, struct iphdr *ip_hdr) {
+    struct nexthop *primary = NULL;
+    uint32_t hash = 0;
+    int hashed = 0;
+
+    for (; group != NULL; group = group->backup) {
+        uint32_t index = 0;
+
+        if (group->count > 1) {
+            if (!hashed) {
+                hash = flow_hash(ip_hdr);
+                hashed = 1;
+            }
+            // Map the hash on [0, count) without a division.
+            index = ((uint64_t) hash * group->count) >> 32;
+        }
 
-        char *target_ip_char = get_interface_ip(interface);
-        uint32_t target_ip = convert_string_ip(target_ip_char);
-        struct ether_header new_eth_hdr;
-        uint8_t best_route_mac[6];
-        uint8_t broadcast_mac[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+        if (primary == NULL) {
+            primary = &group->hops[index];
+        }
 
-        get_interface_mac(best_route->interface, best_route_mac);
+        for (int j = 0; j < group->count; j++) {
+            if (nexthop_up(&group->hops[index])) {
+                return &group->hops[index];
+            }
+            index = index + 1 == (uint32_t) group->count ? 0 : index + 1;
+        }
+    }
 
-        memcpy(new_eth_hdr.ether_dhost, broadcast_mac, sizeof(new_eth_hdr.ether_dhost));
-        memcpy(new_eth_hdr.ether_shost, best_route_mac, sizeof(new_eth_hdr.ether_shost));
-        new_eth_hdr.ether_type = htons(ETHERTYPE_ARP);
+    return primary;
+}
 
-        send_arp(best_route->next_hop, target_ip, &new_eth_hdr, best_route->interface, htons(ARP_OP_REQUEST));
+/**
+ * @brief Looks up the target_ip among the static neighbours, then linear
+ * searches the ARP table for it.
+ *
+ * @param target_ip
+ * @return The ARP entry corresponding to the IP, NULL if the IP cannot be found.
+ */
+const struct arp_entry *get_arp_entry(uint32_t target_ip) {
+    if (static_neighbours.size > 0) {
+        const struct arp_entry *entry = &static_neighbour_table[mph_lookup(&static_neighbours, target_ip)];
 
-        return;
+        if (entry->ip == target_ip) {
+            return entry;
+        }
     }
 
-    memcpy(eth_hdr->ether_dhost, arp_table_entry->mac, sizeof(eth_hdr->ether_dhost));
-    get_interface_mac(best_route->interface, eth_hdr->ether_shost);
+    if (!ARP_RESOLUTION) {
+        return NULL;
+    }
 
-    // Send the packet
-    send_to_link(best_route->interface, buf, len);
+    for (int i=0; i<arp_table_size; i++) {
+        if (arp_table[i].valid && target_ip == arp_table[i].entry.ip) {
+            return &arp_table[i].entry;
+        }
+    }
+    return NULL;
 }
 
 /**
- * @brief Updates the ARP table, adding a new entry in the table.
+ * @brief Patches a 32 bit field covered by a checksum, updating the checksum
+ * incrementally instead of recomputing it.
  *
- * @param arp_hdr ARP header.
+ * @param check The checksum to update, in network order.
+ * @param old_val Old value of the field, in network order.
+ * @param new_val New value of the field, in network order.
  */
-void update_arp_table(struct arp_header *arp_hdr) {
-    // Allocate memory.
-    arp_table = realloc(arp_table, sizeof(struct arp_entry) * (arp_table_size+1));
+void checksum_update32(uint16_t *check, uint32_t old_val, uint32_t new_val) {
+    *check = checksum_update(*check, old_val >> 16, new_val >> 16);
+    *check = checksum_update(*check, old_val & 0xffff, new_val & 0xffff);
+}
 
-    // Add the new entry.
-    arp_table[arp_table_size].ip = arp_hdr->spa;
-    memcpy(arp_table[arp_table_size].mac, arp_hdr->sha, sizeof(arp_hdr->sha));
+/**
+ * @brief Fills the addresses and the ICMP error header templates of every interface.
+ * Called once at startup, so the ICMP paths never query the kernel.
+ */
+void init_interfaces(void) {
+    for (int i = 0; i < ROUTER_NUM_INTERFACES; i++) {
+        struct interface_info *iface = &ifaces[i];
+
+        iface->ip = convert_string_ip(get_interface_ip(i));
+        get_interface_mac(i, iface->mac);
+        iface->mtu = get_interface_mtu(i);
+
+        // IPv6 addresses. Without a configured link-local address, derive it
+        // from the MAC (modified EUI-64).
+        if (get_interface_ip6(i, &iface->ip6, 0) < 0) {
+            memset(&iface->ip6, 0, sizeof(iface->ip6));
+        }
+        if (get_interface_ip6(i, &iface->ip6_ll, 1) < 0) {
+            uint8_t *ll = iface->ip6_ll.s6_addr;
+
+            memset(ll, 0, sizeof(iface->ip6_ll));
+            ll[0] = 0xfe;
+            ll[1] = 0x80;
+            ll[8] = iface->mac[0] ^ 0x02;
+            ll[9] = iface->mac[1];
+            ll[10] = iface->mac[2];
+            ll[11] = 0xff;
+            ll[12] = 0xfe;
+            ll[13] = iface->mac[3];
+            ll[14] = iface->mac[4];
+            ll[15] = iface->mac[5];
+        }
 
-    // Update the size of the table.
-    arp_table_size++;
+        // ETHERNET template, only the destination changes per packet.
+        memcpy(iface->eth_template.ether_shost, iface->mac, sizeof(iface->mac));
+        iface->eth_template.ether_type = htons(ETHERTYPE_IP);
+
+        // IP template, only the destination changes per packet. The checksum is
+        // computed with daddr = 0 and patched incrementally when sending.
+        struct iphdr *ip_hdr = &iface->ip_template;
+        memset(ip_hdr, 0, sizeof(struct iphdr));
+        ip_hdr->version = 4;
+        ip_hdr->ihl = sizeof(struct iphdr) / 4;
+        ip_hdr->tot_len = htons(sizeof(struct iphdr) + sizeof(struct icmphdr) + ICMP_ERROR_QUOTE_LEN);
+        ip_hdr->ttl = MAX_TTL;
+        ip_hdr->protocol = ICMP;
+        ip_hdr->saddr = iface->ip;
+        ip_hdr->check = htons(checksum((uint16_t *) ip_hdr, sizeof(struct iphdr)));
+    }
 }
 
 /**
- * @brief Creates and returns a new packet.
+ * @brief Turns a received ICMP packet into a reply in place: the addresses are
+ * swapped, the type and code replaced and both checksums patched incrementally.
+ * The reply is left in the packet, ready for interface-output.
  *
- * @param payload The packet's payload.
- * @param len The packet's length.
- * @param interface
- * @return
+ * @param packet The packet that generated the ICMP message.
+ * @param icmp_type The type of the ICMP message.
+ * @param icmp_code The code of the ICMP message.
+ * @param interface The interface on which to send it on.
  */
-struct packet *create_packet(char *payload, size_t len, int interface) {
-    struct packet *new_packet = malloc(sizeof(struct packet));
-    new_packet->payload = payload;
-    new_packet->len = len;
-    new_packet->interface = interface;
+void build_icmp_reply(struct packet *packet, uint8_t icmp_type, uint8_t icmp_code, int interface) {
+    // Setup, unpack.
+    struct ether_header *eth_hdr = get_ether_header(packet->payload);
+    struct iphdr *ip_hdr = get_ip_header(packet->payload);
+    struct icmphdr *icmp_hdr = get_icmp_header(packet->payload);
 
-    return new_packet;
-}
+    // Rewrite the ETHERNET header.
+    memcpy(eth_hdr->ether_dhost, eth_hdr->ether_shost, sizeof(eth_hdr->ether_dhost));
+    memcpy(eth_hdr->ether_shost, ifaces[interface].mac, sizeof(eth_hdr->ether_shost));
 
-int main(int argc, char *argv[])
-{
-    char buf[MAX_PACKET_LEN];
+    // Rewrite the IP header. Swapping the addresses leaves the checksum unchanged,
+    // only the TTL needs to be accounted for.
+    uint32_t saddr = ip_hdr->saddr;
+    ip_hdr->saddr = ip_hdr->daddr;
+    ip_hdr->daddr = saddr;
 
-    // Do not modify this line.
-    init(argc - 2, argv + 2);
+    uint16_t old_word = htons(ip_hdr->ttl << 8 | ip_hdr->protocol);
+    ip_hdr->ttl = MAX_TTL;
+    ip_hdr->check = checksum_update(ip_hdr->check, old_word, htons(ip_hdr->ttl << 8 | ip_hdr->protocol));
 
-    // Read the routing table and sort it.
-    rtable = malloc(sizeof(struct route_table_entry) * RTABLE_MAXSIZE);
-    rtable_size = read_rtable(argv[1], rtable);
-    qsort((void *) rtable, rtable_size, sizeof(struct route_table_entry), comparator);
+    // Rewrite the ICMP header.
+    old_word = htons(icmp_hdr->type << 8 | icmp_hdr->code);
+    icmp_hdr->type = icmp_type;
+    icmp_hdr->code = icmp_code;
+    icmp_hdr->checksum = checksum_update(icmp_hdr->checksum, old_word, htons(icmp_type << 8 | icmp_code));
 
-    // Set arp table values.
-    arp_table = NULL;
-    arp_table_size = 0;
+    packet->out_interface = interface;
+    stats.icmp_sent++;
+}
 
-    // Initialize the queue.
-    q = queue_create();
+/**
+ * @brief Builds an ICMP error message in place: the old IP header and 8 bytes of
+ * its payload are moved behind the new headers, which are copied from the
+ * interface's templates. The message is left in the packet, ready for
+ * interface-output.
+ *
+ * @param packet The packet that generated the error.
+ * @param icmp_type The ICMP error type.
+ * @param icmp_code The ICMP error code.
+ * @param interface The interface on which to send the ICMP on.
+ */
+void build_icmp_error(struct packet *packet, uint8_t icmp_type, uint8_t icmp_code, int interface) {
+    // Setup, unpack.
+    char *buf = packet->payload;
+    struct ether_header *eth_hdr = get_ether_header(buf);
+    struct iphdr *ip_hdr = get_ip_header(buf);
+    struct icmphdr *icmp_hdr = get_icmp_header(buf);
+    struct interface_info *iface = &ifaces[interface];
+    uint32_t daddr = ip_hdr->saddr;
+
+    // Move the old IP header and the first 8 bytes of its payload after the new ICMP header.
+    memmove((char *) icmp_hdr + sizeof(struct icmphdr), ip_hdr, ICMP_ERROR_QUOTE_LEN);
+
+    // Construct the ETHERNET header.
+    memcpy(eth_hdr->ether_dhost, eth_hdr->ether_shost, sizeof(eth_hdr->ether_dhost));
+    memcpy(eth_hdr->ether_shost, iface->eth_template.ether_shost, sizeof(eth_hdr->ether_shost));
+    eth_hdr->ether_type = iface->eth_template.ether_type;
+
+    // Construct the IP header from the template.
+    memcpy(ip_hdr, &iface->ip_template, sizeof(struct iphdr));
+    ip_hdr->daddr = daddr;
+    checksum_update32(&ip_hdr->check, 0, daddr);
+
+    // Construct the ICMP header.
+    icmp_hdr->type = icmp_type;
+    icmp_hdr->code = icmp_code;
+    icmp_hdr->checksum = 0;
+    icmp_hdr->un.gateway = 0;
+    icmp_hdr->checksum = htons(checksum((uint16_t *) icmp_hdr, sizeof(struct icmphdr) + ICMP_ERROR_QUOTE_LEN));
+
+    packet->len = sizeof(struct ether_header) + sizeof(struct iphdr) + sizeof(struct icmphdr) + ICMP_ERROR_QUOTE_LEN;
+    packet->out_interface = interface;
+    stats.icmp_sent++;
+}
 
-    while (1) {
+/**
+ * @brief Builds and sends an ICMP error message, for packets outside the
+ * processing graph.
+ *
+ * @param packet The packet that generated the error.
+ * @param icmp_type The ICMP error type.
+ * @param icmp_code The ICMP error code.
+ * @param interface The interface on which to send the ICMP on.
+ */
+void send_icmp_error(struct packet *packet, uint8_t icmp_type, uint8_t icmp_code, int interface) {
+    build_icmp_error(packet, icmp_type, icmp_code, interface);
+    output_frame(interface, packet->payload, packet->len);
+}
 
-        int interface;
-        size_t len;
+/**
+ * @brief Sends an ARP message.
+ *
+ * @param daddr Destination IP address.
+ * @param saddr Sender IP address.
+ * @param eth_hdr Ethernet header.
+ * @param interface Interface ID.
+ * @param op ARP OPCODE.
+ */
+void send_arp(uint32_t daddr, uint32_t saddr, struct ether_header *eth_hdr, int interface, uint16_t op) {
+    struct arp_header new_arp_hdr;
+
+    // Construct the ARP header.
+    new_arp_hdr.op = op;
+    new_arp_hdr.hlen = ARP_HLEN;
+    new_arp_hdr.plen = ARP_PLEN;
+    new_arp_hdr.htype = htons(ARP_HTYPE);
+    new_arp_hdr.ptype = htons(ARP_PTYPE);
+
+    memcpy(&new_arp_hdr.sha, eth_hdr->ether_shost, sizeof(new_arp_hdr.sha));
+    memcpy(&new_arp_hdr.tha, eth_hdr->ether_dhost, sizeof(new_arp_hdr.tha));
+
+    new_arp_hdr.spa = saddr;
+    new_arp_hdr.tpa = daddr;
+
+    // Build the frame.
+    char buf[sizeof(struct ether_header) + sizeof(struct arp_header)];
+    memcpy(buf, eth_hdr, sizeof(struct ether_header));
+    memcpy(buf + sizeof(struct ether_header), &new_arp_hdr, sizeof(struct arp_header));
+
+    // Send the packet.
+    output_frame(interface, buf, sizeof(buf));
+}
+
+/**
+ * @brief Broadcasts an ARP request for next_hop on the interface.
+ *
+ * @param next_hop The IP address to resolve.
+ * @param interface Interface ID.
+ */
+void send_arp_request(uint32_t next_hop, int interface) {
+    struct ether_header eth_hdr;
+
+    memset(eth_hdr.ether_dhost, 0xFF, sizeof(eth_hdr.ether_dhost));
+    memcpy(eth_hdr.ether_shost, ifaces[interface].mac, sizeof(eth_hdr.ether_shost));
+    eth_hdr.ether_type = htons(ETHERTYPE_ARP);
+
+    send_arp(next_hop, ifaces[interface].ip, &eth_hdr, interface, htons(ARP_OP_REQUEST));
+    stats.arp_requests++;
+}
+
+/**
+ * @brief Aging timer callback, invalidates an ARP cache entry.
+ *
+ * @param arg The ARP cache entry.
+ */
+void arp_entry_expired(void *arg) {
+    struct arp_cache_entry *cache_entry = arg;
+
+    cache_entry->valid = 0;
+}
+
+/**
+ * @brief Updates the ARP table, adding a new entry in the table or refreshing
+ * the existing one. Either way the entry's aging timer is restarted.
+ *
+ * @param arp_hdr ARP header.
+ */
+void update_arp_table(struct arp_header *arp_hdr) {
+    struct arp_cache_entry *cache_entry = NULL;
+
+    // Look for the existing entry, remember the first free slot.
+    for (int i = 0; i < arp_table_size; i++) {
+        if (arp_table[i].valid && arp_table[i].entry.ip == arp_hdr->spa) {
+            cache_entry = &arp_table[i];
+            break;
+        }
+        if (!arp_table[i].valid && cache_entry == NULL) {
+            cache_entry = &arp_table[i];
+        }
+    }
+
+    if (cache_entry == NULL) {
+        // Table full, the sender will be resolved again later.
+        if (arp_table_size == ARP_TABLE_MAXSIZE) {
+            return;
+        }
+        cache_entry = &arp_table[arp_table_size++];
+        timer_init(&cache_entry->aging, arp_entry_expired, cache_entry);
+    }
+
+    // Add the new entry.
+    cache_entry->entry.ip = arp_hdr->spa;
+    memcpy(cache_entry->entry.mac, arp_hdr->sha, sizeof(arp_hdr->sha));
+    cache_entry->valid = 1;
+    timer_add(&timers, &cache_entry->aging, ARP_ENTRY_TIMEOUT_MS);
+}
+
+/**
+ * @brief Finds the pending ARP resolution for a next hop.
+ *
+ * @param next_hop
+ * @return The pending resolution, NULL if next_hop is not being resolved.
+ */
+struct arp_pending *get_arp_pending(uint32_t next_hop) {
+    for (int i = 0; i < ARP_PENDING_MAXSIZE; i++) {
+        if (arp_pending[i].in_use && arp_pending[i].family == AF_INET && arp_pending[i].next_hop == next_hop) {
+            return &arp_pending[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Sends a liveness probe to a gateway: an ARP request unicast to its
+ * cached MAC, or broadcast if it is not resolved.
+ *
+ * @param neighbour
+ */
+void send_probe(struct neighbour *neighbour) {
+    const struct arp_entry *entry = get_arp_entry(neighbour->ip);
+    struct ether_header eth_hdr;
+
+    if (entry == NULL) {
+        send_arp_request(neighbour->ip, neighbour->interface);
+        return;
+    }
+
+    memcpy(eth_hdr.ether_dhost, entry->mac, sizeof(eth_hdr.ether_dhost));
+    memcpy(eth_hdr.ether_shost, ifaces[neighbour->interface].mac, sizeof(eth_hdr.ether_shost));
+    eth_hdr.ether_type = htons(ETHERTYPE_ARP);
+
+    send_arp(neighbour->ip, ifaces[neighbour->interface].ip, &eth_hdr, neighbour->interface, htons(ARP_OP_REQUEST));
+}
+
+/**
+ * @brief Marks a gateway down after PROBE_DETECT_MULT unanswered probes. Its
+ * paths are skipped from the next packet on, and its ARP cache entry is
+ * dropped, so the next probes are broadcast in case its MAC changes.
+ *
+ * @param neighbour
+ */
+void neighbour_down(struct neighbour *neighbour) {
+    neighbour->up = 0;
+    stats.nh_failures++;
+
+    for (int i = 0; i < arp_table_size; i++) {
+        if (arp_table[i].valid && arp_table[i].entry.ip == neighbour->ip) {
+            timer_cancel(&timers, &arp_table[i].aging);
+            arp_table[i].valid = 0;
+        }
+    }
+}
+
+/**
+ * @brief Records a reply from a gateway, bringing it back up if it was down.
+ *
+ * @param ip The sender of the reply.
+ * @param interface The interface it has been received on.
+ */
+void neighbour_alive(uint32_t ip, int interface) {
+    for (int i = 0; i < neighbours_size; i++) {
+        if (neighbours[i].ip == ip && neighbours[i].interface == interface) {
+            neighbours[i].missed = 0;
+            if (!neighbours[i].up) {
+                neighbours[i].up = 1;
+                stats.nh_recoveries++;
+            }
+        }
+    }
+}
+
+/**
+ * @brief Checks if an IPv6 address belongs to the router.
+ *
+ * @param addr
+ * @return 1 if one of the interfaces has the address, 0 otherwise.
+ */
+int is_own_ip6(const struct in6_addr *addr) {
+    if (IN6_IS_ADDR_UNSPECIFIED(addr)) {
+        return 0;
+    }
+
+    for (int i = 0; i < ROUTER_NUM_INTERFACES; i++) {
+        if (IN6_ARE_ADDR_EQUAL(addr, &ifaces[i].ip6) || IN6_ARE_ADDR_EQUAL(addr, &ifaces[i].ip6_ll)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Computes the ICMPv6 checksum, which also covers a pseudo-header made of
+ * the addresses, the payload length and the next header of the IPv6 header.
+ *
+ * @param ip6_hdr IPv6 header, followed by the ICMPv6 message.
+ * @return The checksum, in host order.
+ */
+uint16_t icmp6_checksum(struct ip6hdr *ip6_hdr) {
+    uint16_t len = ntohs(ip6_hdr->payload_len);
+    uint32_t sum = 0;
+
+    sum = checksum_partial(sum, &ip6_hdr->saddr, 2 * sizeof(struct in6_addr));
+    sum += len + ICMP6;
+    sum = checksum_partial(sum, ip6_hdr + 1, len);
+
+    return checksum_fold(sum);
+}
+
+/**
+ * @brief Sends an ICMPv6 error message, built in place like the IPv4 ones: the
+ * offending packet is moved behind the new headers and truncated so the error
+ * fits in the minimum IPv6 MTU.
+ *
+ * @param packet The packet that generated the error.
+ * @param icmp_type The ICMPv6 error type.
+ * @param icmp_code The ICMPv6 error code.
+ * @param interface The interface on which to send the error on.
+ * @param data The rest of the ICMPv6 header, the MTU for packet too big.
+ */
+void send_icmp6_error(struct packet *packet, uint8_t icmp_type, uint8_t icmp_code, int interface, uint32_t data) {
+    // Setup, unpack.
+    char *buf = packet->payload;
+    struct ether_header *eth_hdr = get_ether_header(buf);
+    struct ip6hdr *ip6_hdr = get_ip6_header(buf);
+    struct icmp6hdr *icmp6_hdr = get_icmp6_header(buf);
+    struct interface_info *iface = &ifaces[interface];
+
+    // Never answer multicast packets or other ICMPv6 errors (RFC 4443 2.4).
+    if (ip6_hdr->daddr.s6_addr[0] == 0xff) {
+        return;
+    }
+    if (ip6_hdr->next_header == ICMP6 && icmp6_hdr->type < ICMP6_ECHO_REQUEST) {
+        return;
+    }
+
+    struct in6_addr daddr = ip6_hdr->saddr;
+    size_t quote_len = packet->len - sizeof(struct ether_header);
+    if (quote_len > ICMP6_ERROR_MAX_QUOTE) {
+        quote_len = ICMP6_ERROR_MAX_QUOTE;
+    }
+
+    // Move the offending packet after the new ICMPv6 header.
+    memmove((char *) icmp6_hdr + sizeof(struct icmp6hdr), ip6_hdr, quote_len);
+
+    // Construct the ETHERNET header.
+    memcpy(eth_hdr->ether_dhost, eth_hdr->ether_shost, sizeof(eth_hdr->ether_dhost));
+    memcpy(eth_hdr->ether_shost, iface->mac, sizeof(eth_hdr->ether_shost));
+    eth_hdr->ether_type = htons(ETHERTYPE_IPV6);
+
+    // Construct the IPv6 header, sourced from a global address if there is one.
+    ip6_hdr->vtc_flow = htonl(6 << 28);
+    ip6_hdr->payload_len = htons(sizeof(struct icmp6hdr) + quote_len);
+    ip6_hdr->next_header = ICMP6;
+    ip6_hdr->hop_limit = MAX_TTL;
+    ip6_hdr->saddr = IN6_IS_ADDR_UNSPECIFIED(&iface->ip6) ? iface->ip6_ll : iface->ip6;
+    ip6_hdr->daddr = daddr;
+
+    // Construct the ICMPv6 header.
+    icmp6_hdr->type = icmp_type;
+    icmp6_hdr->code = icmp_code;
+    icmp6_hdr->data = htonl(data);
+    icmp6_hdr->checksum = 0;
+    icmp6_hdr->checksum = htons(icmp6_checksum(ip6_hdr));
+
+    // Send the packet.
+    size_t len = sizeof(struct ether_header) + sizeof(struct ip6hdr) + sizeof(struct icmp6hdr) + quote_len;
+    output_frame(interface, buf, len);
+    stats.icmp_sent++;
+}
+
+/**
+ * @brief Sends a neighbour solicitation for target to its solicited-node
+ * multicast address.
+ *
+ * @param target The IPv6 address to resolve.
+ * @param interface Interface ID.
+ */
+void send_ns(const struct in6_addr *target, int interface) {
+    char buf[sizeof(struct ether_header) + sizeof(struct ip6hdr) + sizeof(struct nd_msg) + sizeof(struct nd_opt_lladdr)];
+    struct ether_header *eth_hdr = get_ether_header(buf);
+    struct ip6hdr *ip6_hdr = get_ip6_header(buf);
+    struct nd_msg *ns = (struct nd_msg *) get_icmp6_header(buf);
+    struct nd_opt_lladdr *opt = (struct nd_opt_lladdr *)(ns + 1);
+    struct interface_info *iface = &ifaces[interface];
+
+    memset(buf, 0, sizeof(buf));
+
+    // Construct the ETHERNET header, multicast to 33:33 + the last 32 bits of ff02::1:ffXX:XXXX.
+    eth_hdr->ether_dhost[0] = 0x33;
+    eth_hdr->ether_dhost[1] = 0x33;
+    eth_hdr->ether_dhost[2] = 0xff;
+    memcpy(&eth_hdr->ether_dhost[3], &target->s6_addr[13], 3);
+    memcpy(eth_hdr->ether_shost, iface->mac, sizeof(eth_hdr->ether_shost));
+    eth_hdr->ether_type = htons(ETHERTYPE_IPV6);
+
+    // Construct the IPv6 header.
+    ip6_hdr->vtc_flow = htonl(6 << 28);
+    ip6_hdr->payload_len = htons(sizeof(struct nd_msg) + sizeof(struct nd_opt_lladdr));
+    ip6_hdr->next_header = ICMP6;
+    ip6_hdr->hop_limit = ND_HOP_LIMIT;
+    ip6_hdr->saddr = iface->ip6_ll;
+    ip6_hdr->daddr.s6_addr[0] = 0xff;
+    ip6_hdr->daddr.s6_addr[1] = 0x02;
+    ip6_hdr->daddr.s6_addr[11] = 0x01;
+    ip6_hdr->daddr.s6_addr[12] = 0xff;
+    memcpy(&ip6_hdr->daddr.s6_addr[13], &target->s6_addr[13], 3);
+
+    // Construct the solicitation, with our MAC as source link-layer address.
+    ns->hdr.type = ICMP6_NEIGHBOR_SOLICIT;
+    ns->target = *target;
+    opt->type = ND_OPT_SOURCE_LLADDR;
+    opt->len = 1;
+    memcpy(opt->mac, iface->mac, sizeof(opt->mac));
+    ns->hdr.checksum = htons(icmp6_checksum(ip6_hdr));
+
+    output_frame(interface, buf, sizeof(buf));
+    stats.nd_solicits++;
+}
+
+/**
+ * @brief Linear search the neighbour cache for the target_ip.
+ *
+ * @param target_ip
+ * @return The neighbour entry of the IP, NULL if the IP cannot be found.
+ */
+struct nd_cache_entry *get_nd_entry(const struct in6_addr *target_ip) {
+    for (int i = 0; i < nd_table_size; i++) {
+        if (nd_table[i].valid && IN6_ARE_ADDR_EQUAL(target_ip, &nd_table[i].ip)) {
+            return &nd_table[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Aging timer callback, invalidates a neighbour cache entry.
+ *
+ * @param arg The neighbour cache entry.
+ */
+void nd_entry_expired(void *arg) {
+    struct nd_cache_entry *cache_entry = arg;
+
+    cache_entry->valid = 0;
+}
+
+/**
+ * @brief Adds or refreshes a neighbour cache entry, restarting its aging timer.
+ *
+ * @param ip
+ * @param mac
+ */
+void update_nd_table(const struct in6_addr *ip, const uint8_t *mac) {
+    struct nd_cache_entry *cache_entry = get_nd_entry(ip);
+
+    // Reuse a free slot, or take a new one.
+    for (int i = 0; i < nd_table_size && cache_entry == NULL; i++) {
+        if (!nd_table[i].valid) {
+            cache_entry = &nd_table[i];
+        }
+    }
+
+    if (cache_entry == NULL) {
+        if (nd_table_size == ND_TABLE_MAXSIZE) {
+            return;
+        }
+        cache_entry = &nd_table[nd_table_size++];
+        timer_init(&cache_entry->aging, nd_entry_expired, cache_entry);
+    }
+
+    cache_entry->ip = *ip;
+    memcpy(cache_entry->mac, mac, sizeof(cache_entry->mac));
+    cache_entry->valid = 1;
+    timer_add(&timers, &cache_entry->aging, ARP_ENTRY_TIMEOUT_MS);
+}
+
+/**
+ * @brief Finds the pending neighbour resolution for an IPv6 next hop.
+ *
+ * @param next_hop
+ * @return The pending resolution, NULL if next_hop is not being resolved.
+ */
+struct arp_pending *get_nd_pending(const struct in6_addr *next_hop) {
+    for (int i = 0; i < ARP_PENDING_MAXSIZE; i++) {
+        if (arp_pending[i].in_use && arp_pending[i].family == AF_INET6 &&
+            IN6_ARE_ADDR_EQUAL(&arp_pending[i].next_hop6, next_hop)) {
+            return &arp_pending[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Releases a pending ARP resolution, dropping the packets still queued.
+ * If send_unreachable is set, the sources are notified with ICMP host unreachable.
+ *
+ * @param pending
+ * @param send_unreachable
+ */
+void release_arp_pending(struct arp_pending *pending, int send_unreachable) {
+    timer_cancel(&timers, &pending->retransmit);
+
+    if (trace != NULL) {
+        trace_stamp(trace);
+    }
+
+    while (!queue_empty(pending->packets)) {
+        struct packet *packet = queue_deq(pending->packets);
+
+        if (send_unreachable && pending->family == AF_INET6) {
+            send_icmp6_error(packet, ICMP6_DEST_UNREACH, ICMP6_ADDR_UNREACH, packet->interface, 0);
+        }
+        else if (send_unreachable) {
+            trace_packet(packet, TRACE_ICMP, TRACE_ARP_TIMEOUT, packet->route, pending->interface);
+            send_icmp_error(packet, ICMP_DESTINATION_UNREACHABLE, ICMP_HOST_UNREACHABLE, packet->interface);
+        }
+        stats.dropped++;
+        pool_set_put(frame_buffers, packet);
+    }
+
+    pending->queued = 0;
+    pending->in_use = 0;
+}
+
+/**
+ * @brief Retransmit timer callback. Sends the ARP request again, or gives up on
+ * the next hop after ARP_MAX_RETRIES attempts and expires its queued packets.
+ *
+ * @param arg The pending ARP resolution.
+ */
+void arp_retransmit(void *arg) {
+    struct arp_pending *pending = arg;
+
+    if (pending->retries >= ARP_MAX_RETRIES) {
+        stats.arp_timeouts++;
+        release_arp_pending(pending, 1);
+        return;
+    }
+
+    pending->retries++;
+    if (pending->family == AF_INET6) {
+        send_ns(&pending->next_hop6, pending->interface);
+    }
+    else {
+        send_arp_request(pending->next_hop, pending->interface);
+    }
+    timer_add(&timers, &pending->retransmit, ARP_RETRANSMIT_MS);
+}
+
+/**
+ * @brief Takes a free resolution slot for a next hop on the interface.
+ *
+ * @param family AF_INET for ARP, AF_INET6 for neighbour discovery.
+ * @param interface
+ * @return The new pending resolution, NULL if all the slots are busy.
+ */
+struct arp_pending *new_pending(int family, int interface) {
+    for (int i = 0; i < ARP_PENDING_MAXSIZE; i++) {
+        if (!arp_pending[i].in_use) {
+            arp_pending[i].in_use = 1;
+            arp_pending[i].family = family;
+            arp_pending[i].interface = interface;
+            arp_pending[i].retries = 0;
+            timer_add(&timers, &arp_pending[i].retransmit, ARP_RETRANSMIT_MS);
+            return &arp_pending[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Queues a packet until its next hop is resolved. The payload is copied
+ * into a pool buffer, since the receive buffer is reused for the next packet.
+ * The buffer has room for an ICMP error to still be built in it on expiry.
+ *
+ * @param pending The resolution of the packet's next hop.
+ * @param packet Packet ready to be sent, only the ETHERNET addresses are missing.
+ */
+void enqueue_pending(struct arp_pending *pending, struct packet *packet) {
+    struct packet *new_packet = NULL;
+
+    if (pending->queued < ARP_PENDING_MAXPACKETS) {
+        new_packet = pool_set_get(frame_buffers, sizeof(struct packet) + packet->len + ICMP_ERROR_ROOM);
+    }
+
+    if (new_packet == NULL) {
+        if (pending->family == AF_INET) {
+            trace_packet(packet, TRACE_DROPPED, TRACE_ARP_QUEUE_FULL, packet->route, pending->interface);
+        }
+        stats.dropped++;
+        return;
+    }
+
+    // Enqueue a copy of the packet.
+    new_packet->payload = (char *)(new_packet + 1);
+    memcpy(new_packet->payload, packet->payload, packet->len);
+    new_packet->len = packet->len;
+    new_packet->interface = packet->interface;
+    new_packet->route = packet->route;
+    new_packet->learned = packet->learned;
+
+    queue_enq(pending->packets, new_packet);
+    pending->queued++;
+}
+
+/**
+ * @brief Queues a packet until its next hop is resolved, starting the ARP
+ * resolution if this is the first packet for the next hop.
+ *
+ * @param packet Packet ready to be sent, only the ETHERNET addresses are missing.
+ * @param nh The next hop chosen for the packet.
+ */
+void queue_for_arp(struct packet *packet, struct nexthop *nh) {
+    struct arp_pending *pending = get_arp_pending(nh->ip);
+
+    if (pending == NULL) {
+        pending = new_pending(AF_INET, nh->interface);
+        if (pending == NULL) {
+            trace_packet(packet, TRACE_DROPPED, TRACE_ARP_QUEUE_FULL, packet->route, nh->interface);
+            stats.dropped++;
+            return;
+        }
+
+        pending->next_hop = nh->ip;
+        send_arp_request(pending->next_hop, pending->interface);
+    }
+
+    trace_packet(packet, TRACE_QUEUED, TRACE_NONE, packet->route, nh->interface);
+    enqueue_pending(pending, packet);
+}
+
+/**
+ * @brief Same as queue_for_arp(), for an IPv6 next hop resolved with neighbour
+ * solicitations.
+ *
+ * @param packet Packet ready to be sent, only the ETHERNET addresses are missing.
+ * @param next_hop
+ * @param interface The output interface.
+ */
+void queue_for_nd(struct packet *packet, const struct in6_addr *next_hop, int interface) {
+    struct arp_pending *pending = get_nd_pending(next_hop);
+
+    if (pending == NULL) {
+        pending = new_pending(AF_INET6, interface);
+        if (pending == NULL) {
+            stats.dropped++;
+            return;
+        }
+
+        pending->next_hop6 = *next_hop;
+        send_ns(&pending->next_hop6, pending->interface);
+    }
+
+    enqueue_pending(pending, packet);
+}
+
+/**
+ * @brief Sends the packets waiting for a next hop that has just been resolved.
+ *
+ * @param pending
+ * @param mac The next hop's MAC address.
+ */
+void flush_arp_pending(struct arp_pending *pending, uint8_t *mac) {
+    if (trace != NULL) {
+        trace_stamp(trace);
+    }
+
+    while (!queue_empty(pending->packets)) {
+        struct packet *packet = queue_deq(pending->packets);
+        struct ether_header *eth_hdr = get_ether_header(packet->payload);
+
+        if (pending->family == AF_INET) {
+            trace_packet(packet, TRACE_FORWARDED, TRACE_RESOLVED, packet->route, pending->interface);
+        }
+
+        memcpy(eth_hdr->ether_dhost, mac, sizeof(eth_hdr->ether_dhost));
+        memcpy(eth_hdr->ether_shost, ifaces[pending->interface].mac, sizeof(eth_hdr->ether_shost));
+        output_frame(pending->interface, packet->payload, packet->len);
+        stats.forwarded++;
+
+        pool_set_put(frame_buffers, packet);
+    }
+
+    release_arp_pending(pending, 0);
+}
+
+/**
+ * @brief Answers an ICMPv6 echo request in place. Swapping the addresses leaves
+ * the pseudo-header sum unchanged, so only the type needs a checksum update.
+ *
+ * @param packet
+ */
+void send_icmp6_echo_reply(struct packet *packet) {
+    struct ether_header *eth_hdr = get_ether_header(packet->payload);
+    struct ip6hdr *ip6_hdr = get_ip6_header(packet->payload);
+    struct icmp6hdr *icmp6_hdr = get_icmp6_header(packet->payload);
+
+    memcpy(eth_hdr->ether_dhost, eth_hdr->ether_shost, sizeof(eth_hdr->ether_dhost));
+    memcpy(eth_hdr->ether_shost, ifaces[packet->interface].mac, sizeof(eth_hdr->ether_shost));
+
+    struct in6_addr saddr = ip6_hdr->saddr;
+    ip6_hdr->saddr = ip6_hdr->daddr;
+    ip6_hdr->daddr = saddr;
+    ip6_hdr->hop_limit = MAX_TTL;
+
+    uint16_t old_word = htons(icmp6_hdr->type << 8 | icmp6_hdr->code);
+    icmp6_hdr->type = ICMP6_ECHO_REPLY;
+    icmp6_hdr->checksum = checksum_update(icmp6_hdr->checksum, old_word, htons(icmp6_hdr->type << 8 | icmp6_hdr->code));
+
+    output_frame(packet->interface, packet->payload, packet->len);
+    stats.icmp_sent++;
+}
+
+/**
+ * @brief Answers a neighbour solicitation for one of our addresses, turning it
+ * in place into a neighbour advertisement with our MAC as target link-layer address.
+ *
+ * @param packet The solicitation.
+ */
+void send_na(struct packet *packet) {
+    struct ether_header *eth_hdr = get_ether_header(packet->payload);
+    struct ip6hdr *ip6_hdr = get_ip6_header(packet->payload);
+    struct nd_msg *na = (struct nd_msg *) get_icmp6_header(packet->payload);
+    struct nd_opt_lladdr *opt = (struct nd_opt_lladdr *)(na + 1);
+    struct interface_info *iface = &ifaces[packet->interface];
+    uint32_t flags = ND_FLAG_ROUTER | ND_FLAG_OVERRIDE;
+
+    // Construct the IPv6 header, a solicitation from :: (duplicate address
+    // detection) is answered to all nodes.
+    if (IN6_IS_ADDR_UNSPECIFIED(&ip6_hdr->saddr)) {
+        static const uint8_t all_nodes_mac[6] = {0x33, 0x33, 0x00, 0x00, 0x00, 0x01};
+
+        memset(&ip6_hdr->daddr, 0, sizeof(ip6_hdr->daddr));
+        ip6_hdr->daddr.s6_addr[0] = 0xff;
+        ip6_hdr->daddr.s6_addr[1] = 0x02;
+        ip6_hdr->daddr.s6_addr[15] = 0x01;
+        memcpy(eth_hdr->ether_dhost, all_nodes_mac, sizeof(eth_hdr->ether_dhost));
+    }
+    else {
+        ip6_hdr->daddr = ip6_hdr->saddr;
+        memcpy(eth_hdr->ether_dhost, eth_hdr->ether_shost, sizeof(eth_hdr->ether_dhost));
+        flags |= ND_FLAG_SOLICITED;
+    }
+    memcpy(eth_hdr->ether_shost, iface->mac, sizeof(eth_hdr->ether_shost));
+
+    ip6_hdr->saddr = na->target;
+    ip6_hdr->payload_len = htons(sizeof(struct nd_msg) + sizeof(struct nd_opt_lladdr));
+    ip6_hdr->hop_limit = ND_HOP_LIMIT;
+
+    // Construct the advertisement.
+    na->hdr.type = ICMP6_NEIGHBOR_ADVERT;
+    na->hdr.code = 0;
+    na->hdr.data = htonl(flags);
+    opt->type = ND_OPT_TARGET_LLADDR;
+    opt->len = 1;
+    memcpy(opt->mac, iface->mac, sizeof(opt->mac));
+    na->hdr.checksum = 0;
+    na->hdr.checksum = htons(icmp6_checksum(ip6_hdr));
+
+    size_t len = sizeof(struct ether_header) + sizeof(struct ip6hdr) + sizeof(struct nd_msg) + sizeof(struct nd_opt_lladdr);
+    output_frame(packet->interface, packet->payload, len);
+}
+
+/**
+ * @brief Handles neighbour solicitations and advertisements.
+ *
+ * @param packet
+ */
+void handle_nd(struct packet *packet) {
+    struct ip6hdr *ip6_hdr = get_ip6_header(packet->payload);
+    struct nd_msg *nd = (struct nd_msg *) get_icmp6_header(packet->payload);
+    size_t icmp_len = ntohs(ip6_hdr->payload_len);
+    struct nd_opt_lladdr *lladdr = NULL;
+    uint8_t lladdr_type = nd->hdr.type == ICMP6_NEIGHBOR_SOLICIT ? ND_OPT_SOURCE_LLADDR : ND_OPT_TARGET_LLADDR;
+
+    // Validate the message (RFC 4861 7.1), it must come from the link.
+    if (ip6_hdr->hop_limit != ND_HOP_LIMIT || nd->hdr.code != 0 || icmp_len < sizeof(struct nd_msg) ||
+        packet->len < sizeof(struct ether_header) + sizeof(struct ip6hdr) + icmp_len) {
+        return;
+    }
+
+    // Find the link-layer address option.
+    for (size_t offset = sizeof(struct nd_msg); offset + sizeof(struct nd_opt_lladdr) <= icmp_len; ) {
+        struct nd_opt_lladdr *opt = (struct nd_opt_lladdr *)((char *) nd + offset);
+
+        if (opt->len == 0) {
+            return;
+        }
+        if (opt->type == lladdr_type) {
+            lladdr = opt;
+            break;
+        }
+        offset += opt->len * 8;
+    }
+
+    if (nd->hdr.type == ICMP6_NEIGHBOR_SOLICIT) {
+        if (!is_own_ip6(&nd->target)) {
+            return;
+        }
+
+        // Learn the sender, it is about to talk to us.
+        if (lladdr != NULL && !IN6_IS_ADDR_UNSPECIFIED(&ip6_hdr->saddr)) {
+            update_nd_table(&ip6_hdr->saddr, lladdr->mac);
+        }
+        send_na(packet);
+        return;
+    }
+
+    if (lladdr == NULL) {
+        return;
+    }
+
+    update_nd_table(&nd->target, lladdr->mac);
+
+    // Send the packets waiting for this neighbour.
+    struct arp_pending *pending = get_nd_pending(&nd->target);
+    if (pending != NULL) {
+        flush_arp_pending(pending, lladdr->mac);
+    }
+}
+
+/**
+ * @brief Forwards an IPv6 packet on the network.
+ *
+ * @param packet
+ */
+void forward_ip6(struct packet *packet) {
+    // Setup
+    struct ether_header *eth_hdr = get_ether_header(packet->payload);
+    struct ip6hdr *ip6_hdr = get_ip6_header(packet->payload);
+
+    // Link-local and multicast destinations are never routed.
+    if (IN6_IS_ADDR_LINKLOCAL(&ip6_hdr->daddr) || ip6_hdr->daddr.s6_addr[0] == 0xff) {
+        stats.dropped++;
+        return;
+    }
+
+    // Check the packet's hop limit.
+    if (ip6_hdr->hop_limit <= 1) {
+        send_icmp6_error(packet, ICMP6_TIME_EXCEEDED, 0, packet->interface, 0);
+        return;
+    }
+
+    // Find the best route.
+    int32_t route = lpm6_lookup(fib6, &ip6_hdr->daddr);
+    if (route < 0) {
+        send_icmp6_error(packet, ICMP6_DEST_UNREACH, ICMP6_NO_ROUTE, packet->interface, 0);
+        return;
+    }
+
+    // IPv6 routers never fragment, too big packets are reported to the source.
+    struct route6_table_entry *best_route = &rtable6[route];
+    int mtu = ifaces[best_route->interface].mtu;
+    if (sizeof(struct ip6hdr) + ntohs(ip6_hdr->payload_len) > mtu) {
+        send_icmp6_error(packet, ICMP6_PACKET_TOO_BIG, 0, packet->interface, mtu);
+        stats.mtu_exceeded++;
+        return;
+    }
+
+    // There is no header checksum to update in IPv6.
+    ip6_hdr->hop_limit--;
+
+    // Directly connected prefixes have :: as next hop, the destination is the neighbour.
+    const struct in6_addr *next_hop = &best_route->next_hop;
+    if (IN6_IS_ADDR_UNSPECIFIED(next_hop)) {
+        next_hop = &ip6_hdr->daddr;
+    }
+
+    struct nd_cache_entry *nd_entry = get_nd_entry(next_hop);
+
+    // If no neighbour entry was found, wait for the next hop to be resolved.
+    if (nd_entry == NULL) {
+        queue_for_nd(packet, next_hop, best_route->interface);
+        return;
+    }
+
+    memcpy(eth_hdr->ether_dhost, nd_entry->mac, sizeof(eth_hdr->ether_dhost));
+    memcpy(eth_hdr->ether_shost, ifaces[best_route->interface].mac, sizeof(eth_hdr->ether_shost));
+
+    output_frame(best_route->interface, packet->payload, packet->len);
+    stats.forwarded++;
+}
+
+/**
+ * @brief Handles an IPv6 packet: neighbour discovery, echo requests for the
+ * router, forwarding for everything else.
+ *
+ * @param packet
+ */
+void handle_ip6(struct packet *packet) {
+    struct ip6hdr *ip6_hdr = get_ip6_header(packet->payload);
+
+    if (packet->len < sizeof(struct ether_header) + sizeof(struct ip6hdr) || (ntohl(ip6_hdr->vtc_flow) >> 28) != 6) {
+        stats.dropped++;
+        return;
+    }
+
+    if (ip6_hdr->next_header == ICMP6 &&
+        packet->len >= sizeof(struct ether_header) + sizeof(struct ip6hdr) + sizeof(struct icmp6hdr)) {
+        struct icmp6hdr *icmp6_hdr = get_icmp6_header(packet->payload);
+
+        if (icmp6_hdr->type == ICMP6_NEIGHBOR_SOLICIT || icmp6_hdr->type == ICMP6_NEIGHBOR_ADVERT) {
+            handle_nd(packet);
+            return;
+        }
+
+        if (icmp6_hdr->type == ICMP6_ECHO_REQUEST && is_own_ip6(&ip6_hdr->daddr)) {
+            send_icmp6_echo_reply(packet);
+            return;
+        }
+    }
+
+    // Other packets for the router are ignored.
+    if (is_own_ip6(&ip6_hdr->daddr)) {
+        return;
+    }
+
+    forward_ip6(packet);
+}
+
+/*
+ * Packet processing graph. Received packets are processed in bursts: every
+ * node handles the whole vector of packets waiting for it, then passes each
+ * packet to the vector of its next node. The nodes run in the order below,
+ * which is a topological order of the graph, so the code of one node stays
+ * hot in the instruction cache for the whole burst.
+ */
+enum graph_node {
+    NODE_ETHERNET_INPUT,
+    NODE_ARP_INPUT,
+    NODE_IP6_INPUT,
+    NODE_IP4_INPUT,
+    NODE_RIP_INPUT,
+    NODE_NAT44_IN,
+    NODE_ICMP_ECHO,
+    NODE_IP4_ACL,
+    NODE_IP4_LOOKUP,
+    NODE_NAT44_OUT,
+    NODE_IP4_REWRITE,
+    NODE_INTERFACE_OUTPUT,
+    NODE_COUNT,
+};
+
+/* Packets waiting for a node. A packet only ever waits for one node, so a
+ * vector never holds more than a burst. */
+struct vector {
+    int count;
+    struct packet *packets[VECTOR_SIZE];
+};
+
+struct node_stats {
+    uint64_t calls;
+    uint64_t packets;
+};
+
+static struct vector node_vectors[NODE_COUNT];
+static struct node_stats node_stats[NODE_COUNT];
+
+/* Receive buffers and descriptors of the current burst. */
+static char *rx_buffers[VECTOR_SIZE];
+static size_t rx_lengths[VECTOR_SIZE];
+static int rx_interfaces[VECTOR_SIZE];
+static uint64_t rx_stamps[VECTOR_SIZE];
+
+/* Receive to forward latency of the packets, measured with -L against the
+ * kernel receive timestamps. */
+static int measure_latency;
+static struct latency_hist rx_latency;
+
+/* Busy-poll mode (-B): the core the loop is pinned to, -1 if disabled. */
+static int busy_poll_cpu = -1;
+static struct packet rx_packets[VECTOR_SIZE];
+
+/**
+ * @brief Passes a packet to the next node.
+ *
+ * @param node
+ * @param packet
+ */
+static inline void enqueue_to_node(enum graph_node node, struct packet *packet) {
+    struct vector *vector = &node_vectors[node];
+
+    vector->packets[vector->count++] = packet;
+}
+
+/**
+ * @brief Prefetches the headers of the packet after index i of a vector.
+ *
+ * @param vector
+ * @param i
+ */
+static inline void prefetch_next(struct vector *vector, int i) {
+    if (i + 1 < vector->count) {
+        __builtin_prefetch(vector->packets[i + 1]->payload);
+        __builtin_prefetch(vector->packets[i + 1]->payload + sizeof(struct ether_header) + sizeof(struct iphdr));
+    }
+}
+
+/**
+ * @brief ethernet-input: dispatches the packets by the encapsulated protocol.
+ *
+ * @param vector
+ */
+void ethernet_input(struct vector *vector) {
+    for (int i = 0; i < vector->count; i++) {
+        struct packet *packet = vector->packets[i];
+        struct ether_header *eth_hdr = get_ether_header(packet->payload);
+
+        prefetch_next(vector, i);
+
+        /* Note that packets received are in network order,
+        any header field which has more than 1 byte will need to be converted to
+        host order. For example, ntohs(eth_hdr->ether_type). The opposite is needed when
+        sending a packet on the link, */
+        switch (ntohs(eth_hdr->ether_type)) {
+        case ETHERTYPE_IP:
+            enqueue_to_node(NODE_IP4_INPUT, packet);
+            break;
+        case ETHERTYPE_ARP:
+            enqueue_to_node(NODE_ARP_INPUT, packet);
+            break;
+        case ETHERTYPE_IPV6:
+            enqueue_to_node(NODE_IP6_INPUT, packet);
+            break;
+        default:
+            stats.dropped++;
+        }
+    }
+}
+
+/**
+ * @brief arp-input: answers the requests for the router's addresses and learns
+ * the replies, releasing the packets that waited for them.
+ *
+ * @param vector
+ */
+void arp_input(struct vector *vector) {
+    for (int i = 0; i < vector->count; i++) {
+        struct packet *packet = vector->packets[i];
+        struct ether_header *eth_hdr = get_ether_header(packet->payload);
+        struct arp_header *arp_hdr = get_arp_header(packet->payload);
+        int interface = packet->interface;
+
+        if (ntohs(arp_hdr->op) == ARP_OP_REQUEST) {
+            // Requests for other hosts are ignored.
+            if (arp_hdr->tpa != ifaces[interface].ip) {
+                continue;
+            }
+
+            memcpy(eth_hdr->ether_dhost, eth_hdr->ether_shost, sizeof(eth_hdr->ether_dhost));
+            memcpy(eth_hdr->ether_shost, ifaces[interface].mac, sizeof(eth_hdr->ether_shost));
+
+            send_arp(arp_hdr->spa, arp_hdr->tpa, eth_hdr, interface, htons(ARP_OP_REPLY));
+        }
+        else if (ntohs(arp_hdr->op) == ARP_OP_REPLY) {
+            // Update the ARP table.
+            update_arp_table(arp_hdr);
+
+            // A reply is also the answer to a liveness probe.
+            if (probe_interval_ms > 0) {
+                neighbour_alive(arp_hdr->spa, interface);
+            }
+
+            // Send the packets waiting for this next hop.
+            struct arp_pending *pending = get_arp_pending(arp_hdr->spa);
+            if (pending != NULL) {
+                flush_arp_pending(pending, arp_hdr->sha);
+            }
+        }
+    }
+}
+
+/**
+ * @brief ip6-input: the IPv6 plane, packet by packet.
+ *
+ * @param vector
+ */
+void ip6_input(struct vector *vector) {
+    for (int i = 0; i < vector->count; i++) {
+        handle_ip6(vector->packets[i]);
+    }
+}
+
+/**
+ * @brief Answers a packet with an ICMP error, sent back on its ingress
+ * interface, or drops it in the builds without ICMP errors.
+ *
+ * @param packet
+ * @param icmp_type
+ * @param icmp_code
+ * @param reason The reason recorded in the trace.
+ * @param route The route the packet matched, TRACE_NO_ROUTE if none.
+ * @return The ICMP header of the error, to complete it, NULL if dropped.
+ */
+static inline struct icmphdr *reject_packet(struct packet *packet, uint8_t icmp_type, uint8_t icmp_code,
+                                            uint8_t reason, int32_t route) {
+    if (!ICMP_ERRORS) {
+        trace_packet(packet, TRACE_DROPPED, reason, route, TRACE_NO_INTERFACE);
+        stats.dropped++;
+        return NULL;
+    }
+
+    trace_packet(packet, TRACE_ICMP, reason, route, packet->interface);
+    build_icmp_error(packet, icmp_type, icmp_code, packet->interface);
+    enqueue_to_node(NODE_INTERFACE_OUTPUT, packet);
+    return get_icmp_header(packet->payload);
+}
+
+/**
+ * @brief ip4-input: verifies the checksum and the TTL, and separates the echo
+ * requests for the router from the packets to forward.
+ *
+ * @param vector
+ */
+void ip4_input(struct vector *vector) {
+    for (int i = 0; i < vector->count; i++) {
+        struct packet *packet = vector->packets[i];
+        struct iphdr *ip_hdr = get_ip_header(packet->payload);
+        int interface = packet->interface;
+
+        prefetch_next(vector, i);
+
+        // The link filter checks the header too, but it may have failed to attach.
+        if (packet->len < sizeof(struct ether_header) + sizeof(struct iphdr) ||
+            ip_hdr->version != 4 || ip_hdr->ihl < 5) {
+            trace_packet(packet, TRACE_DROPPED, TRACE_MALFORMED, TRACE_NO_ROUTE, TRACE_NO_INTERFACE);
+            stats.dropped++;
+            continue;
+        }
+
+        // Verify checksum, the sum over a correct header is 0.
+        if (VERIFY_CHECKSUM && checksum((uint16_t *) ip_hdr, sizeof(struct iphdr)) != 0) {
+            trace_packet(packet, TRACE_DROPPED, TRACE_BAD_CHECKSUM, TRACE_NO_ROUTE, TRACE_NO_INTERFACE);
+            stats.dropped++;
+            continue;
+        }
+
+        // Routing updates from the neighbours.
+        if (rip != NULL && ip_hdr->daddr == htonl(RIP_MULTICAST)) {
+            enqueue_to_node(NODE_RIP_INPUT, packet);
+            continue;
+        }
+
+        // Packets for the outside address may be replies to translated flows.
+        if (nat != NULL && interface == nat->outside && ip_hdr->daddr == nat->ext_addr) {
+            enqueue_to_node(NODE_NAT44_IN, packet);
+            continue;
+        }
+
+        // Check if the destination is the router.
+        if (ip_hdr->daddr == ifaces[interface].ip) {
+            struct icmphdr *icmp_hdr = get_icmp_header(packet->payload);
+
+            // Only echo requests are answered, other packets for the router are ignored.
+            if (ip_hdr->protocol != ICMP || icmp_hdr->type != ICMP_ECHO_REQUEST) {
+                trace_packet(packet, TRACE_DROPPED, TRACE_NOT_HANDLED, TRACE_NO_ROUTE, TRACE_NO_INTERFACE);
+                continue;
+            }
+
+            if (ip_hdr->ttl <= 1) {
+                // TTL expired, send time exceeded.
+                reject_packet(packet, ICMP_TIME_EXCEEDED, 0, TRACE_TTL_EXCEEDED, TRACE_NO_ROUTE);
+            }
+            else {
+                enqueue_to_node(NODE_ICMP_ECHO, packet);
+            }
+            continue;
+        }
+
+        // Check the packet's TTL
+        if (ip_hdr->ttl <= 1) {
+            // TTL expired, send time exceeded.
+            reject_packet(packet, ICMP_TIME_EXCEEDED, 0, TRACE_TTL_EXCEEDED, TRACE_NO_ROUTE);
+            continue;
+        }
+
+        enqueue_to_node(acl != NULL ? NODE_IP4_ACL : NODE_IP4_LOOKUP, packet);
+    }
+}
+
+/**
+ * @brief Sends a routing message to the RIP group on an interface.
+ *
+ * @param interface
+ * @param payload The RIP message.
+ * @param len
+ */
+void send_rip(int interface, const uint8_t *payload, size_t len) {
+    char buf[sizeof(struct ether_header) + sizeof(struct iphdr) + sizeof(struct udp_header) + RIP_MAX_PAYLOAD];
+    struct ether_header *eth_hdr = get_ether_header(buf);
+    struct iphdr *ip_hdr = get_ip_header(buf);
+    struct udp_header *udp_hdr = (struct udp_header *) (ip_hdr + 1);
+    uint32_t group = htonl(RIP_MULTICAST);
+
+    // IPv4 multicast MAC, 01:00:5e and the low 23 bits of the group.
+    uint8_t group_mac[6] = { 0x01, 0x00, 0x5e, (ntohl(group) >> 16) & 0x7f, (ntohl(group) >> 8) & 0xff, ntohl(group) & 0xff };
+    memcpy(eth_hdr->ether_dhost, group_mac, sizeof(group_mac));
+    memcpy(eth_hdr->ether_shost, ifaces[interface].mac, sizeof(eth_hdr->ether_shost));
+    eth_hdr->ether_type = htons(ETHERTYPE_IP);
+
+    memset(ip_hdr, 0, sizeof(struct iphdr));
+    ip_hdr->version = 4;
+    ip_hdr->ihl = sizeof(struct iphdr) / 4;
+    ip_hdr->tos = RIP_TOS;
+    ip_hdr->tot_len = htons(sizeof(struct iphdr) + sizeof(struct udp_header) + len);
+    ip_hdr->ttl = 1;
+    ip_hdr->protocol = UDP;
+    ip_hdr->saddr = ifaces[interface].ip;
+    ip_hdr->daddr = group;
+    ip_hdr->check = htons(checksum((uint16_t *) ip_hdr, sizeof(struct iphdr)));
+
+    // The UDP checksum is optional over IPv4.
+    udp_hdr->source = htons(RIP_PORT);
+    udp_hdr->dest = htons(RIP_PORT);
+    udp_hdr->len = htons(sizeof(struct udp_header) + len);
+    udp_hdr->check = 0;
+    memcpy(udp_hdr + 1, payload, len);
+
+    output_frame(interface, buf, sizeof(struct ether_header) + ntohs(ip_hdr->tot_len));
+}
+
+/**
+ * @brief Pushes the routes changed in the RIB into the forwarding table, one
+ * prefix at a time, and schedules a triggered update to announce them.
+ */
+void rip_sync(void) {
+    for (uint32_t i = 0; i < rip->dirty_count; i++) {
+        uint32_t index = rip->dirty[i];
+        struct rip_route *route = &rip->routes[index];
+        int len = __builtin_popcount(route->mask);
+
+        route->dirty = 0;
+
+        // Connected networks are forwarded by the static table.
+        if (route->connected) {
+            continue;
+        }
+
+        if (route->metric < RIP_INFINITY) {
+            learned_routes[index].nh.ip = route->next_hop;
+            learned_routes[index].nh.interface = route->interface;
+            learned_routes[index].nh.neighbour = NULL;
+            learned_routes[index].len = len;
+            fib4_set(rip_fib, ntohl(route->prefix), len, index);
+        }
+        else {
+            fib4_delete(rip_fib, ntohl(route->prefix), len);
+        }
+        stats.fib_updates++;
+    }
+    rip->dirty_count = 0;
+
+    if (rip->changed && !timer_pending(&rip_trigger_timer)) {
+        timer_add(&timers, &rip_trigger_timer, RIP_TRIGGER_MS);
+    }
+}
+
+/**
+ * @brief rip-input: feeds the routing updates to the RIB, and answers the
+ * requests with the whole table.
+ *
+ * @param vector
+ */
+void rip_receive(struct vector *vector) {
+    uint64_t now = timer_now_ms();
+
+    for (int i = 0; i < vector->count; i++) {
+        struct packet *packet = vector->packets[i];
+        struct iphdr *ip_hdr = get_ip_header(packet->payload);
+        struct udp_header *udp_hdr = (struct udp_header *) ((char *) ip_hdr + ip_hdr->ihl * 4);
+        size_t ip_len = packet->len - sizeof(struct ether_header);
+
+        if (ip_hdr->protocol != UDP || ip_len < ip_hdr->ihl * 4 + sizeof(struct udp_header) ||
+            udp_hdr->dest != htons(RIP_PORT) || udp_hdr->source != htons(RIP_PORT) ||
+            ip_hdr->saddr == ifaces[packet->interface].ip) {
+            stats.dropped++;
+            continue;
+        }
+
+        size_t len = ntohs(udp_hdr->len) - sizeof(struct udp_header);
+        if (ntohs(udp_hdr->len) < sizeof(struct udp_header) || ip_len < ip_hdr->ihl * 4 + ntohs(udp_hdr->len)) {
+            stats.dropped++;
+            continue;
+        }
+
+        if (rip_input(rip, ip_hdr->saddr, packet->interface, (uint8_t *) (udp_hdr + 1), len, now) == RIP_REQUEST) {
+            rip_advertise(rip, packet->interface, 0, send_rip);
+        }
+    }
+
+    rip_sync();
+}
+
+/**
+ * @brief nat44-in: translates the packets received on the outside address back
+ * to the inside hosts. Packets of no session are for the router itself.
+ *
+ * @param vector
+ */
+void nat44_in(struct vector *vector) {
+    for (int i = 0; i < vector->count; i++) {
+        struct packet *packet = vector->packets[i];
+        struct iphdr *ip_hdr = get_ip_header(packet->payload);
+        size_t ip_len = packet->len - sizeof(struct ether_header);
+
+        prefetch_next(vector, i);
+
+        // Before the translation, so the error quotes the header the outside
+        // host sent and not the inside address and port of the session.
+        if (ip_hdr->ttl <= 1) {
+            reject_packet(packet, ICMP_TIME_EXCEEDED, 0, TRACE_TTL_EXCEEDED, TRACE_NO_ROUTE);
+            continue;
+        }
+
+        if (nat_in(nat, ip_hdr, ip_len) < 0) {
+            struct icmphdr *icmp_hdr = get_icmp_header(packet->payload);
+
+            // Not translated, only echo requests for the router are answered.
+            if (ip_hdr->protocol != ICMP || icmp_hdr->type != ICMP_ECHO_REQUEST) {
+                trace_packet(packet, TRACE_DROPPED, TRACE_NAT_NO_SESSION, TRACE_NO_ROUTE, TRACE_NO_INTERFACE);
+                stats.dropped++;
+                continue;
+            }
+
+            enqueue_to_node(NODE_ICMP_ECHO, packet);
+            continue;
+        }
+
+        enqueue_to_node(acl != NULL ? NODE_IP4_ACL : NODE_IP4_LOOKUP, packet);
+    }
+}
+
+/**
+ * @brief icmp-echo: turns echo requests into echo replies.
+ *
+ * @param vector
+ */
+void icmp_echo(struct vector *vector) {
+    for (int i = 0; i < vector->count; i++) {
+        struct packet *packet = vector->packets[i];
+
+        trace_packet(packet, TRACE_ICMP, TRACE_ECHO_REPLY, TRACE_NO_ROUTE, packet->interface);
+        build_icmp_reply(packet, ICMP_ECHO_REPLY, 0, packet->interface);
+        enqueue_to_node(NODE_INTERFACE_OUTPUT, packet);
+    }
+}
+
+/**
+ * @brief ip4-acl: drops the packets denied by the ACL.
+ *
+ * @param vector
+ */
+void ip4_acl(struct vector *vector) {
+    for (int i = 0; i < vector->count; i++) {
+        struct packet *packet = vector->packets[i];
+        struct iphdr *ip_hdr = get_ip_header(packet->payload);
+
+        prefetch_next(vector, i);
+
+        uint32_t ports = ntohl(get_l4_ports(ip_hdr));
+        int rule = acl_classify(acl, ip_hdr->saddr, ip_hdr->daddr, ip_hdr->protocol, ports >> 16, ports & 0xffff);
+
+        if (rule >= 0 && acl->rules[rule].action == ACL_DENY) {
+            trace_packet(packet, TRACE_DROPPED, TRACE_ACL_DENY, TRACE_NO_ROUTE, TRACE_NO_INTERFACE);
+            stats.acl_denied++;
+            stats.dropped++;
+            continue;
+        }
+
+        enqueue_to_node(NODE_IP4_LOOKUP, packet);
+    }
+}
+
+/**
+ * @brief Accounts a sampled packet to its flow.
+ *
+ * @param packet
+ * @param ip_hdr
+ */
+void sample_flow(struct packet *packet, struct iphdr *ip_hdr) {
+    struct flow_key key;
+    uint32_t ports = get_l4_ports(ip_hdr);
+
+    memset(&key, 0, sizeof(key));
+    key.saddr = ip_hdr->saddr;
+    key.daddr = ip_hdr->daddr;
+    memcpy(&key.sport, &ports, sizeof(ports));
+    key.proto = ip_hdr->protocol;
+    key.ingress = packet->interface;
+
+    flow_account(flows, &key, ntohs(ip_hdr->tot_len), timer_now_ms());
+}
+
+/**
+ * @brief Counts a sampled packet on the prefix of the route it matched, as
+ * length << 32 | prefix in host order.
+ *
+ * @param ip_hdr
+ * @param best_route The static route found, NULL if none.
+ * @param learned The learned route used, -1 if none.
+ */
+void count_heavy_hitter(struct iphdr *ip_hdr, struct route_table_entry *best_route, int32_t learned) {
+    uint64_t len;
+    uint32_t prefix;
+
+    if (learned >= 0) {
+        len = learned_routes[learned].len;
+        prefix = len > 0 ? ntohl(ip_hdr->daddr) & (0xffffffff << (32 - len)) : 0;
+    }
+    else {
+        len = __builtin_popcount(best_route->mask);
+        prefix = ntohl(best_route->prefix);
+    }
+
+    topk_add(heavy_hitters, len << 32 | prefix, ntohs(ip_hdr->tot_len));
+}
+
+/**
+ * @brief Looks up the learned routes, keeping the static route on ties.
+ *
+ * @param daddr
+ * @param best_route The static route found, NULL if none.
+ * @return The learned route to use, -1 if none.
+ */
+int32_t get_learned_route(uint32_t daddr, struct route_table_entry *best_route) {
+    int32_t learned = fib4_lookup(rip_fib, ntohl(daddr));
+
+    if (learned < 0 || best_route == NULL) {
+        return learned;
+    }
+    return learned_routes[learned].len > __builtin_popcount(best_route->mask) ? learned : -1;
+}
+
+/**
+ * @brief ip4-lookup: finds the route and picks the next hop of every packet.
+ *
+ * @param vector
+ */
+void ip4_lookup(struct vector *vector) {
+    for (int i = 0; i < vector->count; i++) {
+        struct packet *packet = vector->packets[i];
+        struct iphdr *ip_hdr = get_ip_header(packet->payload);
+
+        prefetch_next(vector, i);
+
+        // Find the best route, in the table of the ingress interface's VRF.
+        int vrf = interface_vrf[packet->interface];
+        struct route_table_entry *best_route;
+        if (vrf_fib != NULL) {
+            int32_t route = vrf_fib_lookup(vrf_fib, vrf, ntohl(ip_hdr->daddr));
+            best_route = route >= 0 ? &rtable[route] : NULL;
+        }
+        else {
+            best_route = get_best_route(ip_hdr->daddr, 0, rtable_size - 1);
+        }
+
+        // A learned route is used if it is more specific than the static one,
+        // the routing protocol only runs in the main table.
+        int32_t learned = rip != NULL && vrf == 0 ? get_learned_route(ip_hdr->daddr, best_route) : -1;
+
+        // Check if a route was found.
+        if (best_route == NULL && learned < 0) {
+            // Send destination unreachable ICMP
+            reject_packet(packet, ICMP_DESTINATION_UNREACHABLE, 0, TRACE_NO_ROUTE_FOUND, TRACE_NO_ROUTE);
+            continue;
+        }
+
+        // Pick one of the route's equal-cost paths.
+        packet->nh = learned >= 0 ? &learned_routes[learned].nh : select_nexthop(&nh_groups[best_route - rtable], ip_hdr);
+        packet->route = learned >= 0 ? learned : best_route - rtable;
+        packet->learned = learned >= 0;
+        __builtin_prefetch(packet->nh);
+
+        if (flows != NULL && flow_sample(flows)) {
+            sample_flow(packet, ip_hdr);
+        }
+
+        if (heavy_hitters != NULL && topk_sample(heavy_hitters)) {
+            count_heavy_hitter(ip_hdr, best_route, learned);
+        }
+
+        // Packets too big for the output link are not fragmented. Those with
+        // DF set tell the source the MTU to use (RFC 1191).
+        int mtu = ifaces[packet->nh->interface].mtu;
+        if (ntohs(ip_hdr->tot_len) > mtu) {
+            stats.mtu_exceeded++;
+            if (ip_hdr->frag_off & htons(IP_DF)) {
+                struct icmphdr *icmp_hdr = reject_packet(packet, ICMP_DESTINATION_UNREACHABLE, ICMP_FRAG_NEEDED,
+                                                         TRACE_FRAG_NEEDED, packet->route);
+                if (icmp_hdr != NULL) {
+                    icmp_hdr->un.frag.mtu = htons(mtu);
+                    icmp_hdr->checksum = checksum_update(icmp_hdr->checksum, 0, icmp_hdr->un.frag.mtu);
+                }
+            }
+            else {
+                trace_packet(packet, TRACE_DROPPED, TRACE_MTU, packet->route, packet->nh->interface);
+                stats.dropped++;
+            }
+            continue;
+        }
 
-        interface = recv_from_any_link(buf, &len);
-        DIE(interface < 0, "recv_from_any_links");
+        // Packets from the inside leaving through the outside interface are translated.
+        if (nat != NULL && packet->nh->interface == nat->outside && packet->interface != nat->outside) {
+            enqueue_to_node(NODE_NAT44_OUT, packet);
+            continue;
+        }
 
-        /* Note that packets received are in network order,
-        any header field which has more than 1 byte will need to be converted to
-        host order. For example, ntohs(eth_hdr->ether_type). The opposite is needed when
-        sending a packet on the link, */
+        enqueue_to_node(NODE_IP4_REWRITE, packet);
+    }
+}
+
+/**
+ * @brief nat44-out: translates the source of the packets leaving through the
+ * outside interface, dropping those no session can be created for.
+ *
+ * @param vector
+ */
+void nat44_out(struct vector *vector) {
+    for (int i = 0; i < vector->count; i++) {
+        struct packet *packet = vector->packets[i];
+        struct iphdr *ip_hdr = get_ip_header(packet->payload);
+
+        prefetch_next(vector, i);
+
+        if (nat_out(nat, ip_hdr, packet->len - sizeof(struct ether_header)) < 0) {
+            trace_packet(packet, TRACE_DROPPED, TRACE_NAT_NO_SESSION, packet->route, packet->nh->interface);
+            stats.nat_dropped++;
+            stats.dropped++;
+            continue;
+        }
 
-        struct ether_header *eth_hdr = (struct ether_header *) buf;
-        struct iphdr *ip_hdr = (struct iphdr *)(buf + sizeof(struct ether_header));
-        struct icmphdr *icmp_hdr = get_icmp_header(eth_hdr);
-        struct arp_header *arp_hdr = get_arp_header(eth_hdr);
+        enqueue_to_node(NODE_IP4_REWRITE, packet);
+    }
+}
 
-        // Check the encapsulated protocol
-        uint16_t eth_type = eth_hdr->ether_type;
+/**
+ * @brief ip4-rewrite: decrements the TTL and fills in the ETHERNET addresses of
+ * the next hop, or queues the packet until the next hop is resolved.
+ *
+ * @param vector
+ */
+void ip4_rewrite(struct vector *vector) {
+    for (int i = 0; i < vector->count; i++) {
+        struct packet *packet = vector->packets[i];
+        struct ether_header *eth_hdr = get_ether_header(packet->payload);
+        struct iphdr *ip_hdr = get_ip_header(packet->payload);
+        struct nexthop *nh = packet->nh;
+
+        prefetch_next(vector, i);
+
+        // Decrement TTL, update the checksum incrementally.
+        uint16_t old_word = htons(ip_hdr->ttl << 8 | ip_hdr->protocol);
+        ip_hdr->ttl--;
+        ip_hdr->check = checksum_update(ip_hdr->check, old_word, htons(ip_hdr->ttl << 8 | ip_hdr->protocol));
+
+        const struct arp_entry *arp_table_entry = get_arp_entry(nh->ip);
+
+        // If no ARP entry was found, wait for the next hop to be resolved.
+        if (arp_table_entry == NULL && ARP_RESOLUTION) {
+            queue_for_arp(packet, nh);
+            continue;
+        }
+        if (arp_table_entry == NULL) {
+            trace_packet(packet, TRACE_DROPPED, TRACE_NO_NEIGHBOUR, packet->route, nh->interface);
+            stats.dropped++;
+            continue;
+        }
 
-        if (ntohs(eth_type) == ETHERTYPE_IP) {
-            // Handle IP packet
+        memcpy(eth_hdr->ether_dhost, arp_table_entry->mac, sizeof(eth_hdr->ether_dhost));
+        memcpy(eth_hdr->ether_shost, ifaces[nh->interface].mac, sizeof(eth_hdr->ether_shost));
 
-            // Verify checksum.
-            uint16_t old_check = ip_hdr->check;
-            ip_hdr->check = 0;
-            uint16_t new_check = ntohs(checksum((uint16_t *) ip_hdr, sizeof(struct iphdr)));
+        packet->out_interface = nh->interface;
+        trace_packet(packet, TRACE_FORWARDED, packet->learned ? TRACE_LEARNED_ROUTE : TRACE_STATIC_ROUTE,
+                     packet->route, nh->interface);
+        stats.forwarded++;
+        enqueue_to_node(NODE_INTERFACE_OUTPUT, packet);
+    }
+}
 
-            // Drop the packet if the checksum is incorrect.
-            if (old_check != new_check) {
-                continue;
-            }
+/**
+ * @brief interface-output: sends the packets on their output interfaces.
+ *
+ * @param vector
+ */
+void interface_output(struct vector *vector) {
+    for (int i = 0; i < vector->count; i++) {
+        struct packet *packet = vector->packets[i];
 
-            // Checksum is correct, continue with the execution.
-            ip_hdr->check = old_check;
-
-            // Check if the destination is the router.
-            char *router_ip_address = get_interface_ip(interface);
-            if (ip_hdr->daddr == convert_string_ip(router_ip_address)) {
-
-                if (ip_hdr->protocol == ICMP) {
-                    // Check the ICMP type. Looking for echo request (type 8).
-                    if (icmp_hdr->type == ICMP_ECHO_REQUEST) {
-                        // Check the packet's TTL
-                        if (ip_hdr->ttl <= 1) {
-                            // TTL expired, send time exceeded.
-                            struct packet *new_packet = create_packet(buf, len, interface);
-                            send_icmp_error(new_packet, ICMP_TIME_EXCEEDED, 0, interface);
-                        }
-                        else {
-                            // Send echo reply.
-                            struct packet *new_packet = create_packet(buf, len, interface);
-                            send_icmp(new_packet, ICMP_ECHO_REPLY, 0, interface);
-                        }
-
-                    }
-                    else {
-                        // ICMP packet is for the router, but it is not an ICMP request,
-                        // do not respond to it.
-                        continue;
-                    }
-                }
-                else {
-                    // Forward the packet
-                    struct packet *new_packet = create_packet(buf, len, interface);
-                    forward_packet(new_packet);
-                }
+        output_frame(packet->out_interface, packet->payload, packet->len);
+    }
+}
+
+/**
+ * @brief interface-output of the benchmark: the packets are counted by the
+ * graph and go no further.
+ *
+ * @param vector
+ */
+void discard_output(struct vector *vector) {
+}
+
+typedef void (*node_function)(struct vector *vector);
+
+/* Not const, the benchmark (-b) replaces the output node. */
+static struct {
+    const char *name;
+    node_function function;
+} graph_nodes[NODE_COUNT] = {
+    [NODE_ETHERNET_INPUT] = { "ethernet-input", ethernet_input },
+    [NODE_ARP_INPUT] = { "arp-input", arp_input },
+    [NODE_IP6_INPUT] = { "ip6-input", ip6_input },
+    [NODE_IP4_INPUT] = { "ip4-input", ip4_input },
+    [NODE_RIP_INPUT] = { "rip-input", rip_receive },
+    [NODE_NAT44_IN] = { "nat44-in", nat44_in },
+    [NODE_ICMP_ECHO] = { "icmp-echo", icmp_echo },
+    [NODE_IP4_ACL] = { "ip4-acl", ip4_acl },
+    [NODE_IP4_LOOKUP] = { "ip4-lookup", ip4_lookup },
+    [NODE_NAT44_OUT] = { "nat44-out", nat44_out },
+    [NODE_IP4_REWRITE] = { "ip4-rewrite", ip4_rewrite },
+    [NODE_INTERFACE_OUTPUT] = { "interface-output", interface_output },
+};
+
+/**
+ * @brief Runs the received burst through the graph.
+ *
+ * @param count The number of packets received.
+ */
+void graph_run(int count) {
+    for (int i = 0; i < count; i++) {
+        struct packet *packet = &rx_packets[i];
+
+        packet->payload = rx_buffers[i];
+        packet->len = rx_lengths[i];
+        packet->interface = rx_interfaces[i];
+        enqueue_to_node(NODE_ETHERNET_INPUT, packet);
+    }
+
+    for (int node = 0; node < NODE_COUNT; node++) {
+        struct vector *vector = &node_vectors[node];
+
+        if (vector->count == 0) {
+            continue;
+        }
+
+        graph_nodes[node].function(vector);
+        node_stats[node].calls++;
+        node_stats[node].packets += vector->count;
+        vector->count = 0;
+    }
+}
+
+/**
+ * @brief Prints the top destination prefixes since the last flush, with the
+ * packets and bytes estimated from the samples, then starts over.
+ */
+void dump_heavy_hitters(void) {
+    uint32_t sampling = heavy_hitters->sampling;
+    uint32_t count = topk_sorted(heavy_hitters, heavy_hitters_report);
+
+    fprintf(stderr, "heavy hitters: sampled 1 in %u, packets %lu bytes %lu\n", sampling,
+            heavy_hitters->packets * sampling, heavy_hitters->bytes * sampling);
+
+    for (uint32_t i = 0; i < count && i < heavy_hitters_shown; i++) {
+        struct topk_entry *entry = &heavy_hitters_report[i];
+        struct in_addr prefix = { htonl((uint32_t) entry->key) };
+        char name[INET_ADDRSTRLEN + 4];
+
+        snprintf(name, sizeof(name), "%s/%u", inet_ntoa(prefix), (uint32_t) (entry->key >> 32));
+        fprintf(stderr, "  %-18s packets %lu (%.1f%%) bytes %lu error %lu\n",
+                name, entry->packets * sampling,
+                100.0 * entry->packets / heavy_hitters->packets, entry->bytes * sampling,
+                entry->error * sampling);
+    }
+
+    topk_reset(heavy_hitters);
+}
+
+/**
+ * @brief Stats timer callback, prints the counters and re-arms itself.
+ *
+ * @param arg Unused.
+ */
+void flush_stats(void *arg) {
+    fprintf(stderr, "stats: received %lu forwarded %lu dropped %lu icmp %lu arp requests %lu "
+            "neighbour solicitations %lu resolution timeouts %lu acl denied %lu egress dropped %lu "
+            "mtu exceeded %lu\n",
+            stats.received, stats.forwarded, stats.dropped, stats.icmp_sent,
+            stats.arp_requests, stats.nd_solicits, stats.arp_timeouts, stats.acl_denied,
+            stats.egress_dropped, stats.mtu_exceeded);
+
+    for (int node = 0; node < NODE_COUNT; node++) {
+        if (node_stats[node].calls > 0) {
+            fprintf(stderr, "  %-16s calls %lu packets %lu (%.1f per call)\n", graph_nodes[node].name,
+                    node_stats[node].calls, node_stats[node].packets,
+                    (double) node_stats[node].packets / node_stats[node].calls);
+        }
+    }
+
+    if (acl != NULL) {
+        acl_dump(acl, stderr);
+    }
+
+    egress_dump(egress, stderr);
+
+    if (rip != NULL) {
+        fprintf(stderr, "rip: responses %lu triggered updates %lu fib updates %lu learned prefixes %u\n",
+                rip->responses, rip->triggered, stats.fib_updates, rip_fib->count);
+    }
+
+    if (probe_interval_ms > 0) {
+        int down = 0;
+
+        for (int i = 0; i < neighbours_size; i++) {
+            down += !neighbours[i].up;
+        }
+        fprintf(stderr, "gateways: probed %d down %d failures %lu recoveries %lu\n",
+                neighbours_size, down, stats.nh_failures, stats.nh_recoveries);
+    }
+
+    if (heavy_hitters != NULL) {
+        dump_heavy_hitters();
+    }
+
+    if (flows != NULL) {
+        fprintf(stderr, "flows: active %u sampled %lu exported %lu dropped %lu\n",
+                flows->active, flows->sampled, flows->exported, flows->dropped);
+    }
+
+    if (measure_latency) {
+        latency_dump(&rx_latency, busy_poll_cpu >= 0 ? "busy-poll" : "blocking", stderr);
+        latency_reset(&rx_latency);
+        if (busy_poll_cpu >= 0) {
+            fprintf(stderr, "  idle sleeps %lu\n", stats.poll_sleeps);
+        }
+    }
+
+    if (nat != NULL) {
+        fprintf(stderr, "nat: sessions %u created %lu expired %lu port exhaustion %lu dropped %lu\n",
+                nat->active, nat->created, nat->expired, nat->failed, stats.nat_dropped);
+    }
+
+    timer_add(&timers, &stats_timer, STATS_INTERVAL_MS);
+}
+
+/**
+ * @brief NAT timer callback, advances the session clock and reclaims a batch
+ * of idle sessions.
+ *
+ * @param arg Unused.
+ */
+void nat_tick(void *arg) {
+    nat_sweep(nat, timer_now_ms() / 1000, NAT_SWEEP_BATCH);
+    timer_add(&timers, &nat_timer, NAT_SWEEP_MS);
+}
+
+/**
+ * @brief Flow timer callback, exports a batch of expired flows.
+ *
+ * @param arg Unused.
+ */
+void flow_tick(void *arg) {
+    flow_expire(flows, timer_now_ms(), FLOW_SWEEP_BATCH);
+    timer_add(&timers, &flow_timer, FLOW_SWEEP_MS);
+}
+
+/**
+ * @brief Advertises routes on every interface.
+ *
+ * @param only_changed Only the routes changed since the last update.
+ */
+void rip_announce(int only_changed) {
+    for (int i = 0; i < ROUTER_NUM_INTERFACES; i++) {
+        rip_advertise(rip, i, only_changed, send_rip);
+    }
+    rip_clear_changed(rip);
+}
+
+/**
+ * @brief Periodic update timer callback, advertises the whole table.
+ *
+ * @param arg Unused.
+ */
+void rip_update(void *arg) {
+    rip_announce(0);
+    timer_add(&timers, &rip_update_timer, RIP_UPDATE_MS);
+}
+
+/**
+ * @brief Triggered update timer callback, advertises the changed routes.
+ *
+ * @param arg Unused.
+ */
+void rip_trigger(void *arg) {
+    if (rip->changed) {
+        rip->triggered++;
+        rip_announce(1);
+    }
+}
+
+/**
+ * @brief Expiry timer callback, times out the routes of silent neighbours.
+ *
+ * @param arg Unused.
+ */
+void rip_expire_tick(void *arg) {
+    rip_expire(rip, timer_now_ms());
+    rip_sync();
+    timer_add(&timers, &rip_expire_timer, RIP_EXPIRE_MS);
+}
+
+/**
+ * @brief Probe timer callback, fails the gateways that stopped answering and
+ * probes all of them again.
+ *
+ * @param arg Unused.
+ */
+void probe_tick(void *arg) {
+    for (int i = 0; i < neighbours_size; i++) {
+        struct neighbour *neighbour = &neighbours[i];
+
+        if (neighbour->up && neighbour->missed >= PROBE_DETECT_MULT) {
+            neighbour_down(neighbour);
+        }
+        if (neighbour->missed < PROBE_DETECT_MULT) {
+            neighbour->missed++;
+        }
+        send_probe(neighbour);
+    }
+    timer_add(&timers, &probe_timer, probe_interval_ms);
+}
+
+/**
+ * @brief Sets up the timer wheel, the ARP resolution slots and the periodic timers.
+ */
+void init_timers(void) {
+    timer_wheel_init(&timers);
+
+    for (int i = 0; i < ARP_PENDING_MAXSIZE; i++) {
+        arp_pending[i].packets = queue_create();
+        timer_init(&arp_pending[i].retransmit, arp_retransmit, &arp_pending[i]);
+    }
+
+    timer_init(&stats_timer, flush_stats, NULL);
+    timer_add(&timers, &stats_timer, STATS_INTERVAL_MS);
+
+    if (nat != NULL) {
+        timer_init(&nat_timer, nat_tick, NULL);
+        nat_tick(NULL);
+    }
+
+    if (rip != NULL) {
+        timer_init(&rip_update_timer, rip_update, NULL);
+        timer_init(&rip_trigger_timer, rip_trigger, NULL);
+        timer_init(&rip_expire_timer, rip_expire_tick, NULL);
+        timer_add(&timers, &rip_update_timer, RIP_UPDATE_MS);
+        timer_add(&timers, &rip_expire_timer, RIP_EXPIRE_MS);
+    }
+
+    if (flows != NULL) {
+        timer_init(&flow_timer, flow_tick, NULL);
+        timer_add(&timers, &flow_timer, FLOW_SWEEP_MS);
+    }
+
+    if (probe_interval_ms > 0) {
+        timer_init(&probe_timer, probe_tick, NULL);
+        timer_add(&timers, &probe_timer, probe_interval_ms);
+    }
+}
+
+/**
+ * @brief Loads the static neighbours of a file in the parse_arp_table()
+ * format into the perfect hash, every entry in its slot.
+ *
+ * @param path
+ */
+void load_static_neighbours(char *path) {
+    struct arp_entry *entries = malloc(sizeof(struct arp_entry) * STATIC_NEIGHBOURS_MAXSIZE);
+    uint32_t *keys = malloc(sizeof(uint32_t) * STATIC_NEIGHBOURS_MAXSIZE);
+    DIE(entries == NULL || keys == NULL, "malloc");
+
+    int count = parse_arp_table(path, entries);
+    for (int i = 0; i < count; i++) {
+        keys[i] = entries[i].ip;
+    }
+
+    if (count > 0) {
+        DIE(mph_build(&static_neighbours, keys, count) < 0, "duplicate static neighbours");
+
+        struct arp_entry *table = huge_alloc(sizeof(struct arp_entry) * count, "static neighbours");
+        for (int i = 0; i < count; i++) {
+            table[mph_lookup(&static_neighbours, entries[i].ip)] = entries[i];
+        }
+        static_neighbour_table = table;
+    }
+
+    free(entries);
+    free(keys);
+}
+
+/**
+ * @brief Runs a received burst through the graph and the egress queues, and
+ * records the latency of its packets.
+ *
+ * @param count The number of packets received.
+ */
+void process_burst(int count) {
+    if (count > 0) {
+        stats.received += count;
+        if (trace != NULL) {
+            trace_stamp(trace);
+        }
+        graph_run(count);
+    }
+
+    // Drain the queued frames into the links that have room again.
+    egress_run(egress);
+
+    if (measure_latency && count > 0) {
+        uint64_t now = latency_now_ns();
+
+        for (int i = 0; i < count; i++) {
+            if (rx_stamps[i] != 0 && rx_stamps[i] <= now) {
+                latency_record(&rx_latency, now - rx_stamps[i]);
             }
-            else {
-                // Forward the packet
-                struct packet *new_packet = create_packet(buf, len, interface);
-                forward_packet(new_packet);
+        }
+    }
+}
+
+/**
+ * @brief Waits for bursts in select(), the default mode.
+ */
+void run_blocking(void) {
+    while (1) {
+        // Wait for packets, waking up in time for the next timer tick or when
+        // a link with queued frames can take more.
+        int count = recv_burst_from_links(rx_buffers, rx_frame_size, rx_lengths, rx_interfaces,
+                                          measure_latency ? rx_stamps : NULL, VECTOR_SIZE,
+                                          timer_wheel_timeout(&timers), egress_backlog_mask(egress));
+
+        // Run the expired timers, bounded so forwarding is never delayed for long.
+        timer_wheel_run(&timers, TIMER_RUN_BUDGET);
+
+        process_burst(count);
+    }
+}
+
+/**
+ * @brief Spins on non-blocking receives, so no packet waits for a wakeup.
+ * After a spin window without traffic the loop sleeps in select() until the
+ * next packet or timer. The window adapts: it doubles when packets show up
+ * while spinning and halves every time the loop goes to sleep, so bursty
+ * traffic keeps the loop spinning while an idle router does not burn a core.
+ */
+void run_busy_poll(void) {
+    uint64_t spin_ns = BUSY_POLL_MIN_SPIN_US * 1000;
+    uint64_t idle_since = 0;
+
+    while (1) {
+        int count = poll_burst_from_links(rx_buffers, rx_frame_size, rx_lengths, rx_interfaces,
+                                          measure_latency ? rx_stamps : NULL, VECTOR_SIZE);
+
+        timer_wheel_run(&timers, TIMER_RUN_BUDGET);
+
+        if (count > 0) {
+            if (idle_since != 0 && spin_ns < BUSY_POLL_MAX_SPIN_US * 1000) {
+                spin_ns *= 2;
             }
+            idle_since = 0;
+            process_burst(count);
+            continue;
+        }
+
+        egress_run(egress);
 
+        uint64_t now = latency_now_ns();
+        if (idle_since == 0) {
+            idle_since = now;
+            continue;
+        }
+        if (now - idle_since < spin_ns) {
+            continue;
         }
-        else if (ntohs(eth_type) == ETHERTYPE_ARP) {
-            // Received ARP packet, check the opcode.
 
-            if (ntohs(arp_hdr->op) == ARP_OP_REQUEST) {
-                // Received ARP request.
+        // Idle for the whole window, sleep until there is something to do.
+        if (spin_ns > BUSY_POLL_MIN_SPIN_US * 1000) {
+            spin_ns /= 2;
+        }
+        stats.poll_sleeps++;
+        idle_since = 0;
+
+        count = recv_burst_from_links(rx_buffers, rx_frame_size, rx_lengths, rx_interfaces,
+                                      measure_latency ? rx_stamps : NULL, VECTOR_SIZE,
+                                      timer_wheel_timeout(&timers), egress_backlog_mask(egress));
+        timer_wheel_run(&timers, TIMER_RUN_BUDGET);
+        process_burst(count);
+    }
+}
 
-                char *target_ip_char = get_interface_ip(interface);
-                uint32_t target_ip = convert_string_ip(target_ip_char);
+/**
+ * @brief Benchmark of the forwarding path of this build (-b): runs bursts of
+ * packets to destinations spread over the routing table through the graph,
+ * entering on interface 0, with the output discarded. The next hops should
+ * be static neighbours, so nothing waits for ARP.
+ *
+ * @param packets The number of packets to forward.
+ */
+void run_benchmark(uint64_t packets) {
+    static char templates[VECTOR_SIZE][BENCH_FRAME_LEN];
+    uint32_t rng = 12345;
+
+    DIE(rtable_size == 0, "-b needs routes");
+    for (int i = 0; i < VECTOR_SIZE; i++) {
+        struct ether_header *eth_hdr = get_ether_header(templates[i]);
+        struct iphdr *ip_hdr = get_ip_header(templates[i]);
+
+        // A route through one of the interfaces, not all of rtable0.txt's are.
+        struct route_table_entry *route;
+        do {
+            rng ^= rng << 13;
+            rng ^= rng >> 17;
+            rng ^= rng << 5;
+            route = &rtable[rng % rtable_size];
+        } while (route->interface >= ROUTER_NUM_INTERFACES);
+
+        memcpy(eth_hdr->ether_dhost, ifaces[0].mac, sizeof(eth_hdr->ether_dhost));
+        memset(eth_hdr->ether_shost, 0x02, sizeof(eth_hdr->ether_shost));
+        eth_hdr->ether_type = htons(ETHERTYPE_IP);
+
+        ip_hdr->version = 4;
+        ip_hdr->ihl = sizeof(struct iphdr) / 4;
+        ip_hdr->tot_len = htons(BENCH_FRAME_LEN - sizeof(struct ether_header));
+        ip_hdr->ttl = MAX_TTL;
+        ip_hdr->protocol = UDP;
+        ip_hdr->saddr = htonl(0x0a000001);
+        ip_hdr->daddr = route->prefix | (htonl(rng | 1) & ~route->mask);
+        ip_hdr->check = htons(checksum((uint16_t *) ip_hdr, sizeof(struct iphdr)));
+    }
 
-                if (target_ip == arp_hdr->tpa) {
-                    uint8_t *mac = malloc(sizeof(eth_hdr->ether_shost));
-                    get_interface_mac(interface, mac);
+    graph_nodes[NODE_INTERFACE_OUTPUT].function = discard_output;
 
-                    memcpy(eth_hdr->ether_dhost, eth_hdr->ether_shost, sizeof(eth_hdr->ether_dhost));
-                    memcpy(eth_hdr->ether_shost, mac, sizeof(eth_hdr->ether_shost));
+    uint64_t elapsed = 0;
+    for (uint64_t done = 0; done < packets; done += VECTOR_SIZE) {
+        // The graph rewrites the packets, start every burst from the templates.
+        for (int i = 0; i < VECTOR_SIZE; i++) {
+            memcpy(rx_buffers[i], templates[i], BENCH_FRAME_LEN);
+            rx_lengths[i] = BENCH_FRAME_LEN;
+            rx_interfaces[i] = 0;
+        }
 
-                    send_arp(arp_hdr->spa, arp_hdr->tpa, eth_hdr, interface, htons(ARP_OP_REPLY));
-                }
-                else {
-                    struct packet *new_packet = create_packet(buf, len, interface);
-                    forward_packet(new_packet);
-                }
+        uint64_t start = latency_now_ns();
+        graph_run(VECTOR_SIZE);
+        elapsed += latency_now_ns() - start;
+    }
+
+    printf("checksum %s, icmp errors %s, arp %s: %.1f ns per packet, %lu forwarded, %lu dropped\n",
+           VERIFY_CHECKSUM ? "on" : "off", ICMP_ERRORS ? "on" : "off", ARP_RESOLUTION ? "on" : "off",
+           (double) elapsed / (stats.forwarded + stats.dropped), stats.forwarded, stats.dropped);
+}
+
+int main(int argc, char *argv[])
+{
+    char *rtable6_path = NULL;
+    int nat_outside = -1;
+    uint32_t nat_sessions = NAT_DEFAULT_SESSIONS;
+    uint32_t egress_weights[EGRESS_CLASSES] = { 8, 4, 2, 1 };
+    int mtus[ROUTER_NUM_INTERFACES] = { 0 };
+    int interface, mtu;
+    uint32_t flow_sampling = 0;
+    char *flow_collector = NULL;
+    char *static_neighbours_path = NULL;
+    char *alternates_path = NULL;
+    int control_budget = 0;
+    uint32_t top_prefixes = 0, top_sampling = HEAVY_HITTERS_SAMPLING;
+    char *trace_path = NULL;
+    uint32_t trace_records = TRACE_DEFAULT_RECORDS;
+    uint64_t bench_packets = 0;
+    int routing = 0;
+    int opt;
+
+    // Parse the options, they come before the routing table and the interfaces.
+    while ((opt = getopt(argc, argv, "+6:Sa:N:m:w:M:B:Lf:F:s:RA:P:C:H:T:V:b:")) != -1) {
+        switch (opt) {
+        case '6':
+            rtable6_path = optarg;
+            break;
+        case 'a':
+            acl = acl_load(optarg);
+            break;
+        case 'N':
+            nat_outside = atoi(optarg);
+            break;
+        case 'm':
+            nat_sessions = strtoul(optarg, NULL, 10);
+            break;
+        case 'w':
+            // Egress class weights: control, interactive, best effort, bulk.
+            if (sscanf(optarg, "%u,%u,%u,%u", &egress_weights[0], &egress_weights[1],
+                       &egress_weights[2], &egress_weights[3]) != EGRESS_CLASSES) {
+                fprintf(stderr, "-w takes %d comma separated weights\n", EGRESS_CLASSES);
+                exit(1);
             }
-            else if (ntohs(arp_hdr->op) == ARP_OP_REPLY) {
-                // Update the ARP table.
-                update_arp_table(arp_hdr);
-
-                // Dequeue the packet and send.
-                if (!queue_empty(q)) {
-                    struct packet *new_packet = queue_deq(q);
-                    forward_packet(new_packet);
-                }
+            break;
+        case 'M':
+            // Interface MTU, up to jumbo frames: -M interface:mtu.
+            if (sscanf(optarg, "%d:%d", &interface, &mtu) != 2 || interface < 0 ||
+                interface >= ROUTER_NUM_INTERFACES || mtu < MIN_MTU || mtu > MAX_JUMBO_MTU) {
+                fprintf(stderr, "-M takes interface:mtu, with the MTU in [%d, %d]\n", MIN_MTU, MAX_JUMBO_MTU);
+                exit(1);
+            }
+            mtus[interface] = mtu;
+            break;
+        case 'B':
+            busy_poll_cpu = atoi(optarg);
+            break;
+        case 'L':
+            measure_latency = 1;
+            break;
+        case 'f':
+            flow_sampling = strtoul(optarg, NULL, 10);
+            break;
+        case 'F':
+            flow_collector = optarg;
+            break;
+        case 's':
+            static_neighbours_path = optarg;
+            break;
+        case 'R':
+            routing = 1;
+            break;
+        case 'A':
+            alternates_path = optarg;
+            break;
+        case 'P':
+            // Gateway probing interval, sub-second for a fast failover.
+            probe_interval_ms = atoi(optarg);
+            if (probe_interval_ms < TIMER_TICK_MS) {
+                fprintf(stderr, "-P takes an interval of at least %d ms\n", TIMER_TICK_MS);
+                exit(1);
+            }
+            break;
+        case 'C':
+            // Control frames first, then at most this many data frames per burst.
+            control_budget = atoi(optarg);
+            if (control_budget <= 0) {
+                fprintf(stderr, "-C takes a positive data budget\n");
+                exit(1);
             }
+            break;
+        case 'H':
+            // Top destination prefixes: -H k or -H k:sampling.
+            if (sscanf(optarg, "%u:%u", &top_prefixes, &top_sampling) < 1 || top_prefixes == 0 ||
+                top_sampling == 0) {
+                fprintf(stderr, "-H takes k or k:sampling\n");
+                exit(1);
+            }
+            break;
+        case 'T':
+            // Decision trace: -T file or -T file:records.
+            trace_path = optarg;
+            char *records = strrchr(optarg, ':');
+            if (records != NULL) {
+                *records = '\0';
+                trace_records = strtoul(records + 1, NULL, 10);
+            }
+            if (trace_records == 0 || (trace_records & (trace_records - 1)) != 0) {
+                fprintf(stderr, "-T takes file or file:records, with the records a power of two\n");
+                exit(1);
+            }
+            break;
+        case 'V':
+            // Another routing table: -V name:rtable:interface,interface...
+            if (vrf_count == 0) {
+                vrf_names[vrf_count++] = "default";
+            }
+            if (vrf_count == VRF_MAXSIZE || (vrf_paths[vrf_count] = strchr(optarg, ':')) == NULL ||
+                (vrf_interfaces[vrf_count] = strchr(vrf_paths[vrf_count] + 1, ':')) == NULL) {
+                fprintf(stderr, "-V takes name:rtable:interfaces, at most %d times\n", VRF_MAXSIZE - 1);
+                exit(1);
+            }
+            *vrf_paths[vrf_count]++ = '\0';
+            *vrf_interfaces[vrf_count]++ = '\0';
+            vrf_names[vrf_count++] = optarg;
+            break;
+        case 'b':
+            // Forward this many generated packets, print the cost and exit.
+            bench_packets = strtoull(optarg, NULL, 10);
+            break;
+        case 'S':
+            // Small pages only, to compare against the huge page backed tables.
+            huge_disable();
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-6 rtable6] [-a acl_rules] [-N outside_interface [-m max_sessions]] [-w weights] [-M interface:mtu]... [-B cpu] [-L] [-f sampling -F collector] [-s neighbours] [-R] [-A alternates] [-P probe_ms] [-C data_budget] [-H k[:sampling]] [-T trace[:records]] [-V name:rtable:interfaces]... [-b packets] [-S] rtable interfaces...\n", argv[0]);
+            exit(1);
+        }
+    }
+    argv[optind - 1] = argv[0];
+    argc -= optind - 1;
+    argv += optind - 1;
+
+    // Do not modify this line.
+    init(argc - 2, argv + 2);
+    for (int i = 0; i < ROUTER_NUM_INTERFACES; i++) {
+        if (mtus[i] != 0 && set_interface_mtu(i, mtus[i]) < 0) {
+            fprintf(stderr, "interface %d: cannot set the MTU to %d\n", i, mtus[i]);
+        }
+    }
+    init_interfaces();
+
+    // Separate the control frames from the data frames on ingress.
+    if (control_budget > 0) {
+        DIE(enable_control_priority(control_budget) < 0, "SO_ATTACH_FILTER");
+    }
+
+    // Receive buffers fit the longest frame of any interface.
+    rx_frame_size = MAX_PACKET_LEN;
+    for (int i = 0; i < ROUTER_NUM_INTERFACES; i++) {
+        if ((size_t) ifaces[i].mtu + FRAME_OVERHEAD > rx_frame_size) {
+            rx_frame_size = ifaces[i].mtu + FRAME_OVERHEAD;
+        }
+    }
+
+    // Read the routing table and sort it.
+    rtable = huge_alloc(sizeof(struct route_table_entry) * RTABLE_MAXSIZE, "rtable");
+    rtable_size = read_rtable(argv[1], rtable);
+    qsort((void *) rtable, rtable_size, sizeof(struct route_table_entry), rtable_compare);
+
+    // Merge the equal-cost routes into next-hop groups.
+    // With VRFs, the groups of their routes follow.
+    int groups_size = vrf_count > 0 ? RTABLE_MAXSIZE : (rtable_size > 0 ? rtable_size : 1);
+    nh_groups = huge_alloc(sizeof(struct nexthop_group) * groups_size, "next-hop groups");
+    rtable_size = build_nexthop_groups(rtable, rtable_size, nh_groups);
+
+    // Configured alternate next hops, grouped the same way.
+    if (alternates_path != NULL) {
+        alt_table = huge_alloc(sizeof(struct route_table_entry) * RTABLE_MAXSIZE, "alternate routes");
+        alt_size = read_rtable(alternates_path, alt_table);
+        qsort((void *) alt_table, alt_size, sizeof(struct route_table_entry), rtable_compare);
+        alt_groups = huge_alloc(sizeof(struct nexthop_group) * (alt_size > 0 ? alt_size : 1), "alternate groups");
+        alt_size = build_nexthop_groups(alt_table, alt_size, alt_groups);
+    }
+
+    // Precompute the backup of every prefix for a fast reroute.
+    build_backups();
+
+    // The other routing tables, looked up with the main one in a shared FIB.
+    if (vrf_count > 0) {
+        build_vrfs();
+    }
+
+    // Read the IPv6 routing table, if any, into the trie.
+    rtable6 = huge_alloc(sizeof(struct route6_table_entry) * RTABLE6_MAXSIZE, "rtable6");
+    rtable6_size = rtable6_path != NULL ? read_rtable6(rtable6_path, rtable6, RTABLE6_MAXSIZE) : 0;
+    fib6 = lpm6_create();
+    for (int i = 0; i < rtable6_size; i++) {
+        lpm6_insert(fib6, &rtable6[i].prefix, rtable6[i].len, i);
+    }
+
+    // Set arp table values, the neighbour caches and the pending packets'
+    // buffers are backed by huge pages like the routing tables.
+    arp_table = huge_alloc(sizeof(struct arp_cache_entry) * ARP_TABLE_MAXSIZE, "arp table");
+    nd_table = huge_alloc(sizeof(struct nd_cache_entry) * ND_TABLE_MAXSIZE, "neighbour table");
+    frame_buffers = pool_set_create(frame_class_sizes, frame_class_counts, FRAME_CLASSES, "frame buffers");
+    arp_table_size = 0;
+    nd_table_size = 0;
+
+    // Static neighbours, from the command line or else compiled in.
+    if (static_neighbours_path != NULL) {
+        load_static_neighbours(static_neighbours_path);
+    }
+#ifdef STATIC_NEIGHBOURS
+    else {
+        static_neighbours = (struct mph) { STATIC_NEIGHBOURS_SIZE, STATIC_NEIGHBOURS_BUCKETS, static_neighbours_seeds };
+        static_neighbour_table = static_neighbours_entries;
+    }
+#endif
+
+    // Masquerade the traffic leaving through the outside interface.
+    if (nat_outside >= 0) {
+        DIE(nat_outside >= ROUTER_NUM_INTERFACES || nat_sessions == 0, "nat options");
+        nat = nat_create(ifaces[nat_outside].ip, nat_outside, nat_sessions);
+    }
+
+    // Sample 1 in flow_sampling forwarded packets into flow records.
+    if (flow_sampling > 0) {
+        DIE(flow_collector == NULL, "-f needs a collector, -F ip:port or -F file");
+        flows = flow_create(flow_sampling, FLOW_TABLE_SIZE);
+        flow_set_collector(flows, flow_collector);
+    }
+
+    // Track the heavy-hitter prefixes, with spare counters for the churn of
+    // the smallest ones.
+    if (top_prefixes > 0) {
+        heavy_hitters = topk_create(TOPK_OVERSIZE * top_prefixes, top_sampling);
+        heavy_hitters_report = malloc(sizeof(struct topk_entry) * TOPK_OVERSIZE * top_prefixes);
+        DIE(heavy_hitters_report == NULL, "malloc");
+        heavy_hitters_shown = top_prefixes;
+    }
+
+    // Keep the decisions of the last packets in a file that survives a crash.
+    if (trace_path != NULL) {
+        trace = trace_open(trace_path, trace_records);
+    }
+
+    // Distance-vector routing, starting from the connected networks.
+    if (routing) {
+        rip = rip_create(RIP_MAX_ROUTES);
+        rip_fib = fib4_create(RIP_MAX_ROUTES);
+        learned_routes = huge_alloc(sizeof(struct learned_route) * RIP_MAX_ROUTES, "learned routes");
+        for (int i = 0; i < ROUTER_NUM_INTERFACES; i++) {
+            rip_add_connected(rip, ifaces[i].ip, get_interface_netmask(i), i);
+        }
+    }
+
+    // Output queues, used once the links stop keeping up.
+    egress = egress_create(ROUTER_NUM_INTERFACES, egress_weights, frame_buffers);
+
+    // Initialize the timers and the ARP resolution queues.
+    init_timers();
+
+    // Receive buffers of a burst.
+    char *rx_memory = huge_alloc(VECTOR_SIZE * rx_frame_size, "rx buffers");
+    for (int i = 0; i < VECTOR_SIZE; i++) {
+        rx_buffers[i] = rx_memory + i * rx_frame_size;
+    }
+
+    if (measure_latency) {
+        DIE(enable_rx_timestamps() < 0, "SO_TIMESTAMPNS");
+    }
+
+    // Ask the neighbours for their tables and announce ours, so the routes
+    // converge without waiting for the periodic updates.
+    if (rip != NULL) {
+        uint8_t request[RIP_MAX_PAYLOAD];
+        size_t len = rip_build_request(request);
+
+        rip_sync();
+        for (int i = 0; i < ROUTER_NUM_INTERFACES; i++) {
+            send_rip(i, request, len);
+        }
+        rip_announce(0);
+    }
+
+    if (bench_packets > 0) {
+        run_benchmark(bench_packets);
+        return 0;
+    }
+
+    if (busy_poll_cpu >= 0) {
+        DIE(pin_to_cpu(busy_poll_cpu) < 0, "sched_setaffinity");
+        if (enable_busy_poll(BUSY_POLL_USECS) < 0) {
+            fprintf(stderr, "SO_BUSY_POLL not available, spinning in user space only\n");
         }
+        run_busy_poll();
     }
+    run_blocking();
 }
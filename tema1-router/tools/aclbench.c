@@ -0,0 +1,148 @@
+/*
+ * Benchmark of the ACL classification rate against the number of rules: for
+ * every rule count, writes that many random rules to a file, loads it with
+ * acl_load() like the router started with -a, then classifies packets of
+ * the rules and random packets, as ip4-acl does.
+ *
+ *	tools/aclbench [packets] [rule_count ...]
+ *
+ * The rules mix /0, /8, /16, /24 and /32 prefixes, the three protocols and
+ * single ports, * and a few usual port ranges (0-1023, 1024-65535 and
+ * 6000-6063), so the number of tuples grows with the rules until all the
+ * mask combinations are used. Ranges of random bounds split into prefixes of
+ * most lengths, and give a tuple for almost every rule.
+ */
+#include "acl.h"
+#include "lib.h"
+#include "latency.h"
+#include <arpa/inet.h>
+#include <string.h>
+
+#define ACLBENCH_PACKETS (1 << 20)
+
+struct aclbench_packet {
+	uint32_t src, dst;
+	uint8_t proto;
+	uint16_t sport, dport;
+};
+
+static uint32_t rng = 12345;
+
+static uint32_t next_random(void)
+{
+	rng ^= rng << 13;
+	rng ^= rng >> 17;
+	rng ^= rng << 5;
+	return rng;
+}
+
+static const int prefix_lengths[] = { 0, 8, 16, 24, 32 };
+static const char *protos[] = { "any", "tcp", "udp" };
+static const uint16_t ranges[][2] = { { 0, 1023 }, { 1024, 65535 }, { 6000, 6063 } };
+
+static uint32_t random_host(uint32_t prefix, int len)
+{
+	uint32_t mask = len ? 0xffffffff << (32 - len) : 0;
+
+	return (prefix & mask) | (next_random() & ~mask);
+}
+
+static void write_ports(FILE *f, uint16_t *port)
+{
+	uint32_t kind = next_random() % 3;
+	const uint16_t *range = ranges[next_random() % 3];
+
+	if (kind == 0) {
+		*port = next_random();
+		fprintf(f, " *");
+	} else if (kind == 1) {
+		*port = 1 + next_random() % 65535;
+		fprintf(f, " %u", *port);
+	} else {
+		*port = range[0] + next_random() % (range[1] - range[0] + 1);
+		fprintf(f, " %u-%u", range[0], range[1]);
+	}
+}
+
+/* writes count random rules to path, and a packet matching each of them */
+static void write_rules(const char *path, int count, struct aclbench_packet *matching)
+{
+	FILE *f = fopen(path, "w");
+
+	DIE(f == NULL, "Failed to open %s", path);
+	for (int i = 0; i < count; i++) {
+		struct aclbench_packet *p = &matching[i];
+		int src_len = prefix_lengths[next_random() % 5];
+		int dst_len = prefix_lengths[next_random() % 5];
+		int proto = next_random() % 3;
+		uint32_t src = random_host(next_random(), src_len);
+		uint32_t dst = random_host(next_random(), dst_len);
+		struct in_addr in;
+
+		in.s_addr = htonl(src);
+		fprintf(f, "%d %s %s/%d", i + 1, next_random() % 4 ? "permit" : "deny", inet_ntoa(in),
+			src_len);
+		in.s_addr = htonl(dst);
+		fprintf(f, " %s/%d %s", inet_ntoa(in), dst_len, protos[proto]);
+		write_ports(f, &p->sport);
+		write_ports(f, &p->dport);
+		fprintf(f, "\n");
+
+		p->src = htonl(random_host(src, src_len));
+		p->dst = htonl(random_host(dst, dst_len));
+		p->proto = proto == 2 ? 17 : 6;
+	}
+	fclose(f);
+}
+
+int main(int argc, char *argv[])
+{
+	static const int default_counts[] = { 10, 100, 1000, 10000, 100000 };
+	uint64_t packets = argc > 1 ? strtoull(argv[1], NULL, 10) : 1000000;
+	int runs = argc > 2 ? argc - 2 : 5;
+	char path[] = "/tmp/aclbench.XXXXXX";
+	int fd = mkstemp(path);
+
+	DIE(fd < 0, "mkstemp");
+	close(fd);
+
+	struct aclbench_packet *samples = malloc(sizeof(struct aclbench_packet) * ACLBENCH_PACKETS);
+	DIE(samples == NULL, "malloc");
+
+	for (int run = 0; run < runs; run++) {
+		int count = argc > 2 ? atoi(argv[run + 2]) : default_counts[run];
+		struct aclbench_packet *matching = malloc(sizeof(struct aclbench_packet) * count);
+
+		DIE(count <= 0 || matching == NULL, "rule count");
+		write_rules(path, count, matching);
+		struct acl *acl = acl_load(path);
+
+		/* half the packets hit a rule, the other half are random */
+		for (uint32_t n = 0; n < ACLBENCH_PACKETS; n++) {
+			if (n & 1) {
+				samples[n] = matching[next_random() % count];
+			} else {
+				samples[n].src = next_random();
+				samples[n].dst = next_random();
+				samples[n].proto = next_random() & 1 ? 6 : 17;
+				samples[n].sport = next_random();
+				samples[n].dport = next_random();
+			}
+		}
+
+		uint64_t hits = 0, start = latency_now_ns();
+		for (uint64_t n = 0; n < packets; n++) {
+			struct aclbench_packet *p = &samples[n & (ACLBENCH_PACKETS - 1)];
+
+			hits += acl_classify(acl, p->src, p->dst, p->proto, p->sport, p->dport) >= 0;
+		}
+		uint64_t elapsed = latency_now_ns() - start;
+
+		printf("%d rules, %d tuples: %.1f ns per packet, %.2f Mpps (%.0f%% hits)\n", count,
+		       acl->tuple_count, (double)elapsed / packets, packets * 1e3 / elapsed,
+		       hits * 100.0 / packets);
+		free(matching);
+	}
+	unlink(path);
+	return 0;
+}
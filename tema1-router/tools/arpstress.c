@@ -0,0 +1,205 @@
+/*
+ * Stress benchmark of the router's control plane under data load: floods one
+ * of its links with IPv4 frames while resolving its address with ARP, and
+ * prints the latency of the ARP replies. Run it from the host side of a link,
+ * e.g. against a router started with and without -C:
+ *
+ *	tools/arpstress h-0 192.168.0.1 192.168.1.2 10
+ *
+ * floods h-0 with frames for 192.168.1.2 for 10 seconds while asking for the
+ * MAC of 192.168.0.1 every ARPSTRESS_PROBE_US microseconds.
+ */
+#include "lib.h"
+#include "protocols.h"
+#include "latency.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <net/if.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#define ARPSTRESS_FRAME_LEN 1024
+#define ARPSTRESS_PROBE_US 10000
+#define ARPSTRESS_TIMEOUT_MS 1000
+
+static int open_socket(const char *if_name, int *ifindex, uint8_t *mac)
+{
+	struct ifreq ifr;
+	int s = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+
+	DIE(s == -1, "socket");
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, if_name, IFNAMSIZ - 1);
+	DIE(ioctl(s, SIOCGIFINDEX, &ifr) == -1, "ioctl SIOCGIFINDEX");
+	*ifindex = ifr.ifr_ifindex;
+	DIE(ioctl(s, SIOCGIFHWADDR, &ifr) == -1, "ioctl SIOCGIFHWADDR");
+	memcpy(mac, ifr.ifr_hwaddr.sa_data, 6);
+
+	struct sockaddr_ll addr = { .sll_family = AF_PACKET, .sll_ifindex = *ifindex,
+				    .sll_protocol = htons(ETH_P_ALL) };
+	DIE(bind(s, (struct sockaddr *)&addr, sizeof(addr)) == -1, "bind");
+	return s;
+}
+
+/* Builds a broadcast ARP request for target_ip. */
+static size_t build_arp_request(char *frame, const uint8_t *mac, uint32_t target_ip)
+{
+	struct ether_header *eth_hdr = (struct ether_header *)frame;
+	struct arp_header *arp_hdr = (struct arp_header *)(eth_hdr + 1);
+
+	memset(eth_hdr->ether_dhost, 0xff, 6);
+	memcpy(eth_hdr->ether_shost, mac, 6);
+	eth_hdr->ether_type = htons(0x0806);
+
+	arp_hdr->htype = htons(1);
+	arp_hdr->ptype = htons(0x0800);
+	arp_hdr->hlen = 6;
+	arp_hdr->plen = 4;
+	arp_hdr->op = htons(1);
+	memcpy(arp_hdr->sha, mac, 6);
+	arp_hdr->spa = 0;
+	memset(arp_hdr->tha, 0, 6);
+	arp_hdr->tpa = target_ip;
+
+	return sizeof(*eth_hdr) + sizeof(*arp_hdr);
+}
+
+/* Builds a UDP frame for daddr through the router. */
+static size_t build_data_frame(char *frame, const uint8_t *mac, const uint8_t *router_mac,
+			       uint32_t daddr)
+{
+	struct ether_header *eth_hdr = (struct ether_header *)frame;
+	struct iphdr *ip_hdr = (struct iphdr *)(eth_hdr + 1);
+
+	memset(frame, 0, ARPSTRESS_FRAME_LEN);
+	memcpy(eth_hdr->ether_dhost, router_mac, 6);
+	memcpy(eth_hdr->ether_shost, mac, 6);
+	eth_hdr->ether_type = htons(0x0800);
+
+	ip_hdr->version = 4;
+	ip_hdr->ihl = 5;
+	ip_hdr->tot_len = htons(ARPSTRESS_FRAME_LEN - sizeof(*eth_hdr));
+	ip_hdr->ttl = 64;
+	ip_hdr->protocol = 17;
+	ip_hdr->saddr = inet_addr("10.255.255.1");
+	ip_hdr->daddr = daddr;
+	ip_hdr->check = htons(checksum((uint16_t *)ip_hdr, sizeof(*ip_hdr)));
+
+	return ARPSTRESS_FRAME_LEN;
+}
+
+/*
+ * Sends an ARP request and waits for the router's reply.
+ * Returns: the reply's latency in ns, 0 if none came in time. Sets router_mac
+ * from the reply.
+ */
+static uint64_t resolve(int s, const uint8_t *mac, uint32_t router_ip, uint8_t *router_mac)
+{
+	char frame[MAX_PACKET_LEN];
+	size_t len = build_arp_request(frame, mac, router_ip);
+	uint64_t start = latency_now_ns();
+
+	DIE(send(s, frame, len, 0) == -1, "send");
+
+	while (latency_now_ns() - start < (uint64_t)ARPSTRESS_TIMEOUT_MS * 1000000) {
+		struct pollfd pfd = { .fd = s, .events = POLLIN };
+		struct ether_header *eth_hdr = (struct ether_header *)frame;
+		struct arp_header *arp_hdr = (struct arp_header *)(eth_hdr + 1);
+
+		/* Sleep rather than spin, so the router keeps the CPU. */
+		if (poll(&pfd, 1, ARPSTRESS_TIMEOUT_MS) <= 0)
+			continue;
+
+		ssize_t ret = recv(s, frame, sizeof(frame), MSG_DONTWAIT);
+		if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			continue;
+		DIE(ret < 0, "recv");
+
+		if ((size_t)ret >= sizeof(*eth_hdr) + sizeof(*arp_hdr) &&
+		    eth_hdr->ether_type == htons(0x0806) && arp_hdr->op == htons(2) &&
+		    arp_hdr->spa == router_ip) {
+			memcpy(router_mac, arp_hdr->sha, 6);
+			return latency_now_ns() - start;
+		}
+	}
+	return 0;
+}
+
+/* Floods the link until killed. */
+static void flood(const char *if_name, const uint8_t *router_mac, uint32_t daddr)
+{
+	static char frame[ARPSTRESS_FRAME_LEN];
+	uint8_t mac[6];
+	int ifindex;
+	int s = open_socket(if_name, &ifindex, mac);
+	size_t len = build_data_frame(frame, mac, router_mac, daddr);
+
+	while (1) {
+		/* The link being full is the point. */
+		if (send(s, frame, len, 0) == -1 && errno != ENOBUFS && errno != EAGAIN)
+			DIE(1, "send");
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct latency_hist idle = { 0 }, loaded = { 0 };
+	uint8_t mac[6], router_mac[6];
+	uint64_t lost = 0;
+	int ifindex;
+
+	if (argc != 5) {
+		fprintf(stderr, "Usage: %s interface router_ip flood_destination seconds\n", argv[0]);
+		return 1;
+	}
+
+	uint32_t router_ip = inet_addr(argv[2]);
+	uint32_t daddr = inet_addr(argv[3]);
+	uint64_t duration = strtoull(argv[4], NULL, 10) * 1000000000;
+	int s = open_socket(argv[1], &ifindex, mac);
+	int on = 1;
+
+	/* Only the router's frames, not the flood sent on the same link. */
+	DIE(setsockopt(s, SOL_PACKET, PACKET_IGNORE_OUTGOING, &on, sizeof(on)) == -1,
+	    "PACKET_IGNORE_OUTGOING");
+
+	/* Baseline without load, which also finds the router's MAC. */
+	for (int i = 0; i < 100; i++) {
+		uint64_t ns = resolve(s, mac, router_ip, router_mac);
+
+		DIE(ns == 0 && i == 0, "no ARP reply from %s", argv[2]);
+		if (ns != 0)
+			latency_record(&idle, ns);
+		usleep(ARPSTRESS_PROBE_US);
+	}
+
+	pid_t flooder = fork();
+	DIE(flooder == -1, "fork");
+	if (flooder == 0)
+		flood(argv[1], router_mac, daddr);
+
+	uint64_t start = latency_now_ns();
+	while (latency_now_ns() - start < duration) {
+		uint64_t ns = resolve(s, mac, router_ip, router_mac);
+
+		if (ns != 0)
+			latency_record(&loaded, ns);
+		else
+			lost++;
+		usleep(ARPSTRESS_PROBE_US);
+	}
+
+	kill(flooder, SIGKILL);
+	waitpid(flooder, NULL, 0);
+
+	latency_dump(&idle, "arp idle", stdout);
+	latency_dump(&loaded, "arp loaded", stdout);
+	printf("unanswered under load: %lu\n", lost);
+	return 0;
+}
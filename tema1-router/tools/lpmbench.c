@@ -0,0 +1,127 @@
+/*
+ * Benchmark of the IPv4 route lookups of the router with and without huge
+ * pages. It loads a routing table into the two structures ip4-lookup
+ * searches, both from huge_alloc():
+ *  - the rtable sorted with rtable_compare(), searched by rtable_lookup()
+ *    like get_best_route() does by default;
+ *  - the trie of the VRF FIB, built from the same routes and moved to huge
+ *    pages by vrf_fib_finish(), searched like with -V.
+ * Then it looks up random addresses of the routes and reads the route found,
+ * as ip4-lookup does. With -S the tables get regular pages, like the router
+ * started with -S.
+ *
+ *	tools/lpmbench [-S] rtable [extra_prefixes] [lookups]
+ *
+ * extra_prefixes random /24 routes are added to the table, by default up to
+ * LPMBENCH_ROUTES, the most routes the router loads.
+ */
+#include "lib.h"
+#include "hugepage.h"
+#include "latency.h"
+#include "vrf.h"
+#include <arpa/inet.h>
+#include <string.h>
+
+#define LPMBENCH_ROUTES 100000
+#define LPMBENCH_ADDRESSES (1 << 22)
+
+static uint32_t rng = 12345;
+
+static uint32_t next_random(void)
+{
+	rng ^= rng << 13;
+	rng ^= rng >> 17;
+	rng ^= rng << 5;
+	return rng;
+}
+
+/* number of lines of a file, an upper bound of its routes */
+static uint32_t count_lines(const char *path)
+{
+	FILE *f = fopen(path, "r");
+	uint32_t lines = 0;
+	int c;
+
+	DIE(f == NULL, "Failed to open %s", path);
+	while ((c = getc(f)) != EOF)
+		lines += c == '\n';
+	fclose(f);
+	return lines + 1;
+}
+
+int main(int argc, char *argv[])
+{
+	int small = argc > 1 && strcmp(argv[1], "-S") == 0;
+
+	if (small) {
+		huge_disable();
+		argv++;
+		argc--;
+	}
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s [-S] rtable [extra_prefixes] [lookups]\n", argv[0]);
+		return 1;
+	}
+
+	struct route_table_entry *read = malloc(sizeof(struct route_table_entry) * count_lines(argv[1]));
+	DIE(read == NULL, "malloc");
+	uint32_t count = read_rtable(argv[1], read);
+	DIE(count == 0, "%s: no routes", argv[1]);
+
+	uint32_t extra = argc > 2 ? atoi(argv[2]) : (count < LPMBENCH_ROUTES ? LPMBENCH_ROUTES - count : 0);
+	uint64_t lookups = argc > 3 ? strtoull(argv[3], NULL, 10) : 50000000;
+	uint32_t size = count + extra;
+
+	struct route_table_entry *rtable = huge_alloc(sizeof(struct route_table_entry) * size, "rtable");
+
+	memcpy(rtable, read, sizeof(struct route_table_entry) * count);
+	for (uint32_t i = count; i < size; i++) {
+		rtable[i].prefix = htonl(next_random() & 0xffffff00);
+		rtable[i].mask = htonl(0xffffff00);
+		rtable[i].next_hop = rtable[i % count].next_hop;
+		rtable[i].interface = rtable[i % count].interface;
+	}
+	qsort(rtable, size, sizeof(struct route_table_entry), rtable_compare);
+
+	struct vrf_route *routes = malloc(sizeof(struct vrf_route) * size);
+	DIE(routes == NULL, "malloc");
+	for (uint32_t i = 0; i < size; i++)
+		routes[i] = (struct vrf_route) { ntohl(rtable[i].prefix), __builtin_popcount(rtable[i].mask), i };
+
+	struct vrf_fib *fib = vrf_fib_create(1);
+	vrf_fib_build(fib, 0, routes, size);
+	vrf_fib_finish(fib);
+
+	/* hosts of random routes, so the lookups spread over the whole table */
+	uint32_t *addresses = malloc(sizeof(uint32_t) * LPMBENCH_ADDRESSES);
+	DIE(addresses == NULL, "malloc");
+	for (uint32_t n = 0; n < LPMBENCH_ADDRESSES; n++) {
+		struct route_table_entry *route = &rtable[next_random() % size];
+
+		addresses[n] = route->prefix | (htonl(next_random()) & ~route->mask);
+	}
+
+	uint64_t sum = 0, start = latency_now_ns();
+	for (uint64_t n = 0; n < lookups; n++) {
+		struct route_table_entry *route = rtable_lookup(rtable, addresses[n & (LPMBENCH_ADDRESSES - 1)],
+							       0, size - 1);
+
+		if (route != NULL)
+			sum += route->next_hop;
+	}
+	uint64_t rtable_elapsed = latency_now_ns() - start;
+
+	start = latency_now_ns();
+	for (uint64_t n = 0; n < lookups; n++) {
+		int32_t index = vrf_fib_lookup(fib, 0, ntohl(addresses[n & (LPMBENCH_ADDRESSES - 1)]));
+
+		if (index >= 0)
+			sum += rtable[index].next_hop;
+	}
+	uint64_t trie_elapsed = latency_now_ns() - start;
+
+	printf("%s pages, %u routes, %zu KB of trie: %.1f ns per rtable lookup, %.1f ns per trie lookup (%lx)\n",
+	       small ? "regular" : "huge", size, vrf_fib_memory(fib) / 1024, (double)rtable_elapsed / lookups,
+	       (double)trie_elapsed / lookups, (unsigned long)(sum & 0xf));
+	return 0;
+}
@@ -0,0 +1,59 @@
+/*
+ * Generates the static neighbour table compiled into the router for fixed
+ * topologies: reads a neighbour file in the parse_arp_table() format and
+ * prints a header with the perfect hash seeds and the entries in slot
+ * order. See the STATIC_NEIGHBOURS variable of the Makefile.
+ *
+ * The addresses are written as they are in memory, so the header is only
+ * valid for hosts with the byte order of the one that generated it.
+ */
+#include "lib.h"
+#include "mph.h"
+#include <arpa/inet.h>
+
+#define MPHGEN_MAX_ENTRIES 65536
+
+int main(int argc, char *argv[])
+{
+	static struct arp_entry entries[MPHGEN_MAX_ENTRIES];
+	static uint32_t keys[MPHGEN_MAX_ENTRIES];
+	struct mph m;
+
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s neighbours_file > static_neighbours.h\n", argv[0]);
+		return 1;
+	}
+
+	int n = parse_arp_table(argv[1], entries);
+	DIE(n == 0, "no neighbours in %s", argv[1]);
+	for (int i = 0; i < n; i++)
+		keys[i] = entries[i].ip;
+	DIE(mph_build(&m, keys, n) < 0, "duplicate neighbours in %s", argv[1]);
+
+	/* place every entry in its slot */
+	struct arp_entry *slots = calloc(n, sizeof(struct arp_entry));
+	DIE(slots == NULL, "calloc");
+	for (int i = 0; i < n; i++)
+		slots[mph_lookup(&m, entries[i].ip)] = entries[i];
+
+	printf("/* Generated by tools/mphgen from %s, do not edit. */\n", argv[1]);
+	printf("#define STATIC_NEIGHBOURS_SIZE %u\n", m.size);
+	printf("#define STATIC_NEIGHBOURS_BUCKETS %u\n\n", m.num_buckets);
+
+	printf("static const uint32_t static_neighbours_seeds[STATIC_NEIGHBOURS_BUCKETS] = {\n");
+	for (uint32_t b = 0; b < m.num_buckets; b++)
+		printf("\t%u,\n", m.seeds[b]);
+	printf("};\n\n");
+
+	printf("static const struct arp_entry static_neighbours_entries[STATIC_NEIGHBOURS_SIZE] = {\n");
+	for (int i = 0; i < n; i++) {
+		struct in_addr addr = { .s_addr = slots[i].ip };
+		uint8_t *mac = slots[i].mac;
+
+		printf("\t{ 0x%08x, { 0x%02x, 0x%02x, 0x%02x, 0x%02x, 0x%02x, 0x%02x } },\t/* %s */\n",
+		       slots[i].ip, mac[0], mac[1], mac[2], mac[3], mac[4], mac[5], inet_ntoa(addr));
+	}
+	printf("};\n");
+
+	return 0;
+}
@@ -0,0 +1,80 @@
+/*
+ * Benchmark of the heavy-hitter tracker of the router (-H): feeds topk_add()
+ * a Zipf-distributed stream of destination prefixes, like the one of
+ * get_best_route() on a full table, and prints the cost per packet and how
+ * many of the true top k keys are among the first k reported. Like the
+ * router, it keeps TOPK_OVERSIZE * k counters for k reported.
+ *
+ *	tools/topkbench [k] [sampling] [prefixes] [packets]
+ */
+#include "lib.h"
+#include "topk.h"
+#include "latency.h"
+#include <string.h>
+
+static uint32_t rng = 12345;
+
+static uint32_t next_random(void)
+{
+	rng ^= rng << 13;
+	rng ^= rng >> 17;
+	rng ^= rng << 5;
+	return rng;
+}
+
+int main(int argc, char *argv[])
+{
+	uint32_t k = argc > 1 ? atoi(argv[1]) : 16;
+	uint32_t sampling = argc > 2 ? atoi(argv[2]) : 1;
+	uint32_t prefixes = argc > 3 ? atoi(argv[3]) : 65536;
+	uint32_t packets = argc > 4 ? atoi(argv[4]) : 10000000;
+
+	/* Zipf(1) over the prefixes, drawn by binary search in the CDF. */
+	double *cdf = malloc(sizeof(double) * prefixes);
+	uint64_t *keys = malloc(sizeof(uint64_t) * packets);
+	uint64_t *exact = calloc(prefixes, sizeof(uint64_t));
+	DIE(cdf == NULL || keys == NULL || exact == NULL, "malloc");
+
+	double sum = 0;
+	for (uint32_t i = 0; i < prefixes; i++) {
+		sum += 1.0 / (i + 1);
+		cdf[i] = sum;
+	}
+	for (uint32_t n = 0; n < packets; n++) {
+		double u = (double)next_random() / UINT32_MAX * sum;
+		uint32_t lo = 0, hi = prefixes - 1;
+
+		while (lo < hi) {
+			uint32_t mid = (lo + hi) / 2;
+
+			if (cdf[mid] < u)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		/* a /24 per rank, scattered over the address space */
+		keys[n] = (uint64_t)24 << 32 | ((lo * 2654435761u) & 0xffffff00);
+		exact[lo]++;
+	}
+
+	struct topk *t = topk_create(TOPK_OVERSIZE * k, sampling);
+	uint64_t start = latency_now_ns();
+	for (uint32_t n = 0; n < packets; n++)
+		if (topk_sample(t))
+			topk_add(t, keys[n], 64 + (keys[n] & 0x3ff));
+	uint64_t elapsed = latency_now_ns() - start;
+
+	/* The true top k are the first k ranks. */
+	struct topk_entry *top = malloc(sizeof(struct topk_entry) * TOPK_OVERSIZE * k);
+	uint32_t count = topk_sorted(t, top), found = 0;
+	for (uint32_t i = 0; i < count && i < k; i++)
+		for (uint32_t r = 0; r < k && r < prefixes; r++)
+			if (top[i].key == ((uint64_t)24 << 32 | ((r * 2654435761u) & 0xffffff00)))
+				found++;
+
+	printf("k %u sampling %u prefixes %u packets %u: %.1f ns per packet, %u of the top %u found\n",
+	       k, sampling, prefixes, packets, (double)elapsed / packets, found, k);
+	printf("top counter: packets %lu (exact %lu) error %lu\n", top[0].packets * sampling,
+	       exact[0], top[0].error * sampling);
+	return 0;
+}
@@ -0,0 +1,104 @@
+/*
+ * Decodes the decision trace of the router (-T), oldest record first. The
+ * file stays valid after the router exits or crashes, and it can be read
+ * while the router runs: the records overwritten during the copy are
+ * skipped.
+ *
+ *	tools/tracedump trace_file [count]
+ *
+ * prints the last count records, all the ring by default.
+ */
+#include "lib.h"
+#include "trace.h"
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+
+static void print_record(const struct trace_record *r)
+{
+	char saddr[INET_ADDRSTRLEN], daddr[INET_ADDRSTRLEN], stamp[32], route[16];
+	time_t sec = r->stamp / 1000000000;
+	struct tm tm;
+
+	localtime_r(&sec, &tm);
+	strftime(stamp, sizeof(stamp), "%H:%M:%S", &tm);
+	inet_ntop(AF_INET, &r->saddr, saddr, sizeof(saddr));
+	inet_ntop(AF_INET, &r->daddr, daddr, sizeof(daddr));
+
+	if (r->route == TRACE_NO_ROUTE)
+		strcpy(route, "-");
+	else
+		snprintf(route, sizeof(route), "%d", r->route);
+
+	printf("%s.%09lu %10u if %u", stamp, (unsigned long)(r->stamp % 1000000000), r->seq, r->ingress);
+	if (r->egress != TRACE_NO_INTERFACE)
+		printf("->%u", r->egress);
+	else
+		printf("   ");
+	printf(" %15s > %-15s len %5u %-9s %-14s route %s\n", saddr, daddr, r->len,
+	       trace_decision_name(r->decision), trace_reason_name(r->reason), route);
+}
+
+int main(int argc, char *argv[])
+{
+	struct stat st;
+
+	if (argc < 2 || argc > 3) {
+		fprintf(stderr, "Usage: %s trace_file [count]\n", argv[0]);
+		return 1;
+	}
+
+	int fd = open(argv[1], O_RDONLY);
+	DIE(fd < 0, "open %s", argv[1]);
+	DIE(fstat(fd, &st) < 0, "fstat");
+	DIE((size_t)st.st_size < sizeof(struct trace_header), "%s: not a trace", argv[1]);
+
+	const struct trace_header *header = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	DIE(header == MAP_FAILED, "mmap");
+	close(fd);
+
+	DIE(__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != TRACE_MAGIC ||
+	    header->version != TRACE_VERSION || header->record_size != sizeof(struct trace_record),
+	    "%s: not a trace of this version", argv[1]);
+
+	uint32_t records = header->records;
+	DIE(sizeof(*header) + (size_t)records * sizeof(struct trace_record) > (size_t)st.st_size,
+	    "%s: truncated", argv[1]);
+
+	const struct trace_record *ring = (const struct trace_record *)(header + 1);
+	uint64_t count = argc > 2 ? strtoull(argv[2], NULL, 10) : records;
+	if (count > records)
+		count = records;
+
+	/* Copy the records, then drop those the writer may have reached since:
+	 * the ones more than a ring behind the head read afterwards, and the one
+	 * exactly a ring behind, whose slot record head may be being written to. */
+	struct trace_record *copy = malloc(sizeof(struct trace_record) * count);
+	DIE(copy == NULL, "malloc");
+
+	uint64_t head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+	uint64_t first = head > count ? head - count : 0;
+	for (uint64_t n = first; n < head; n++)
+		copy[n - first] = ring[n & (records - 1)];
+
+	uint64_t after = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+	uint64_t valid = after + 1 > records ? after + 1 - records : 0;
+	uint64_t skipped = 0;
+
+	for (uint64_t n = first; n < head; n++) {
+		const struct trace_record *r = &copy[n - first];
+
+		if (n < valid || r->seq != (uint32_t)n) {
+			skipped++;
+			continue;
+		}
+		print_record(r);
+	}
+
+	fprintf(stderr, "%lu records written, %lu shown, %lu overwritten while reading\n",
+		(unsigned long)head, (unsigned long)(head - first - skipped), (unsigned long)skipped);
+	return 0;
+}
@@ -0,0 +1,505 @@
+/*
+ * Traffic generator for loading the router on the testbed links: sends a mix
+ * of IPv4 (UDP), ICMP echo and ARP frames at a target rate with sendmmsg(),
+ * to destinations drawn from the prefixes of a routing table, uniformly or
+ * by a Zipf law. The IPv4 and ICMP frames carry their send time, so the
+ * frames the router delivers on the receive links give the delivered rate,
+ * the loss and the latency.
+ *
+ *	tools/trafficgen [-r pps] [-d seconds] [-m ipv4,icmp,arp] [-z exponent]
+ *			 [-l frame_len] [-b batch] [-I interfaces] [-R rx_interface]...
+ *			 interface router_ip rtable
+ *
+ * e.g. from the host side of the links:
+ *
+ *	tools/trafficgen -r 200000 -z 1 -R h-1 -R h-2 h-0 192.168.0.1 rtable0.txt
+ *
+ * Every link answers all the ARP requests, so the router resolves all the
+ * next hops of the table to the generator, and the frames routed back out of
+ * the send link count as delivered too. -I keeps only the routes out of the
+ * first interfaces of the router, for the tables naming more than it has. A
+ * rate of 0 sends as fast as the link takes the frames.
+ */
+#define _GNU_SOURCE
+#include "lib.h"
+#include "protocols.h"
+#include "latency.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <math.h>
+#include <net/if.h>
+#include <poll.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#define TRAFFICGEN_MAGIC 0x5447454e	/* "TGEN" */
+#define TRAFFICGEN_MAX_RX 8
+#define TRAFFICGEN_MAX_BATCH 256
+#define TRAFFICGEN_DESTINATIONS (1 << 20)
+#define TRAFFICGEN_ROUTES 100000
+#define TRAFFICGEN_DRAIN_MS 500
+#define TRAFFICGEN_UDP_PORT 9	/* discard */
+
+enum frame_type { FRAME_IPV4, FRAME_ICMP, FRAME_ARP, FRAME_TYPES };
+
+static const char *type_names[FRAME_TYPES] = { "ipv4", "icmp", "arp" };
+
+/* After the UDP or ICMP header of the generated frames. */
+struct stamp {
+	uint32_t magic;
+	uint32_t id;		/* of the generator, the frames of others are ignored */
+	uint64_t seq;
+	uint64_t sent_ns;
+} __attribute__((packed));
+
+struct link {
+	int s;
+	int ifindex;
+	uint8_t mac[6];
+	const char *name;
+};
+
+static struct link tx, rx[TRAFFICGEN_MAX_RX];
+static int rx_count;
+static uint8_t router_mac[6];
+static uint32_t saddr, router_ip, id;
+
+/* Written by the receiver thread, read once it is done. */
+static struct latency_hist latency;
+static uint64_t delivered[FRAME_TYPES], arp_replies, icmp_errors, arp_answered;
+static volatile int receiving = 1;
+
+static uint32_t rng = 2463534242u;
+
+static uint32_t next_random(void)
+{
+	rng ^= rng << 13;
+	rng ^= rng >> 17;
+	rng ^= rng << 5;
+	return rng;
+}
+
+static void open_link(struct link *link, const char *if_name)
+{
+	struct ifreq ifr;
+	int on = 1;
+
+	link->name = if_name;
+	link->s = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+	DIE(link->s == -1, "socket");
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, if_name, IFNAMSIZ - 1);
+	DIE(ioctl(link->s, SIOCGIFINDEX, &ifr) == -1, "ioctl SIOCGIFINDEX %s", if_name);
+	link->ifindex = ifr.ifr_ifindex;
+	DIE(ioctl(link->s, SIOCGIFHWADDR, &ifr) == -1, "ioctl SIOCGIFHWADDR");
+	memcpy(link->mac, ifr.ifr_hwaddr.sa_data, 6);
+
+	struct sockaddr_ll addr = { .sll_family = AF_PACKET, .sll_ifindex = link->ifindex,
+				    .sll_protocol = htons(ETH_P_ALL) };
+	DIE(bind(link->s, (struct sockaddr *)&addr, sizeof(addr)) == -1, "bind");
+
+	/* Only the frames coming in, not the ones sent. */
+	DIE(setsockopt(link->s, SOL_PACKET, PACKET_IGNORE_OUTGOING, &on, sizeof(on)) == -1,
+	    "PACKET_IGNORE_OUTGOING");
+}
+
+static size_t build_arp(char *frame, const uint8_t *mac, const uint8_t *dmac, uint16_t op,
+			uint32_t spa, const uint8_t *tha, uint32_t tpa)
+{
+	struct ether_header *eth_hdr = (struct ether_header *)frame;
+	struct arp_header *arp_hdr = (struct arp_header *)(eth_hdr + 1);
+
+	memcpy(eth_hdr->ether_dhost, dmac, 6);
+	memcpy(eth_hdr->ether_shost, mac, 6);
+	eth_hdr->ether_type = htons(0x0806);
+
+	arp_hdr->htype = htons(1);
+	arp_hdr->ptype = htons(0x0800);
+	arp_hdr->hlen = 6;
+	arp_hdr->plen = 4;
+	arp_hdr->op = htons(op);
+	memcpy(arp_hdr->sha, mac, 6);
+	arp_hdr->spa = spa;
+	memcpy(arp_hdr->tha, tha, 6);
+	arp_hdr->tpa = tpa;
+
+	/* padded to the Ethernet minimum */
+	memset(arp_hdr + 1, 0, 60 - sizeof(*eth_hdr) - sizeof(*arp_hdr));
+	return 60;
+}
+
+/* Asks the router for its MAC, returns 0 if it never answered. */
+static int resolve_router(void)
+{
+	static const uint8_t broadcast[6] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+	static const uint8_t zero[6];
+	char frame[MAX_PACKET_LEN];
+
+	for (int attempt = 0; attempt < 3; attempt++) {
+		size_t len = build_arp(frame, tx.mac, broadcast, 1, saddr, zero, router_ip);
+		uint64_t start = latency_now_ns();
+
+		DIE(send(tx.s, frame, len, 0) == -1, "send");
+		while (latency_now_ns() - start < 1000000000) {
+			struct pollfd pfd = { .fd = tx.s, .events = POLLIN };
+			struct arp_header *arp_hdr = (struct arp_header *)(frame + sizeof(struct ether_header));
+
+			if (poll(&pfd, 1, 100) <= 0)
+				continue;
+			ssize_t ret = recv(tx.s, frame, sizeof(frame), MSG_DONTWAIT);
+			if (ret >= (ssize_t)(sizeof(struct ether_header) + sizeof(*arp_hdr)) &&
+			    ((struct ether_header *)frame)->ether_type == htons(0x0806) &&
+			    arp_hdr->op == htons(2) && arp_hdr->spa == router_ip) {
+				memcpy(router_mac, arp_hdr->sha, 6);
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+ * Fills destinations with addresses in the prefixes of the table, the prefix
+ * of rank i (in the table's order) drawn with a weight of 1 / (i + 1)^exponent,
+ * uniformly for an exponent of 0, out of the routes through interfaces below
+ * interfaces. Drawn once, so sending only indexes them.
+ */
+static void draw_destinations(const char *path, double exponent, int interfaces, uint32_t *destinations)
+{
+	struct route_table_entry *routes = malloc(sizeof(struct route_table_entry) * TRAFFICGEN_ROUTES);
+	double *cdf = malloc(sizeof(double) * TRAFFICGEN_ROUTES);
+
+	DIE(routes == NULL || cdf == NULL, "malloc");
+	DIE(access(path, R_OK) != 0, "%s", path);
+	int read = read_rtable(path, routes), count = 0;
+
+	for (int i = 0; i < read; i++)
+		if (routes[i].interface < interfaces)
+			routes[count++] = routes[i];
+	DIE(count == 0, "no routes in %s", path);
+
+	double sum = 0;
+	for (int i = 0; i < count; i++) {
+		sum += pow(i + 1, -exponent);
+		cdf[i] = sum;
+	}
+
+	for (int n = 0; n < TRAFFICGEN_DESTINATIONS; n++) {
+		double u = (double)next_random() / UINT32_MAX * sum;
+		int lo = 0, hi = count - 1;
+
+		while (lo < hi) {
+			int mid = (lo + hi) / 2;
+
+			if (cdf[mid] < u)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		/* a host of the prefix, never its network address */
+		destinations[n] = routes[lo].prefix | (htonl(next_random() | 1) & ~routes[lo].mask);
+	}
+
+	free(cdf);
+	free(routes);
+}
+
+/* Builds a frame of the given type and length, stamped with seq and now. */
+static size_t build_frame(char *frame, enum frame_type type, size_t len, uint32_t daddr, uint64_t seq,
+			  uint64_t now)
+{
+	static const uint8_t zero[6];
+	struct ether_header *eth_hdr = (struct ether_header *)frame;
+	struct iphdr *ip_hdr = (struct iphdr *)(eth_hdr + 1);
+	size_t ip_len = len - sizeof(*eth_hdr);
+	struct stamp stamp = { TRAFFICGEN_MAGIC, id, seq, now };
+
+	if (type == FRAME_ARP)
+		return build_arp(frame, tx.mac, router_mac, 1, saddr, zero, router_ip);
+
+	memcpy(eth_hdr->ether_dhost, router_mac, 6);
+	memcpy(eth_hdr->ether_shost, tx.mac, 6);
+	eth_hdr->ether_type = htons(0x0800);
+
+	ip_hdr->version = 4;
+	ip_hdr->ihl = 5;
+	ip_hdr->tos = 0;
+	ip_hdr->tot_len = htons(ip_len);
+	ip_hdr->id = htons(seq);
+	ip_hdr->frag_off = 0;
+	ip_hdr->ttl = 64;
+	ip_hdr->saddr = saddr;
+	ip_hdr->daddr = daddr;
+
+	if (type == FRAME_IPV4) {
+		struct udp_header *udp_hdr = (struct udp_header *)(ip_hdr + 1);
+
+		ip_hdr->protocol = 17;
+		/* spread over the ECMP paths, by flow */
+		udp_hdr->source = htons(1024 + (seq & 0x3fff));
+		udp_hdr->dest = htons(TRAFFICGEN_UDP_PORT);
+		udp_hdr->len = htons(ip_len - sizeof(*ip_hdr));
+		udp_hdr->check = 0;
+		memcpy(udp_hdr + 1, &stamp, sizeof(stamp));
+	} else {
+		struct icmphdr *icmp_hdr = (struct icmphdr *)(ip_hdr + 1);
+
+		ip_hdr->protocol = 1;
+		icmp_hdr->type = 8;
+		icmp_hdr->code = 0;
+		icmp_hdr->un.echo.id = htons(id);
+		icmp_hdr->un.echo.sequence = htons(seq);
+		icmp_hdr->checksum = 0;
+		memcpy(icmp_hdr + 1, &stamp, sizeof(stamp));
+		icmp_hdr->checksum = htons(checksum((uint16_t *)icmp_hdr, ip_len - sizeof(*ip_hdr)));
+	}
+
+	ip_hdr->check = 0;
+	ip_hdr->check = htons(checksum((uint16_t *)ip_hdr, sizeof(*ip_hdr)));
+	return len;
+}
+
+/* Accounts a frame received on a link, answering the ARP requests. */
+static void receive_frame(struct link *link, char *frame, size_t len, uint64_t now)
+{
+	struct ether_header *eth_hdr = (struct ether_header *)frame;
+
+	if (len < sizeof(*eth_hdr))
+		return;
+
+	if (eth_hdr->ether_type == htons(0x0806)) {
+		struct arp_header *arp_hdr = (struct arp_header *)(eth_hdr + 1);
+		char reply[60];
+
+		if (len < sizeof(*eth_hdr) + sizeof(*arp_hdr))
+			return;
+		if (arp_hdr->op == htons(2) && arp_hdr->spa == router_ip) {
+			arp_replies++;
+		} else if (arp_hdr->op == htons(1)) {
+			build_arp(reply, link->mac, arp_hdr->sha, 2, arp_hdr->tpa, arp_hdr->sha, arp_hdr->spa);
+			if (send(link->s, reply, sizeof(reply), 0) != -1)
+				arp_answered++;
+		}
+		return;
+	}
+
+	if (eth_hdr->ether_type != htons(0x0800) || len < sizeof(*eth_hdr) + sizeof(struct iphdr))
+		return;
+
+	struct iphdr *ip_hdr = (struct iphdr *)(eth_hdr + 1);
+	char *l4 = (char *)ip_hdr + ip_hdr->ihl * 4;
+	enum frame_type type;
+
+	if (ip_hdr->protocol == 17) {
+		type = FRAME_IPV4;
+	} else if (ip_hdr->protocol == 1 && ((struct icmphdr *)l4)->type == 8) {
+		type = FRAME_ICMP;
+	} else {
+		if (ip_hdr->protocol == 1 && ip_hdr->daddr == saddr)
+			icmp_errors++;
+		return;
+	}
+
+	/* both headers are 8 bytes */
+	struct stamp *stamp = (struct stamp *)(l4 + 8);
+	if ((char *)(stamp + 1) > frame + len || stamp->magic != TRAFFICGEN_MAGIC || stamp->id != id)
+		return;
+
+	delivered[type]++;
+	if (now >= stamp->sent_ns)
+		latency_record(&latency, now - stamp->sent_ns);
+}
+
+/* Receives on all the links until told to stop. */
+static void *receiver(void *arg)
+{
+	struct pollfd pfds[TRAFFICGEN_MAX_RX + 1];
+	static char frames[TRAFFICGEN_MAX_BATCH][MAX_PACKET_LEN];
+	struct mmsghdr msgs[TRAFFICGEN_MAX_BATCH];
+	struct iovec iovs[TRAFFICGEN_MAX_BATCH];
+
+	for (int i = 0; i < TRAFFICGEN_MAX_BATCH; i++) {
+		iovs[i] = (struct iovec) { frames[i], MAX_PACKET_LEN };
+		memset(&msgs[i], 0, sizeof(msgs[i]));
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	for (int i = 0; i < rx_count; i++)
+		pfds[i] = (struct pollfd) { .fd = rx[i].s, .events = POLLIN };
+	pfds[rx_count] = (struct pollfd) { .fd = tx.s, .events = POLLIN };
+
+	while (receiving) {
+		if (poll(pfds, rx_count + 1, 10) <= 0)
+			continue;
+
+		for (int i = 0; i <= rx_count; i++) {
+			struct link *link = i < rx_count ? &rx[i] : &tx;
+
+			if (!(pfds[i].revents & POLLIN))
+				continue;
+
+			int n = recvmmsg(link->s, msgs, TRAFFICGEN_MAX_BATCH, MSG_DONTWAIT, NULL);
+			uint64_t now = latency_now_ns();
+
+			for (int j = 0; j < n; j++)
+				receive_frame(link, frames[j], msgs[j].msg_len, now);
+		}
+	}
+	return NULL;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-r pps] [-d seconds] [-m ipv4,icmp,arp] [-z exponent] [-l frame_len] "
+		"[-b batch] [-I interfaces] [-R rx_interface]... interface router_ip rtable\n", name);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	uint64_t rate = 100000, seconds = 10;
+	unsigned mix[FRAME_TYPES] = { 90, 8, 2 };
+	double exponent = 0;
+	size_t len = 128;
+	int batch = 64, interfaces = INT32_MAX, opt;
+	const size_t min_len = sizeof(struct ether_header) + sizeof(struct iphdr) + 8 + sizeof(struct stamp);
+
+	while ((opt = getopt(argc, argv, "r:d:m:z:l:b:I:R:")) != -1) {
+		switch (opt) {
+		case 'r':
+			rate = strtoull(optarg, NULL, 10);
+			break;
+		case 'd':
+			seconds = strtoull(optarg, NULL, 10);
+			break;
+		case 'm':
+			if (sscanf(optarg, "%u,%u,%u", &mix[0], &mix[1], &mix[2]) != FRAME_TYPES ||
+			    mix[0] + mix[1] + mix[2] == 0)
+				usage(argv[0]);
+			break;
+		case 'z':
+			exponent = atof(optarg);
+			break;
+		case 'l':
+			len = strtoul(optarg, NULL, 10);
+			break;
+		case 'b':
+			batch = atoi(optarg);
+			break;
+		case 'I':
+			interfaces = atoi(optarg);
+			break;
+		case 'R':
+			DIE(rx_count == TRAFFICGEN_MAX_RX, "at most %d receive links", TRAFFICGEN_MAX_RX);
+			open_link(&rx[rx_count++], optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind != 3 || len < min_len || len > 1514 || batch < 1 || batch > TRAFFICGEN_MAX_BATCH)
+		usage(argv[0]);
+
+	open_link(&tx, argv[optind]);
+	router_ip = inet_addr(argv[optind + 1]);
+	/* the host next to the router on the link, x.y.z.1 sends from x.y.z.2 */
+	saddr = htonl(ntohl(router_ip) + 1);
+	id = getpid();
+	rng ^= id;
+
+	uint32_t *destinations = malloc(sizeof(uint32_t) * TRAFFICGEN_DESTINATIONS);
+	DIE(destinations == NULL, "malloc");
+	draw_destinations(argv[optind + 2], exponent, interfaces, destinations);
+
+	DIE(!resolve_router(), "no ARP reply from %s", argv[optind + 1]);
+
+	pthread_t thread;
+	DIE(pthread_create(&thread, NULL, receiver, NULL) != 0, "pthread_create");
+
+	/* The frames of a batch are rebuilt before each sendmmsg(). */
+	static char frames[TRAFFICGEN_MAX_BATCH][1514];
+	struct mmsghdr msgs[TRAFFICGEN_MAX_BATCH];
+	struct iovec iovs[TRAFFICGEN_MAX_BATCH];
+	memset(msgs, 0, sizeof(msgs));
+	for (int i = 0; i < batch; i++) {
+		iovs[i].iov_base = frames[i];
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	uint64_t sent[FRAME_TYPES] = { 0 }, seq = 0, full = 0;
+	uint32_t total_mix = mix[0] + mix[1] + mix[2];
+	uint64_t start = latency_now_ns(), now = start, duration = seconds * 1000000000;
+
+	while ((now = latency_now_ns()) - start < duration) {
+		int count = batch;
+
+		/* Keep to the rate: send what is due, sleep while nothing is. */
+		if (rate > 0) {
+			uint64_t due = (unsigned __int128)rate * (now - start) / 1000000000;
+
+			if (due <= seq) {
+				uint64_t wait_ns = (seq + 1 - due) * 1000000000 / rate;
+
+				if (wait_ns > 50000) {
+					struct timespec ts = { 0, wait_ns < 1000000 ? wait_ns : 1000000 };
+					nanosleep(&ts, NULL);
+				}
+				continue;
+			}
+			if (due - seq < (uint64_t)count)
+				count = due - seq;
+		}
+
+		enum frame_type types[TRAFFICGEN_MAX_BATCH];
+		for (int i = 0; i < count; i++) {
+			uint32_t pick = next_random() % total_mix;
+
+			types[i] = pick < mix[0] ? FRAME_IPV4 : pick < mix[0] + mix[1] ? FRAME_ICMP : FRAME_ARP;
+			iovs[i].iov_len = build_frame(frames[i], types[i], len,
+						      destinations[next_random() & (TRAFFICGEN_DESTINATIONS - 1)],
+						      seq + i, now);
+		}
+
+		int n = sendmmsg(tx.s, msgs, count, 0);
+		if (n < 0) {
+			/* the link is full, try again */
+			DIE(errno != ENOBUFS && errno != EAGAIN, "sendmmsg");
+			full++;
+			continue;
+		}
+		for (int i = 0; i < n; i++)
+			sent[types[i]]++;
+		seq += n;
+	}
+	double elapsed = (double)(latency_now_ns() - start) / 1e9;
+
+	/* Let the last frames come out of the router. */
+	usleep(TRAFFICGEN_DRAIN_MS * 1000);
+	receiving = 0;
+	pthread_join(thread, NULL);
+
+	uint64_t routed_sent = sent[FRAME_IPV4] + sent[FRAME_ICMP];
+	uint64_t routed_delivered = delivered[FRAME_IPV4] + delivered[FRAME_ICMP];
+
+	printf("sent %lu frames in %.2f s, %.0f pps (%lu times the link was full)\n", seq, elapsed, seq / elapsed, full);
+	for (int t = 0; t < FRAME_TYPES; t++)
+		printf("  %-4s sent %lu", type_names[t], sent[t]);
+	printf("\n");
+	for (int t = 0; t < FRAME_ARP; t++)
+		printf("  %-4s delivered %lu", type_names[t], delivered[t]);
+	printf("\ndelivered %lu, %.0f pps, lost %lu (%.2f%%)\n", routed_delivered, routed_delivered / elapsed,
+	       routed_sent > routed_delivered ? routed_sent - routed_delivered : 0,
+	       routed_sent > 0 && routed_sent > routed_delivered ?
+	       100.0 * (routed_sent - routed_delivered) / routed_sent : 0.0);
+	printf("arp replies %lu of %lu, icmp errors back %lu, arp requests answered %lu\n", arp_replies,
+	       sent[FRAME_ARP], icmp_errors, arp_answered);
+	latency_dump(&latency, "latency", stdout);
+	return 0;
+}
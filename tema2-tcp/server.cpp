@@ -1,20 +1,134 @@
 #include <iostream>
+#include <sstream>
 #include <string>
 #include <unistd.h>
+#include <cerrno>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 #include <algorithm>
+#include <functional>
 #include <cstring>
 
 #include "./structures.h"
 
 using namespace std;
 
+/**
+ * A file descriptor registered with epoll, with the handler called with the
+ * events it is ready for. The epoll events point to it.
+ */
+struct handler {
+    int fd;
+    function<void(uint32_t)> on_events;
+    bool closed = false;
+};
+
+/**
+ * A TCP client. The socket is non-blocking and edge-triggered, so a message
+ * can arrive in pieces: the bytes are gathered in "in" until a whole tcp_msg
+ * has been received. The bytes the socket could not take yet wait in "out",
+ * and are sent when the socket is writable again. A client that lets more
+ * than MAX_QUEUED_MSGS messages pile up there is disconnected.
+ */
+struct connection : handler {
+    // Handle of the client, -1 until it sent its ID.
+    int client = -1;
+    sockaddr_in address;
+    char in[sizeof(struct tcp_msg)];
+    size_t in_length = 0;
+    string out;
+    size_t out_offset = 0;
+};
+
+/**
+ * A client ID seen by the server. It is kept after the client disconnects, with
+ * its subscriptions and the messages of its SF topics.
+ */
+struct client {
+    string id;
+    // Null while the client is offline.
+    connection *conn = nullptr;
+    // Position of the client in the subscribers of each of its topics, by topic handle.
+    unordered_map<int, size_t> subscriptions;
+    // Messages received for the SF topics while the client was offline, and
+    // the ones published while they are sent after it reconnected.
+    vector<struct udp_msg *> waiting_msgs;
+    // Last message sent or stored for the client, so that a message matching
+    // several of its subscriptions reaches it once.
+    uint64_t last_published = 0;
+};
+
+/**
+ * A subscription to a topic, by client handle.
+ */
+struct subscriber {
+    int client;
+    bool sf;
+};
+
+/**
+ * A topic name seen by the server, with its subscribers.
+ */
+struct topic {
+    string name;
+    vector<struct subscriber> subscribers;
+    // Handles of the wildcard topics matching this one, valid while
+    // matches_generation is trie_generation.
+    vector<int> matches;
+    uint64_t matches_generation = 0;
+};
+
+/**
+ * A node of the trie of the wildcard topics, over their '/' separated levels.
+ * A "+" level matches exactly one level, a "*" level any number of levels,
+ * none included, so consecutive "*" levels share a single node.
+ */
+struct trie_node {
+    unordered_map<string, int> children;
+    // Handles of the wildcard topics ending at this node, e.g. "a/*" and "a/*/*".
+    vector<int> topics;
+};
+
+// Epoll instance of the server.
+static int epoll_fd;
+
+// Connected clients, by socket.
+static unordered_map<int, connection *> connections;
+
+// Clients closed while handling the current events, freed once all were handled.
+static vector<connection *> closed_connections;
+
+// Client IDs and topic names are interned into handles, their index in these
+// vectors, when first seen. Publishing hashes the topic name once, then only
+// follows handles.
+static vector<struct client> clients;
+static unordered_map<string, int> client_handles;
+static vector<struct topic> topics;
+static unordered_map<string, int> topic_handles;
+
+// Nodes of the trie of the wildcard topics, the root first. Matching a topic
+// walks its levels, so it costs the same for any number of subscriptions, and
+// its result is cached in the topic until a wildcard topic is added.
+static vector<struct trie_node> trie(1);
+static uint64_t trie_generation;
+
+// Topics nobody subscribed to, interned by publishing to cache their matches.
+// At most MAX_CACHED_TOPICS, the matches of the others are not cached.
+static int cached_topics;
+
+// Number of messages published.
+static uint64_t published;
+
+static bool loop = true;
+
 string lowercase(string str) {
 
     // Iterate all characters, transform all to lowercase.
@@ -24,478 +138,802 @@ string lowercase(string str) {
     return str;
 }
 
-int main(int argc, char *argv[]) {
+void watch(handler *h, uint32_t events) {
 
-    // Handle error if no arguments were passed.
-    if (argc != 2) {
-        cerr << "Usage: " << argv[0] << " server_port" << endl;
-        exit(0);
+    struct epoll_event event{};
+    event.events = events;
+    event.data.ptr = h;
+
+    int rc = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, h->fd, &event);
+    DIE(rc < 0, "epoll_ctl");
+}
+
+/**
+ * Close a client's connection. If the client had sent its ID, it is marked
+ * offline, its subscriptions are kept.
+ */
+void close_connection(connection *conn) {
+
+    if (conn->closed) {
+        return;
     }
 
-    int rc, flag;
+    if (conn->client >= 0) {
 
-    // Disable buffering.
-    setvbuf(stdout, nullptr, _IONBF, BUFSIZ);
+        // Client has disconnected.
+        cout << "Client " << clients[conn->client].id << " disconnected." << endl;
+        clients[conn->client].conn = nullptr;
+    }
 
-    // Convert port number to int.
-    int port = stoi(argv[1]);
-    DIE(port == 0, "port");
+    // Closing the socket also removes it from the epoll instance.
+    connections.erase(conn->fd);
+    close(conn->fd);
 
-    // Set up UDP socket.
-    int udp_socket = socket(AF_INET, SOCK_DGRAM, 0);
-    DIE(udp_socket < 0, "udp socket");
+    // Events for the connection may follow in the same batch, free it later.
+    conn->closed = true;
+    closed_connections.push_back(conn);
+}
 
-    // Fill the details on what destination port should the
-    // datagrams have to be sent to our process.
-    auto *udp_addr = new sockaddr_in;
-    memset((char *) udp_addr, 0, sizeof(struct sockaddr_in));
+/**
+ * Send as much of the queued bytes as the socket takes now.
+ */
+void flush_connection(connection *conn) {
 
-    // Populate the fields.
-    udp_addr->sin_family = AF_INET;
-    udp_addr->sin_addr.s_addr = INADDR_ANY;
-    udp_addr->sin_port = htons(port);
+    while (conn->out_offset < conn->out.size()) {
 
-    // Bind the socket with the address.
-    rc = bind(udp_socket, (const struct sockaddr *) udp_addr, sizeof(struct sockaddr_in));
-    DIE(rc < 0, "udp bind");
+        auto rc = send(conn->fd, conn->out.data() + conn->out_offset,
+                       conn->out.size() - conn->out_offset, MSG_NOSIGNAL);
 
-    // Set up TCP socket.
-    int tcp_socket = socket(AF_INET, SOCK_STREAM, 0);
-    DIE(tcp_socket < 0, "tcp socket");
+        if (rc < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // The rest is sent on EPOLLOUT, drop what was sent already.
+                conn->out.erase(0, conn->out_offset);
+                conn->out_offset = 0;
+                return;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
 
-    // Fill the details on what destination port should the
-    // datagrams have to be sent to our process.
-    auto *tcp_addr = new sockaddr_in;
-    memset((char *) tcp_addr, 0, sizeof(struct sockaddr_in));
+            // The client went away, its socket reports it as readable too.
+            DIE(errno != EPIPE && errno != ECONNRESET, "tcp send");
+            close_connection(conn);
+            return;
+        }
 
-    // Populate the fields.
-    tcp_addr->sin_family = AF_INET;
-    tcp_addr->sin_addr.s_addr = INADDR_ANY;
-    tcp_addr->sin_port = htons(port);
+        conn->out_offset += rc;
+    }
 
-    // Bind the socket with the address.
-    rc = bind(tcp_socket, (struct sockaddr *)tcp_addr, sizeof(struct sockaddr));
-    DIE(rc < 0, "tcp bind");
+    conn->out.clear();
+    conn->out_offset = 0;
+}
 
-    rc = listen(tcp_socket, MAX_CLIENTS);
-    DIE(rc < 0, "listen");
+/**
+ * Send data to a client, after the bytes already waiting for its socket.
+ */
+void send_to_connection(connection *conn, const void *data, size_t length) {
 
-    // Disable Nagle's algorithm.
-    flag = 1;
-    rc = setsockopt(tcp_socket, IPPROTO_TCP, TCP_NODELAY, (const void*) &flag, sizeof(int));
-    DIE(rc < 0, "nagle");
+    if (conn->closed) {
+        return;
+    }
 
-    // Set file descriptors.
-    fd_set read_fds;
-    FD_ZERO(&read_fds);
-    FD_SET(0, &read_fds);
+    // The client does not read, stop queueing messages for it.
+    if (conn->out.size() + length > MAX_QUEUED_MSGS * sizeof(struct tcp_msg)) {
+        close_connection(conn);
+        return;
+    }
 
-    fd_set temp_fds;
-    FD_ZERO(&temp_fds);
+    conn->out.append((const char *) data, length);
 
-    FD_SET(udp_socket, &read_fds);
-    FD_SET(tcp_socket, &read_fds);
+    // Nothing was waiting before, try to send right away.
+    if (conn->out.size() == length) {
+        flush_connection(conn);
+    }
+}
 
-    // Calculate the maximum file descriptor value.
-    int max_fd = max(udp_socket, tcp_socket);
+/**
+ * Handle of a topic name, interned if it is new.
+ */
+int topic_handle(const string &name) {
 
-    // Unordered map linking client ID and socket.
-    unordered_map<string, int> id_socket;
+    auto handle = topic_handles.find(name);
+    if (handle != topic_handles.end()) {
+        return handle->second;
+    }
 
-    // Unordered map linking socket and client ID.
-    unordered_map<int, string> socket_id;
+    topics.push_back({name, {}, {}, 0});
+    topic_handles[name] = (int) topics.size() - 1;
+    return (int) topics.size() - 1;
+}
 
-    // Unordered map linking topic with subscribed clients.
-    unordered_map<string, vector<string>> topic_clients;
+vector<string> split_levels(const string &name) {
 
-    // Unordered map linking clients with the SF topics.
-    unordered_map<string, vector<string>> sf_client_topics;
+    vector<string> levels;
+    size_t start = 0, end;
 
-    // Unordered map working as a message queue for every client
-    // that has at least 1 SF enabled topic.
-    unordered_map<string, vector<struct udp_msg *>> client_waiting_msgs;
+    while ((end = name.find('/', start)) != string::npos) {
+        levels.push_back(name.substr(start, end - start));
+        start = end + 1;
+    }
+    levels.push_back(name.substr(start));
+    return levels;
+}
 
-    // Setup complete, start the infinite loop.
-    bool loop = true;
+/**
+ * Add a topic to the trie if it has wildcard levels. Does nothing for the
+ * topics already added.
+ */
+void add_wildcard_topic(int topic) {
 
-    while (loop) {
+    auto levels = split_levels(topics[topic].name);
+    if (find(levels.begin(), levels.end(), "+") == levels.end() &&
+        find(levels.begin(), levels.end(), "*") == levels.end()) {
+        return;
+    }
+
+    int node = 0;
+    for (size_t i = 0; i < levels.size(); i++) {
+
+        auto &level = levels[i];
+
+        // "*/*" matches the same topics as "*".
+        if (level == "*" && i > 0 && levels[i - 1] == "*") {
+            continue;
+        }
+
+        auto child = trie[node].children.find(level);
+        if (child == trie[node].children.end()) {
+            trie.emplace_back();
+            child = trie[node].children.emplace(level, (int) trie.size() - 1).first;
+        }
+        node = child->second;
+    }
+
+    auto &node_topics = trie[node].topics;
+    if (find(node_topics.begin(), node_topics.end(), topic) == node_topics.end()) {
+        node_topics.push_back(topic);
+
+        // The cached matches may miss the new topic.
+        trie_generation++;
+    }
+}
+
+/**
+ * Collect the wildcard topics matching levels, from the given level and node on.
+ * The "*" levels reach the same node and level through many paths, each pair
+ * in visited is expanded only once.
+ */
+void match_levels(const vector<string> &levels, size_t level, int node, vector<int> &matches,
+                  unordered_set<size_t> &visited) {
+
+    if (!visited.insert((size_t) node * (levels.size() + 1) + level).second) {
+        return;
+    }
+
+    auto &n = trie[node];
+
+    if (level == levels.size()) {
+        matches.insert(matches.end(), n.topics.begin(), n.topics.end());
+    }
+    else {
+
+        // The same level, or any single level.
+        auto child = n.children.find(levels[level]);
+        if (child != n.children.end()) {
+            match_levels(levels, level + 1, child->second, matches, visited);
+        }
+
+        child = n.children.find("+");
+        if (child != n.children.end()) {
+            match_levels(levels, level + 1, child->second, matches, visited);
+        }
+    }
+
+    // Any number of levels, the rest of the topic included.
+    auto child = n.children.find("*");
+    if (child != n.children.end()) {
+        for (size_t next = level; next <= levels.size(); next++) {
+            match_levels(levels, next, child->second, matches, visited);
+        }
+    }
+}
+
+/**
+ * The wildcard topics matching a topic name, into matches.
+ */
+void collect_matches(const string &name, vector<int> &matches) {
+
+    // A node is visited once at the last level, so no topic is added twice.
+    unordered_set<size_t> visited;
+    matches.clear();
+    match_levels(split_levels(name), 0, 0, matches, visited);
+}
+
+/**
+ * The wildcard topics matching a topic, from its cache when still valid.
+ */
+const vector<int> &topic_matches(int topic) {
+
+    auto &t = topics[topic];
+
+    if (t.matches_generation != trie_generation) {
+        collect_matches(t.name, t.matches);
+        t.matches_generation = trie_generation;
+    }
+
+    return t.matches;
+}
+
+/**
+ * Subscribe a client to a topic, or update the SF flag of its subscription.
+ */
+void subscribe(int client_handle, int topic, bool sf) {
+
+    auto &c = clients[client_handle];
+    auto &subscribers = topics[topic].subscribers;
+
+    auto position = c.subscriptions.find(topic);
+    if (position != c.subscriptions.end()) {
+        subscribers[position->second].sf = sf;
+        return;
+    }
+
+    c.subscriptions[topic] = subscribers.size();
+    subscribers.push_back({client_handle, sf});
+}
+
+/**
+ * Unsubscribe a client from a topic, if it is subscribed.
+ */
+void unsubscribe(int client_handle, int topic) {
+
+    auto &c = clients[client_handle];
+    auto &subscribers = topics[topic].subscribers;
+
+    auto position = c.subscriptions.find(topic);
+    if (position == c.subscriptions.end()) {
+        return;
+    }
+
+    // Move the last subscriber in the freed slot.
+    subscribers[position->second] = subscribers.back();
+    clients[subscribers[position->second].client].subscriptions[topic] = position->second;
+    subscribers.pop_back();
+
+    c.subscriptions.erase(position);
+}
+
+/**
+ * Send the messages stored for a client, in order. They only fill half of the
+ * output queue of its connection, so a long backlog does not get the client
+ * disconnected, and the rest is sent on EPOLLOUT. The messages published in
+ * the meantime are stored after them.
+ */
+void send_waiting_msgs(struct client &c) {
+
+    auto *conn = c.conn;
+    size_t sent = 0;
+
+    while (sent < c.waiting_msgs.size() &&
+           conn->out.size() + sizeof(struct tcp_msg) <= MAX_QUEUED_MSGS / 2 * sizeof(struct tcp_msg)) {
+
+        // Create a new TCP message.
+        struct tcp_msg new_tcp_msg{};
+        memset(&new_tcp_msg, 0, sizeof(struct tcp_msg));
+
+        // Set type 1, copy the UDP message in the data field of the TCP message.
+        new_tcp_msg.type = 1;
+        memcpy(new_tcp_msg.data, c.waiting_msgs[sent], sizeof(struct udp_msg));
+
+        // Send to the client, keep the message if it went away.
+        send_to_connection(conn, &new_tcp_msg, sizeof(struct tcp_msg));
+        if (conn->closed) {
+            break;
+        }
+
+        delete c.waiting_msgs[sent];
+        sent++;
+    }
+
+    c.waiting_msgs.erase(c.waiting_msgs.begin(), c.waiting_msgs.begin() + sent);
+}
 
-        temp_fds = read_fds;
+/**
+ * Handle a client's first message, carrying its ID.
+ */
+void handle_connect(connection *conn, struct tcp_msg *client_tcp_msg) {
 
-        // Monitor all file descriptors in range (0, max_fd).
-        rc = select(max_fd + 1, &temp_fds, nullptr, nullptr, nullptr);
-        DIE(rc < 0, "select");
+    // This will take all characters until first '\0', representing the client's ID.
+    client_tcp_msg->data[MAX_CLIENT_ID_LENGTH] = '\0';
+    string client_tcp_id = client_tcp_msg->data;
 
-        // Iterate all file descriptors and handle those which are ready for reading.
-        for (int i = 0; i <= max_fd; i++) {
+    // Check if a client with the same ID is already connected.
+    auto handle = client_handles.find(client_tcp_id);
+    if (handle != client_handles.end() && clients[handle->second].conn != nullptr) {
 
-            // Check if file descriptor "i" is ready for reading.
-            if (FD_ISSET(i, &temp_fds) == true) {
+        // Close the connection.
+        close_connection(conn);
 
-                // Handle messages coming on the UDP socket.
-                if (i == udp_socket) {
+        // Output an error message.
+        cout << "Client " << client_tcp_id << " already connected." << endl;
+        return;
+    }
 
-                    // Prepare to store the message.
-                    char buf[MAX_UDP_MSG_SIZE];
-                    memset(buf, 0, sizeof(buf));
+    // A client that was connected before with the same ID keeps its handle and subscriptions.
+    if (handle == client_handles.end()) {
+        clients.push_back({client_tcp_id, nullptr, {}, {}});
+        handle = client_handles.emplace(client_tcp_id, (int) clients.size() - 1).first;
+    }
 
-                    auto *udp_client = new sockaddr_in;
-                    socklen_t udp_len = sizeof(struct sockaddr_in);
+    auto &c = clients[handle->second];
+    c.conn = conn;
+    conn->client = handle->second;
 
-                    // Receive the message from the UDP socket.
-                    rc = (int) recvfrom(udp_socket, buf, sizeof(buf), 0, (struct sockaddr *) udp_client, &udp_len);
-                    DIE(rc < 0, "udp receive");
+    // Print the "new client connected" message.
+    auto *string_address = inet_ntoa(conn->address.sin_addr);
+    auto string_port = ntohs(conn->address.sin_port);
 
-                    // Create a new TCP message.
-                    auto *new_tcp_msg = new tcp_msg;
-                    memset(new_tcp_msg, 0, sizeof(struct tcp_msg));
+    cout << "New client " << client_tcp_id << " connected from " <<
+         string_address << ":" << string_port << endl;
 
-                    // Set type 1, copy the UDP message in the data field of the TCP message.
-                    new_tcp_msg->type = 1;
-                    memcpy(new_tcp_msg->data, buf, sizeof(struct udp_msg));
+    // Send the messages of the SF topics received while the client was offline.
+    send_waiting_msgs(c);
+}
 
-                    // Get the topic name.
-                    char *topic_name = new char[MAX_TOPIC_NAME_LENGTH];
-                    memset(topic_name, 0, MAX_TOPIC_NAME_LENGTH);
-                    memcpy(topic_name, (struct udp_msg *) buf, MAX_TOPIC_NAME_LENGTH-1);
+/**
+ * Handle subscribe/unsubscribe requests from the clients.
+ */
+void handle_subscribe(connection *conn, struct tcp_msg *client_tcp_msg) {
 
-                    // If no clients are subscribed to the topic, continue.
-                    if (topic_clients.find(topic_name) == topic_clients.end()){
-                        continue;
-                    }
+    if (client_tcp_msg->type != 1) {
+        return;
+    }
 
-                    // Get the subscribed clients.
-                    vector<string> subscribed_clients = topic_clients[topic_name];
+    int flag;
 
-                    // Iterate all subscribed clients.
-                    for (auto client : subscribed_clients) {
+    // Copy the subscribe/unsubscribe message.
+    struct subscribe_msg sub_msg{};
+    memcpy(&sub_msg, client_tcp_msg->data, sizeof(struct subscribe_msg));
+    sub_msg.topic[MAX_TOPIC_NAME_LENGTH - 1] = '\0';
 
-                        // Get the client's socket.
-                        int client_socket = id_socket[client];
+    // Type is 0, client wants to unsubscribe.
+    if (sub_msg.type == 0) {
 
-                        // If the socket of the client is -1, the client was previously connected.
-                        if (id_socket[client] == -1) {
+        // A topic never subscribed to has no subscribers.
+        auto topic = topic_handles.find(sub_msg.topic);
+        if (topic != topic_handles.end()) {
+            unsubscribe(conn->client, topic->second);
+        }
 
-                            // Check if client has any SF subscriptions.
-                            if (sf_client_topics.find(client) != sf_client_topics.end()) {
+        // Send unsubscribe success to the client.
+        flag = 0;
+        send_to_connection(conn, &flag, 1);
+    }
 
-                                auto sf_topics = sf_client_topics[client];
+    // Type is 1, client wants to subscribe.
+    if (sub_msg.type == 1) {
 
-                                // Client already has some SF enabled topics. Check if the current topic
-                                // is contained.
-                                if (find(sf_topics.begin(), sf_topics.end(), topic_name) != sf_topics.end()) {
+        // Add the client to the subscribers of the topic, with the last SF flag it asked for.
+        int topic = topic_handle(sub_msg.topic);
+        add_wildcard_topic(topic);
+        subscribe(conn->client, topic, sub_msg.sf == SF_ENABLED);
 
-                                    // Client is offline but has enabled SF for this topic, add the message
-                                    // to the waiting list.
-                                    auto *new_waiting_msg = new udp_msg;
-                                    memset(new_waiting_msg, 0, sizeof(struct udp_msg));
-                                    memcpy(new_waiting_msg, buf, sizeof(struct udp_msg));
+        // Send subscribe success to client.
+        flag = 1;
+        send_to_connection(conn, &flag, 1);
+    }
+}
 
-                                    // Check if client has other waiting messages.
-                                    if (client_waiting_msgs.find(client) != client_waiting_msgs.end()) {
+/**
+ * Read everything a client sent, handling every whole message. Edge-triggered,
+ * so the socket is read until it would block.
+ */
+void handle_client(connection *conn, uint32_t events) {
+
+    // Send what was waiting for the socket to be writable, then more of the
+    // stored messages.
+    if (events & EPOLLOUT) {
+        flush_connection(conn);
+        if (!conn->closed && conn->client >= 0 && !clients[conn->client].waiting_msgs.empty()) {
+            send_waiting_msgs(clients[conn->client]);
+        }
+    }
 
-                                        // Get the list of messages.
-                                        auto waiting_msgs = client_waiting_msgs[client];
-                                        // Add the new message to the list.
-                                        waiting_msgs.push_back(new_waiting_msg);
-                                        // Update the list.
-                                        client_waiting_msgs[client] = waiting_msgs;
+    if (!(events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+        return;
+    }
 
-                                    }
-                                    else {
+    while (!conn->closed) {
 
-                                        // Client doesn't have any other waiting messages.
-                                        vector<struct udp_msg *> waiting_msgs;
-                                        // Add the new message to the list.
-                                        waiting_msgs.push_back(new_waiting_msg);
-                                        // Update the list.
-                                        client_waiting_msgs[client] = waiting_msgs;
-                                    }
-                                }
+        // Receive the rest of the current message.
+        auto rc = recv(conn->fd, conn->in + conn->in_length, sizeof(struct tcp_msg) - conn->in_length, 0);
 
-                                continue;
-                            }
+        if (rc < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            DIE(errno != ECONNRESET, "tcp receive");
+            rc = 0;
+        }
 
-                        }
+        if (rc == 0) {
+            close_connection(conn);
+            return;
+        }
 
-                        if (client_socket >= 0) {
-                            // Send.
-                            rc = (int) send(client_socket, new_tcp_msg, sizeof(struct tcp_msg), 0);
-                            DIE(rc < 0, "tcp send");
-                        }
-                    }
+        conn->in_length += rc;
+        if (conn->in_length < sizeof(struct tcp_msg)) {
+            continue;
+        }
+        conn->in_length = 0;
+
+        // The first message carries the client's ID.
+        auto *client_tcp_msg = (struct tcp_msg *) conn->in;
+        if (conn->client < 0) {
+            handle_connect(conn, client_tcp_msg);
+        } else {
+            handle_subscribe(conn, client_tcp_msg);
+        }
+    }
+}
 
-                    break;
-                }
+/**
+ * Accept all the pending connections. Their IDs are read when they arrive.
+ */
+void handle_listen(int tcp_socket) {
 
-                // Handle messages coming on the TCP socket.
-                if (i == tcp_socket) {
+    while (true) {
 
-                    // Disable Nagle's algorithm.
-                    flag = 1;
-                    rc = setsockopt(tcp_socket, IPPROTO_TCP, TCP_NODELAY, (char *) &flag, sizeof(int));
-                    DIE(rc < 0, "nagle");
+        // Get the client's address.
+        sockaddr_in client_address{};
+        socklen_t client_length = sizeof(struct sockaddr_in);
 
-                    // Get the client's address.
-                    auto *client_address = new sockaddr_in;
-                    socklen_t client_length = sizeof(struct sockaddr_in);
+        // Accept the new TCP connection and assign the file descriptor to new_client.
+        int new_client = accept4(tcp_socket, (struct sockaddr *) &client_address, &client_length, SOCK_NONBLOCK);
+        if (new_client < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;
+            }
 
-                    // Accept the new TCP connection and assign the file descriptor to new_client.
-                    int new_client = accept(tcp_socket, (struct sockaddr *) client_address, &client_length);
-                    DIE(new_client < 0, "accept");
+            // The connection was reset before being accepted, or the server
+            // is out of descriptors for now: try again on the next event.
+            if (errno == ECONNABORTED || errno == EINTR) {
+                continue;
+            }
+            DIE(errno != EMFILE && errno != ENFILE, "accept");
+            cerr << "accept: out of file descriptors" << endl;
+            return;
+        }
 
-                    // Allocate memory.
-                    auto *client_tcp_msg = new tcp_msg;
-                    memset(client_tcp_msg, 0, sizeof(tcp_msg));
+        // Disable Nagle's algorithm.
+        int flag = 1;
+        int rc = setsockopt(new_client, IPPROTO_TCP, TCP_NODELAY, (char *) &flag, sizeof(int));
+        DIE(rc < 0, "nagle");
 
-                    // Get the actual message's data.
-                    rc = (int) recv(new_client, client_tcp_msg, sizeof(tcp_msg), 0);
-                    DIE(rc < 0, "tcp receive");
+        auto *conn = new connection;
+        conn->fd = new_client;
+        conn->address = client_address;
+        conn->on_events = [conn](uint32_t events) { handle_client(conn, events); };
+        connections[new_client] = conn;
 
-                    // This will take all characters until first '\0', representing the client's ID.
-                    auto *client_tcp_id = (char *) client_tcp_msg->data;
+        watch(conn, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET);
+    }
+}
 
-                    // Check if a client with the same ID is already connected.
-                    if (id_socket.find(client_tcp_id) != id_socket.end() && id_socket[client_tcp_id] != -1) {
+/**
+ * Send a message to the subscribers that did not get it yet, or store it for
+ * the offline ones subscribed with SF.
+ */
+void deliver(const vector<struct subscriber> &subscribers, struct tcp_msg *new_tcp_msg, char *buf) {
 
-                        // Close the connection.
-                        close(new_client);
+    // Iterate all subscribed clients.
+    for (auto &subscriber : subscribers) {
 
-                        // Output an error message.
-                        cout << "Client " << client_tcp_id << " already connected." << endl;
-                        continue;
-                    }
+        auto &c = clients[subscriber.client];
 
-                    // This checks if an entry in the id_socket map already exists from a previous
-                    // client that was connected with the same ID. When the previous client disconnected,
-                    // its id_socket entry was set to -1, not deleted entirely.
-                    if (id_socket.find(client_tcp_id) == id_socket.end()) {
+        // The client already got the message through another subscription.
+        if (c.last_published == published) {
+            continue;
+        }
 
-                        // If there wasn't a previous client that had this ID, create a new entry in the map.
-                        id_socket.insert(make_pair(client_tcp_id, new_client));
-                        socket_id.insert(make_pair(new_client, client_tcp_id));
-                    }
-                    else {
+        // Send, unless the stored messages are still being sent before it.
+        if (c.conn != nullptr && c.waiting_msgs.empty()) {
+            send_to_connection(c.conn, new_tcp_msg, sizeof(struct tcp_msg));
+            if (c.conn != nullptr) {
+                c.last_published = published;
+                continue;
+            }
 
-                        // There was a previous client using this ID.
-                        id_socket[client_tcp_id] = new_client;
-                        socket_id.insert(make_pair(new_client, client_tcp_id));
-                    }
+            // The client fell too far behind and was disconnected, it is
+            // offline now.
+        }
+
+        if (c.conn != nullptr || subscriber.sf) {
+
+            // Client is offline but has enabled SF for this topic, or still gets
+            // its stored messages, add the message to the waiting list.
+            auto *new_waiting_msg = new udp_msg;
+            memcpy(new_waiting_msg, buf, sizeof(struct udp_msg));
+            c.waiting_msgs.push_back(new_waiting_msg);
+            c.last_published = published;
+        }
+    }
+}
 
+/**
+ * Forward a message received on the UDP socket to the subscribers of its topic
+ * and of the wildcard topics matching it.
+ */
+void handle_udp_message(char *buf) {
+
+    // Get the topic name. The string is reused, so looking the topic up
+    // allocates nothing.
+    static string topic_name;
+    auto *udp_message = (struct udp_msg *) buf;
+    topic_name.assign(udp_message->topic, strnlen(udp_message->topic, MAX_TOPIC_NAME_LENGTH - 1));
+
+    // Matches of a topic that is not interned.
+    static vector<int> uncached_matches;
+    static const vector<struct subscriber> no_subscribers;
+
+    const vector<int> *matches = &uncached_matches;
+    const vector<struct subscriber> *subscribers = &no_subscribers;
+
+    auto topic = topic_handles.find(topic_name);
+    if (topic != topic_handles.end()) {
+        matches = &topic_matches(topic->second);
+        subscribers = &topics[topic->second].subscribers;
+    }
+    else {
 
-                    // Update the set of file descriptors.
-                    FD_SET(new_client, &read_fds);
+        // A topic nobody subscribed to is interned, to cache its matches,
+        // only if wildcard topics match it and there is room, so publishing
+        // random topic names cannot grow the server's memory.
+        if (trie_generation == 0) {
+            return;
+        }
+        collect_matches(topic_name, uncached_matches);
+        if (uncached_matches.empty()) {
+            return;
+        }
 
-                    // Update the max file descriptor value.
-                    max_fd = max(new_client, max_fd);
+        if (cached_topics < MAX_CACHED_TOPICS) {
+            int handle = topic_handle(topic_name);
+            cached_topics++;
 
-                    // Print the "new client connected" message.
-                    auto *string_address = inet_ntoa(client_address->sin_addr);
-                    auto string_port = ntohs(client_address->sin_port);
+            topics[handle].matches = uncached_matches;
+            topics[handle].matches_generation = trie_generation;
+            matches = &topics[handle].matches;
+        }
+    }
 
-                    cout << "New client " << client_tcp_id << " connected from " <<
-                         string_address << ":" << string_port << endl;
+    if (subscribers->empty() && matches->empty()) {
+        return;
+    }
 
-                    // Check if the new client has any SF enabled topics.
-                    if (client_waiting_msgs.find(client_tcp_id) != client_waiting_msgs.end()) {
+    // Create a new TCP message.
+    struct tcp_msg new_tcp_msg{};
+    memset(&new_tcp_msg, 0, sizeof(struct tcp_msg));
 
-                        // Client has some sf enabled topics, send the waiting messages.
-                        for (auto message : client_waiting_msgs[client_tcp_id]) {
+    // Set type 1, copy the UDP message in the data field of the TCP message.
+    new_tcp_msg.type = 1;
+    memcpy(new_tcp_msg.data, buf, sizeof(struct udp_msg));
 
-                            // Create a new TCP message.
-                            auto *new_tcp_msg = new tcp_msg;
-                            memset(new_tcp_msg, 0, sizeof(struct tcp_msg));
+    published++;
+    deliver(*subscribers, &new_tcp_msg, buf);
+    for (int match : *matches) {
+        deliver(topics[match].subscribers, &new_tcp_msg, buf);
+    }
+}
 
-                            // Set type 1, copy the UDP message in the data field of the TCP message.
-                            new_tcp_msg->type = 1;
-                            memcpy(new_tcp_msg->data, message, sizeof(struct udp_msg));
+/**
+ * Receive all the datagrams waiting on the UDP socket.
+ */
+void handle_udp(int udp_socket) {
 
-                            // Send to the client.
-                            rc = (int) send(id_socket[client_tcp_id], new_tcp_msg, sizeof(struct tcp_msg), 0);
-                            DIE(rc < 0, "sf send");
-                        }
+    while (true) {
 
-                        // All waiting messages for this client have been sent, delete its entry
-                        // in the waiting list.
-                        client_waiting_msgs.erase(client_tcp_id);
-                    }
+        // Prepare to store the message.
+        char buf[MAX_UDP_MSG_SIZE];
+        memset(buf, 0, sizeof(buf));
 
-                    continue;
-                }
+        sockaddr_in udp_client{};
+        socklen_t udp_len = sizeof(struct sockaddr_in);
 
-                // Handle commands coming on stdin.
-                if (i == STDIN_FILENO) {
+        // Receive the message from the UDP socket.
+        auto rc = recvfrom(udp_socket, buf, sizeof(buf), 0, (struct sockaddr *) &udp_client, &udp_len);
+        if (rc < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;
+            }
+            DIE(errno != EINTR, "udp receive");
+            continue;
+        }
 
-                    // Read the command.
-                    string command;
-                    cin >> command;
+        handle_udp_message(buf);
+    }
+}
 
-                    // Convert all character to lowercase.
-                    command = lowercase(command);
+/**
+ * Handle commands coming on stdin. Only whole lines are handled, the rest
+ * waits for the next read.
+ */
+void handle_stdin(handler *h) {
 
-                    // Exit command was entered.
-                    if (command == "exit") {
+    static string pending;
+    char buf[256];
 
-                        // Close all connected clients.
-                        for (int j = 1; j <= max_fd; j++) {
+    auto rc = read(STDIN_FILENO, buf, sizeof(buf));
+    if (rc <= 0) {
+        // Stdin was closed, stop watching it.
+        if (rc == 0) {
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, h->fd, nullptr);
+        }
+        return;
+    }
+    pending.append(buf, rc);
 
-                            if (FD_ISSET(j, &read_fds) && j != tcp_socket && j != udp_socket) {
-                                // Remove the "j" file descriptor from the list.
-                                FD_CLR(j, &read_fds);
-                                // Close the connection.
-                                close(j);
-                            }
-                        }
+    size_t end;
+    while ((end = pending.find('\n')) != string::npos) {
 
-                        // Stop the while loop.
-                        loop = false;
-                        break;
-                    }
+        // Read the command.
+        string command;
+        istringstream(pending.substr(0, end)) >> command;
+        pending.erase(0, end + 1);
 
-                    continue;
-                }
+        // Convert all character to lowercase.
+        command = lowercase(command);
 
-                // Handle client disconnects.
+        // Exit command was entered.
+        if (command == "exit") {
 
-                // Allocate memory for the tcp message.
-                auto *client_tcp_msg = new tcp_msg;
-                memset(client_tcp_msg, 0, sizeof(struct tcp_msg));
+            // Close all connected clients.
+            vector<connection *> open_connections;
+            for (auto &entry : connections) {
+                open_connections.push_back(entry.second);
+            }
+            for (auto conn : open_connections) {
+                // Closed without the "disconnected" message.
+                conn->client = -1;
+                close_connection(conn);
+            }
 
-                // Receive the data.
-                rc = (int) recv(i, client_tcp_msg, sizeof(tcp_msg), 0);
-                DIE(rc < 0, "tcp receive");
+            // Stop the loop.
+            loop = false;
+            return;
+        }
+    }
+}
 
-                if (rc == 0) {
+int main(int argc, char *argv[]) {
 
-                    // Client has disconnected.
-                    cout << "Client " << socket_id[i] << " disconnected." << endl;
+    // Handle error if no arguments were passed.
+    if (argc != 2) {
+        cerr << "Usage: " << argv[0] << " server_port" << endl;
+        exit(0);
+    }
 
-                    // Remove the client from the maps. Set the id_socket entry to -1
-                    // to mark what clients were previously connected.
-                    id_socket[socket_id[i]] = -1;
-                    socket_id.erase(i);
+    int rc, flag;
 
-                    // Remove the client's file descriptor from the file descriptor sets.
-                    FD_CLR(i, &read_fds);
-                    FD_CLR(i, &temp_fds);
+    // Disable buffering.
+    setvbuf(stdout, nullptr, _IONBF, BUFSIZ);
 
-                    // Close the connection.
-                    close(i);
-                    continue;
-                }
-
-                // Handle subscribe/unsubscribe requests from the clients.
-                if (client_tcp_msg->type != 1) {
-                    continue;
-                }
-
-                // Allocate memory for the subscribe/unsubscribe message.
-                auto *sub_msg = new subscribe_msg;
-                memset(sub_msg, 0, sizeof(struct subscribe_msg));
-
-                // Copy the data.
-                memcpy(sub_msg, client_tcp_msg->data, sizeof(struct subscribe_msg));
-
-
-                // Type is 0, client wants to unsubscribe.
-                if (sub_msg->type == 0) {
-
-                    // Check if the topic has any subscribers.
-                    if (topic_clients.find(sub_msg->topic) != topic_clients.end()) {
-
-                        // Get the subscribed clients to the topic.
-                        auto subscribers = topic_clients[sub_msg->topic];
-
-                        // Find the client's ID in the subscribers vector.
-                        auto client_id = find(subscribers.begin(), subscribers.end(), socket_id[i]);
-
-                        // If the client can be found in the list of subscribers.
-                        if (client_id != subscribers.end()) {
-                            // Remove the client from the list of subscribers.
-                            subscribers.erase(client_id);
-                        }
-
-                        // Update the topic's subscribers with the new list.
-                        topic_clients[sub_msg->topic] = subscribers;
-                    }
-
-                    // Send unsubscribe success to the client.
-                    flag = 0;
-                    rc = (int) send(i, &flag, 1, 0);
-                    DIE(rc < 0, "unsubscribe send");
-                }
-
-                // Type is 1, client wants to subscribe.
-                if (sub_msg->type == 1) {
-
-                    // Check if the topic has any subscribers.
-                    if (topic_clients.find(sub_msg->topic) != topic_clients.end()) {
-
-                        // Get the subscribed clients to the topic.
-                        auto subscribers = topic_clients[sub_msg->topic];
-
-                        // Find the client's ID in the subscribers vector.
-                        auto client_id = find(subscribers.begin(), subscribers.end(), socket_id[i]);
-
-                        // If the client is not subscribed, add it to the list of subscribers.
-                        if (client_id == subscribers.end()) {
-                            subscribers.push_back(socket_id[i]);
-                        }
-
-                        // Update the topic's subscribers with the new list.
-                        topic_clients[sub_msg->topic] = subscribers;
-                    }
-                    else {
-                        // Topic does not have any subscribers, create a new list.
-                        vector<string> subscribers;
-                        // Add the client to the new list of subscribers.
-                        subscribers.push_back(socket_id[i]);
-
-                        // Convert the topic's name to string.
-                        auto string_topic = string(sub_msg->topic);
-                        // Add the new topic and list of subscribers to the topic_clients map.
-                        topic_clients.insert(make_pair(string_topic, subscribers));
-                    }
-
-                    // Handle SF.
-                    if (sub_msg->sf == SF_ENABLED) {
-
-                        // Check if the client has other SF enabled topics.
-                        if (sf_client_topics.find(socket_id[i]) != sf_client_topics.end()) {
-
-                            // Client has other SF enabled topics, get the list.
-                            auto topics = sf_client_topics[socket_id[i]];
-                            // Add the new topic.
-                            auto string_topic = string(sub_msg->topic);
-                            topics.push_back(string_topic);
-                            // Update the list of SF enabled topics.
-                            sf_client_topics[socket_id[i]] = topics;
-                        }
-                        else {
-
-                            // Client doesn't have any other sf enabled topics.
-                            vector<string> topics;
-                            // Add the new topic.
-                            auto string_topic = string(sub_msg->topic);
-                            topics.push_back(string_topic);
-                            // Update the list of SF enabled topics.
-                            sf_client_topics[socket_id[i]] = topics;
-                        }
-                    }
-
-                    // Send subscribe success to client.
-                    flag = 1;
-                    rc = (int) send(i, &flag, 1, 0);
-                    DIE(rc < 0, "subscribe send");
-
-                }
+    // Convert port number to int.
+    int port = stoi(argv[1]);
+    DIE(port == 0, "port");
+
+    // Every client takes a descriptor, allow as many as the hard limit.
+    struct rlimit limit{};
+    rc = getrlimit(RLIMIT_NOFILE, &limit);
+    DIE(rc < 0, "getrlimit");
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+
+    // Set up UDP socket.
+    int udp_socket = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    DIE(udp_socket < 0, "udp socket");
+
+    // Fill the details on what destination port should the
+    // datagrams have to be sent to our process.
+    auto *udp_addr = new sockaddr_in;
+    memset((char *) udp_addr, 0, sizeof(struct sockaddr_in));
+
+    // Populate the fields.
+    udp_addr->sin_family = AF_INET;
+    udp_addr->sin_addr.s_addr = INADDR_ANY;
+    udp_addr->sin_port = htons(port);
+
+    // Bind the socket with the address.
+    rc = bind(udp_socket, (const struct sockaddr *) udp_addr, sizeof(struct sockaddr_in));
+    DIE(rc < 0, "udp bind");
+
+    // Set up TCP socket.
+    int tcp_socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    DIE(tcp_socket < 0, "tcp socket");
+
+    // Fill the details on what destination port should the
+    // datagrams have to be sent to our process.
+    auto *tcp_addr = new sockaddr_in;
+    memset((char *) tcp_addr, 0, sizeof(struct sockaddr_in));
+
+    // Populate the fields.
+    tcp_addr->sin_family = AF_INET;
+    tcp_addr->sin_addr.s_addr = INADDR_ANY;
+    tcp_addr->sin_port = htons(port);
+
+    // Bind the socket with the address.
+    rc = bind(tcp_socket, (struct sockaddr *)tcp_addr, sizeof(struct sockaddr));
+    DIE(rc < 0, "tcp bind");
+
+    // Clients connecting in bursts wait in the backlog until accepted.
+    rc = listen(tcp_socket, SOMAXCONN);
+    DIE(rc < 0, "listen");
+
+    // Disable Nagle's algorithm.
+    flag = 1;
+    rc = setsockopt(tcp_socket, IPPROTO_TCP, TCP_NODELAY, (const void*) &flag, sizeof(int));
+    DIE(rc < 0, "nagle");
+
+    // Set up the epoll instance. A wakeup only reports the sockets that are
+    // ready, so its cost does not depend on the number of clients.
+    epoll_fd = epoll_create1(0);
+    DIE(epoll_fd < 0, "epoll_create1");
+
+    // The UDP and listening sockets are edge-triggered and drained on every event.
+    handler udp_handler{udp_socket, [udp_socket](uint32_t) { handle_udp(udp_socket); }, false};
+    watch(&udp_handler, EPOLLIN | EPOLLET);
+
+    handler tcp_handler{tcp_socket, [tcp_socket](uint32_t) { handle_listen(tcp_socket); }, false};
+    watch(&tcp_handler, EPOLLIN | EPOLLET);
+
+    // Stdin stays blocking and level-triggered, it is read once per event.
+    // A regular file cannot be watched, and has no commands to wait for.
+    handler stdin_handler{STDIN_FILENO, nullptr, false};
+    stdin_handler.on_events = [&stdin_handler](uint32_t) { handle_stdin(&stdin_handler); };
+
+    struct epoll_event stdin_event{};
+    stdin_event.events = EPOLLIN;
+    stdin_event.data.ptr = &stdin_handler;
+    rc = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, STDIN_FILENO, &stdin_event);
+    DIE(rc < 0 && errno != EPERM, "epoll_ctl");
+
+    // Setup complete, start the infinite loop.
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+
+    while (loop) {
+
+        // Wait for any file descriptor to be ready.
+        int count = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, -1);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        DIE(count < 0, "epoll_wait");
+
+        // Handle every ready file descriptor.
+        for (int i = 0; i < count && loop; i++) {
+
+            auto *h = (handler *) events[i].data.ptr;
+
+            // Skip the connections closed by an earlier event of this batch.
+            if (!h->closed) {
+                h->on_events(events[i].events);
             }
         }
+
+        // No more events refer to the closed connections.
+        for (auto conn : closed_connections) {
+            delete conn;
+        }
+        closed_connections.clear();
     }
 
     // Close the server's udp and tcp sockets.
     close(udp_socket);
     close(tcp_socket);
+    close(epoll_fd);
 
     return 0;
-}
\ No newline at end of file
+}
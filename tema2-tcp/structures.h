@@ -1,9 +1,11 @@
 #define MAX_CLIENT_ID_LENGTH 10
-#define MAX_CLIENTS 128
+#define MAX_EPOLL_EVENTS 1024
 #define MAX_UDP_MSG_SIZE 1552
 #define MAX_TOPIC_NAME_LENGTH 51
 #define MAX_UDP_PAYLOAD_SIZE 1500
 #define MAX_TCP_PAYLOAD_SIZE 1601
+#define MAX_QUEUED_MSGS 1024
+#define MAX_CACHED_TOPICS 65536
 #define SF_ENABLED 1
 #define SF_DISABLED 0
 